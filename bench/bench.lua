@@ -0,0 +1,372 @@
+#!/usr/bin/env lua
+---------------------------------------------------------------------
+-- LuaLDAP benchmarks.
+-- Measures the throughput of searches (entries and bytes per second
+-- read through the search iterator) for several sizes of entries,
+-- and the throughput and latency of add, modify, compare, rename,
+-- delete and bind, with sequential and pipelined requests.
+-- The entries are created below ou=lualdap-bench,<base> and deleted
+-- at the end.  The results are written as JSON and compared against
+-- a baseline.
+--
+-- See Copyright Notice in license.md
+---------------------------------------------------------------------
+
+local getenv = require("os").getenv
+
+local lualdap = assert(require("lualdap"))
+
+local URI = assert(getenv("LDAP_URI"))
+local BASE = assert(getenv("LDAP_BASE_DN"))
+local BIND_DN = assert(getenv("LDAP_BIND_DN"))
+local PASSWORD = assert(getenv("LDAP_BIND_PASSWORD"))
+local WHO = assert(getenv("LDAP_TEST_DN"))
+local WHO_PASSWORD = assert(getenv("LDAP_TEST_PASSWORD"))
+
+local usage = [[
+usage: bench.lua [-o output.json] [-b baseline.json] [-n count] [-e entries]
+                 [-r repeat] [-w window] [-t threshold]
+  -o  file where the results are written (default: standard output)
+  -b  results to compare with
+  -n  number of each operation (default: 10000)
+  -e  number of entries of each search (default: 1000)
+  -r  number of times each search is repeated (default: 10)
+  -w  number of requests in progress in the pipelined variants (default: 32)
+  -t  change in percent reported as a regression (default: 10)
+]]
+
+local params = { n = 10000, e = 1000, r = 10, w = 32, t = 10 }
+do
+	local i = 1
+	local arg = arg or {}
+	while i <= #arg do
+		local opt, value = arg[i]:match("^%-(%a)$"), arg[i + 1]
+		if not opt or value == nil then
+			io.stderr:write(usage)
+			os.exit(2)
+		end
+		if opt == "o" or opt == "b" then
+			params[opt] = value
+		elseif params[opt] and tonumber(value) then
+			params[opt] = tonumber(value)
+		else
+			io.stderr:write(usage)
+			os.exit(2)
+		end
+		i = i + 2
+	end
+end
+
+-- Directory strings of inetOrgPerson holding the generated values.
+local ATTRS = {
+	"description", "title", "ou", "l", "st", "street", "givenName",
+	"businessCategory", "departmentNumber", "employeeType", "initials",
+	"carLicense", "roomNumber", "physicalDeliveryOfficeName",
+	"postOfficeBox", "postalCode",
+}
+
+-- Shapes of the searched entries: number of attributes and size of their values.
+local SHAPES = {
+	{ attrs = 1, size = 32 },
+	{ attrs = 4, size = 32 },
+	{ attrs = 16, size = 32 },
+	{ attrs = 4, size = 256 },
+	{ attrs = 4, size = 4096 },
+	{ attrs = 16, size = 1024 },
+}
+
+local ROOT = "ou=lualdap-bench," .. BASE
+
+---------------------------------------------------------------------
+-- JSON
+---------------------------------------------------------------------
+
+local function encode(value, indent)
+	indent = indent or ""
+	if type(value) == "table" then
+		local keys = {}
+		for k in pairs(value) do
+			keys[#keys + 1] = k
+		end
+		table.sort(keys)
+		local inner = indent .. "  "
+		local fields = {}
+		for _, k in ipairs(keys) do
+			fields[#fields + 1] = inner .. string.format("%q", k) .. ": " .. encode(value[k], inner)
+		end
+		return "{\n" .. table.concat(fields, ",\n") .. "\n" .. indent .. "}"
+	elseif type(value) == "number" then
+		if value >= 100 then
+			return string.format("%.0f", value)
+		end
+		return string.format("%.4g", value)
+	end
+	return string.format("%q", tostring(value))
+end
+
+-- Decodes the objects, strings and numbers written by encode.
+local function decode(text)
+	local pos = 1
+	local function skip()
+		pos = text:find("%S", pos) or #text + 1
+	end
+	local function value()
+		skip()
+		local c = text:sub(pos, pos)
+		if c == "{" then
+			local t = {}
+			pos = pos + 1
+			skip()
+			if text:sub(pos, pos) == "}" then
+				pos = pos + 1
+				return t
+			end
+			repeat
+				local k = value()
+				skip()
+				assert(text:sub(pos, pos) == ":", "bad JSON: ':' expected at " .. pos)
+				pos = pos + 1
+				t[k] = value()
+				skip()
+				c = text:sub(pos, pos)
+				pos = pos + 1
+			until c ~= ","
+			assert(c == "}", "bad JSON: '}' expected at " .. pos)
+			return t
+		elseif c == '"' then
+			local s, e = text:find('^"[^"\\]*"', pos)
+			assert(s, "bad JSON: unsupported string at " .. pos)
+			pos = e + 1
+			return text:sub(s + 1, e - 1)
+		end
+		local s, e = text:find("^-?[%d.]+[eE]?[-+]?%d*", pos)
+		assert(s, "bad JSON: unexpected character at " .. pos)
+		pos = e + 1
+		return tonumber(text:sub(s, e))
+	end
+	return value()
+end
+
+---------------------------------------------------------------------
+-- Measures
+---------------------------------------------------------------------
+
+local ld = assert(lualdap.open_simple(URI, BIND_DN, PASSWORD))
+
+local records = {}
+ld:on_operation(function(event, record)
+	if event == "done" then
+		records[#records + 1] = record
+	end
+end)
+
+local function percentile(sorted, p)
+	local i = math.ceil(#sorted * p / 100)
+	return sorted[math.max(i, 1)]
+end
+
+-- Summarizes the operations recorded since records was emptied.
+local function summary()
+	local first, last, latencies = math.huge, -math.huge, {}
+	for i, r in ipairs(records) do
+		first = math.min(first, r.start)
+		last = math.max(last, r.finish)
+		latencies[i] = (r.finish - r.start) * 1000
+	end
+	table.sort(latencies)
+	local elapsed = last - first
+	return {
+		count = #records,
+		seconds = elapsed,
+		ops_per_sec = #records / elapsed,
+		p50_ms = percentile(latencies, 50),
+		p99_ms = percentile(latencies, 99),
+	}
+end
+
+-- Sends n requests, send(i) returning the function which reads the result,
+-- with at most window requests in progress.
+local function pipeline(n, window, send)
+	local pending, head = {}, 1
+	for i = 1, n do
+		pending[i] = assert(send(i))
+		if i - head + 1 >= window then
+			assert(pending[head]())
+			pending[head] = nil
+			head = head + 1
+		end
+	end
+	for i = head, n do
+		assert(pending[i]())
+		pending[i] = nil
+	end
+end
+
+local function value(i, j, size)
+	local s = i .. "-" .. j .. "-"
+	return s .. string.rep("x", size - #s)
+end
+
+local function entry(cn, nattrs, size)
+	local attrs = {
+		objectClass = { "top", "person", "organizationalPerson", "inetOrgPerson" },
+		cn = cn,
+		sn = cn,
+	}
+	for j = 1, nattrs do
+		attrs[ATTRS[j]] = value(cn, j, size)
+	end
+	return attrs
+end
+
+local results = {
+	server = URI,
+	lua = _VERSION,
+	version = lualdap._VERSION,
+	parameters = { n = params.n, e = params.e, r = params.r, w = params.w },
+	search = {},
+	operations = {},
+}
+
+local function cleanup()
+	local removed = ld:delete_tree(ROOT, { parallel = params.w })
+	if type(removed) == "function" then
+		removed()
+	end
+end
+
+cleanup()
+assert(ld:add(ROOT, { objectClass = { "top", "organizationalUnit" }, ou = "lualdap-bench" })())
+
+-- Searches: entries and bytes per second through the search iterator.
+for _, shape in ipairs(SHAPES) do
+	local name = string.format("a%d-s%d", shape.attrs, shape.size)
+	local parent = "ou=" .. name .. "," .. ROOT
+	assert(ld:add(parent, { objectClass = { "top", "organizationalUnit" }, ou = name })())
+	pipeline(params.e, params.w, function(i)
+		return ld:add("cn=" .. i .. "," .. parent, entry(tostring(i), shape.attrs, shape.size))
+	end)
+
+	ld:stats(true)
+	records = {}
+	local entries = 0
+	for _ = 1, params.r do
+		for _, attrs in ld:search { base = parent, scope = "onelevel", filter = "(objectClass=person)" } do
+			assert(attrs.sn)
+			entries = entries + 1
+		end
+	end
+	local elapsed = 0
+	for _, r in ipairs(records) do
+		elapsed = elapsed + (r.finish - r.start)
+	end
+	local bytes = ld:stats().bytes_in
+	results.search[name] = {
+		entries = entries,
+		seconds = elapsed,
+		entries_per_sec = entries / elapsed,
+		bytes_per_sec = bytes > 0 and bytes / elapsed or nil,
+	}
+end
+
+-- Operations on n entries, sequential then pipelined.
+local OPS = {
+	{ "add", function(dn, i)
+		return ld:add(dn, entry(tostring(i), 1, 32))
+	end },
+	{ "modify", function(dn, i)
+		return ld:modify(dn, { "=", description = value(i, 2, 32) })
+	end },
+	{ "compare", function(dn, i)
+		return ld:compare(dn, "description", value(i, 2, 32))
+	end },
+	{ "rename", function(dn, i)
+		return ld:rename(dn, "cn=r" .. i, nil, 1)
+	end, function(parent, i)
+		return "cn=r" .. i .. "," .. parent
+	end },
+	{ "delete", function(dn)
+		return ld:delete(dn)
+	end },
+}
+
+for _, variant in ipairs { "sequential", "pipelined" } do
+	local parent = "ou=" .. variant .. "," .. ROOT
+	assert(ld:add(parent, { objectClass = { "top", "organizationalUnit" }, ou = variant })())
+	local window = variant == "sequential" and 1 or params.w
+	local dn = function(i)
+		return "cn=" .. i .. "," .. parent
+	end
+	for _, op in ipairs(OPS) do
+		local name, send, renamed = op[1], op[2], op[3]
+		records = {}
+		pipeline(params.n, window, function(i)
+			return send(dn(i), i)
+		end)
+		results.operations[name] = results.operations[name] or {}
+		results.operations[name][variant] = summary()
+		if renamed then
+			dn = function(i)
+				return renamed(parent, i)
+			end
+		end
+	end
+end
+
+-- Binds cannot be pipelined: only the sequential variant is measured.
+records = {}
+for _ = 1, params.n do
+	assert(ld:bind_simple(WHO, WHO_PASSWORD))
+end
+results.operations.bind = { sequential = summary() }
+assert(ld:bind_simple(BIND_DN, PASSWORD))
+
+ld:on_operation(nil)
+cleanup()
+ld:close()
+
+---------------------------------------------------------------------
+-- Output and comparison
+---------------------------------------------------------------------
+
+local json = encode(results) .. "\n"
+if params.o then
+	local f = assert(io.open(params.o, "w"))
+	f:write(json)
+	f:close()
+else
+	io.write(json)
+end
+
+if params.b then
+	local f = io.open(params.b)
+	if not f then
+		io.stderr:write("no baseline ", params.b, "\n")
+		os.exit(0)
+	end
+	local baseline = decode(f:read("*a"))
+	f:close()
+
+	local lines = {}
+	local function compare(path, new, old)
+		for k, v in pairs(new) do
+			local name = path == "" and k or path .. "." .. k
+			if type(v) == "table" and type(old[k]) == "table" then
+				compare(name, v, old[k])
+			elseif type(v) == "number" and type(old[k]) == "number" and old[k] > 0 then
+				local higher = k:match("_per_sec$")
+				local lower = k:match("_ms$")
+				if higher or lower then
+					local change = (v - old[k]) / old[k] * 100
+					local worse = higher and -change or change
+					lines[#lines + 1] = string.format("%-48s %12.6g %12.6g %+7.1f%%%s",
+						name, old[k], v, change, worse > params.t and "  REGRESSION" or "")
+				end
+			end
+		end
+	end
+	compare("", results, baseline)
+	table.sort(lines)
+	io.stderr:write(string.format("%-48s %12s %12s %8s\n", "metric", "baseline", "current", "change"))
+	io.stderr:write(table.concat(lines, "\n"), "\n")
+end
@@ -3,11 +3,22 @@
 ** See Copyright Notice in license.md
 */
 
+#include <ctype.h>
+#include <stddef.h>
+#include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #ifdef WIN32
 #include <Winsock2.h>
 #else
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/socket.h>
 #include <sys/time.h>
 #endif
 
@@ -17,6 +28,16 @@
 #include <ldap.h>
 #endif
 
+/* Cyrus SASL is needed by the mechanisms other than EXTERNAL */
+#if !defined(LUALDAP_SASL) && defined(__has_include)
+#if __has_include(<sasl/sasl.h>)
+#define LUALDAP_SASL
+#endif
+#endif
+#if defined(LUALDAP_SASL) && !defined(WINLDAP)
+#include <sasl/sasl.h>
+#endif
+
 #include <lua.h>
 #include <lauxlib.h>
 
@@ -45,6 +66,17 @@ typedef const char * ldap_pchar_t;
 #define LUALDAP_TABLENAME "lualdap"
 #define LUALDAP_CONNECTION_METATABLE "LuaLDAP connection"
 #define LUALDAP_SEARCH_METATABLE "LuaLDAP search"
+#define LUALDAP_FUTURE_METATABLE "LuaLDAP future"
+#define LUALDAP_POOL_METATABLE "LuaLDAP pool"
+#define LUALDAP_ROUTER_METATABLE "LuaLDAP router"
+#define LUALDAP_SHARED_METATABLE "LuaLDAP shared pool"
+#define LUALDAP_TLS_METATABLE "LuaLDAP TLS context"
+#define LUALDAP_AUTH_METATABLE "LuaLDAP authenticator"
+#define LUALDAP_DECODER_METATABLE "LuaLDAP decoder"
+#define LUALDAP_OBJECTS "LuaLDAP objects"
+#define LUALDAP_RETIRED "LuaLDAP retired counters"
+#define LUALDAP_DEBUG_SINK "LuaLDAP debug sink"
+#define LUALDAP_HEALTH "LuaLDAP host health"
 
 #define LUALDAP_MOD_ADD (LDAP_MOD_ADD | LDAP_MOD_BVALUES)
 #define LUALDAP_MOD_DEL (LDAP_MOD_DELETE | LDAP_MOD_BVALUES)
@@ -66,11 +98,153 @@ typedef const char * ldap_pchar_t;
 #define LUALDAP_MAX_VALUES (LUALDAP_ARRAY_VALUES_SIZE / 2)
 #endif
 
+/* Maximum number of controls attached to an operation */
+#ifndef LUALDAP_MAX_CONTROLS
+#define LUALDAP_MAX_CONTROLS 8
+#endif
+
+/* LDAP transactions (RFC 5805) */
+#ifndef LDAP_EXOP_TXN_START
+#define LDAP_EXOP_TXN_START "1.3.6.1.1.21.1"
+#endif
+#ifndef LDAP_CONTROL_TXN_SPEC
+#define LDAP_CONTROL_TXN_SPEC "1.3.6.1.1.21.2"
+#endif
+#ifndef LDAP_EXOP_TXN_END
+#define LDAP_EXOP_TXN_END "1.3.6.1.1.21.3"
+#endif
+
+/* Who am I? extended operation (RFC 4532) */
+#ifndef LDAP_EXOP_WHO_AM_I
+#define LDAP_EXOP_WHO_AM_I "1.3.6.1.4.1.4203.1.11.3"
+#endif
+
+/* Proxied authorization control (RFC 4370) */
+#ifndef LDAP_CONTROL_PROXY_AUTHZ
+#define LDAP_CONTROL_PROXY_AUTHZ "2.16.840.1.113730.3.4.18"
+#endif
+
+/* Tree delete control */
+#ifndef LUALDAP_CONTROL_TREE_DELETE
+#define LUALDAP_CONTROL_TREE_DELETE "1.2.840.113556.1.4.805"
+#endif
+
+/* Number of entries per page when enumerating a subtree */
+#ifndef LUALDAP_PAGE_SIZE
+#define LUALDAP_PAGE_SIZE 1000
+#endif
+
+/* Maximum number of pipelined delete requests of delete_tree */
+#ifndef LUALDAP_MAX_PARALLEL
+#define LUALDAP_MAX_PARALLEL LUALDAP_PAGE_SIZE
+#endif
+
+/* Maximum number of connection attempts raced in parallel */
+#ifndef LUALDAP_MAX_RACE
+#define LUALDAP_MAX_RACE 16
+#endif
+
+/* Default time during which a host which could not be reached is tried last */
+#ifndef LUALDAP_COOLDOWN
+#define LUALDAP_COOLDOWN 30.0
+#endif
+
+/* Number of buckets of the latency histograms (powers of two of microseconds) */
+#ifndef LUALDAP_HIST_BUCKETS
+#define LUALDAP_HIST_BUCKETS 32
+#endif
+
+/* Greatest result code counted on its own by the statistics */
+#define LUALDAP_MAX_RESULT_CODE 127
+
+/* Operations counted by the statistics of a connection */
+#define LUALDAP_OP_ADD     0
+#define LUALDAP_OP_BIND    1
+#define LUALDAP_OP_COMPARE 2
+#define LUALDAP_OP_DELETE  3
+#define LUALDAP_OP_EXTENDED 4
+#define LUALDAP_OP_MODIFY  5
+#define LUALDAP_OP_RENAME  6
+#define LUALDAP_OP_SEARCH  7
+#define LUALDAP_NOPS       8
+
+/* Maximum number of connections of an authenticator */
+#ifndef LUALDAP_MAX_AUTH_CONNECTIONS
+#define LUALDAP_MAX_AUTH_CONNECTIONS 64
+#endif
+
+/* Size of the buffer of the debug output waiting for the sink of set_debug */
+#ifndef LUALDAP_DEBUG_BUFFER
+#define LUALDAP_DEBUG_BUFFER 65536
+#endif
+
+
+struct shared_pool;
+
+
+/* Statistics of an operation type */
+typedef struct {
+	unsigned long count;     /* completed operations */
+	unsigned long errors;    /* operations which failed */
+	double        time;      /* total latency (seconds) */
+	unsigned long hist[LUALDAP_HIST_BUCKETS]; /* latencies by power of two of microseconds */
+} op_stats;
+
+
+/* Statistics of a connection */
+typedef struct {
+	op_stats      ops[LUALDAP_NOPS];
+	unsigned long results[LUALDAP_MAX_RESULT_CODE + 2]; /* result codes of failures (the last one counts the others) */
+	unsigned long entries;   /* search entries returned */
+	unsigned long bytes_in;  /* bytes of LDAP messages received */
+	unsigned long bytes_out; /* bytes of LDAP messages sent */
+} stats_data;
+
+
+/* Totals of the connections and pools of a Lua state */
+typedef struct {
+	stats_data    stats;
+	unsigned long conns;      /* open connections */
+	unsigned long pending;    /* operations waiting for their results */
+	unsigned long reconnects;
+	unsigned long idle;       /* idle connections of the pools */
+	unsigned long lent;       /* lent connections of the pools */
+	unsigned long max;        /* maximum size of the pools */
+	unsigned long gets;
+	unsigned long exhausted;
+	double        get_time;
+} metrics_data;
+
+
+/* Reporting of the slow operations of a connection */
+typedef struct {
+	int           sink;      /* reference to the function reporting them */
+	double        threshold; /* minimum latency of a slow operation (seconds) */
+	double        sample;    /* fraction of the slow operations reported */
+	double        credit;    /* accumulated fraction (one is reported at 1) */
+} slowlog_data;
+
 
 /* LDAP connection information */
 typedef struct {
-	int        version; /* LDAP version */
-	LDAP      *ld;      /* LDAP connection */
+	int        version;    /* LDAP version */
+	LDAP      *ld;         /* LDAP connection */
+	BerValue  *txn;        /* identifier of the transaction in progress */
+	int        params;     /* reference to the parameters of the connection */
+	int        reconnect;  /* reconnect automatically when the server is lost */
+	unsigned   generation; /* number of reconnections */
+	int       *msgids;     /* requests waiting for their results */
+	int        pending;    /* number of them */
+	int        maxpending; /* size of msgids */
+	struct shared_pool *lender; /* shared pool the LDAP connection is borrowed from */
+	stats_data stats;      /* operation statistics */
+	int        result;     /* result code of the last operation */
+	int        hook;       /* reference to the function called on operations */
+	slowlog_data slowlog;  /* reporting of slow operations */
+	int        tree_delete; /* server advertises the tree delete control (-1 when not known yet) */
+#if !defined(WIN32)
+	pid_t      pid;        /* process which opened the LDAP connection */
+#endif
 } conn_data;
 
 
@@ -78,22 +252,253 @@ typedef struct {
 typedef struct {
 	int      conn;        /* conn_data reference */
 	int      msgid;
+	int      spec;        /* search specification reference (to be replayed) */
+	int      entries;     /* number of entries already returned */
+	unsigned generation;  /* generation of the connection of the request */
+	double   start;       /* time the request was sent */
+	double   first;       /* time the first response was received (0 before) */
+	int      record;      /* reference to the record of the operation hook */
 } search_data;
 
 
+/* Requests whose results are read by a function returned by an operation */
+typedef struct {
+	int      conn;        /* conn_data reference (LUA_NOREF once the results are read) */
+	unsigned generation;  /* generation of the connection of the requests */
+	int      reads;       /* boolean: requests abandoned when their results are dropped */
+	int      n;           /* number of requests */
+	int      msgids[1];
+} future_data;
+
+
+/* Pool of LDAP connections */
+typedef struct {
+	int        params;       /* reference to the connection parameters */
+	int        idle;         /* reference to the stack of idle connections */
+	int        since;        /* reference to the idle times of the connections */
+	int        lent;         /* reference to the set of lent connections */
+	int        nidle;        /* number of idle connections */
+	int        min;          /* number of connections kept open */
+	int        max;          /* maximum number of connections */
+	double     idle_timeout; /* idle time after which a connection is closed */
+	double     probe_after;  /* idle time after which a connection is probed */
+	unsigned long gets;      /* number of calls to get */
+	unsigned long exhausted; /* number of them which found the pool exhausted */
+	double     get_time;     /* total time spent in get (seconds) */
+} pool_data;
+
+
+/* TLS context shared by connections */
+typedef struct {
+	void      *ctx;          /* TLS library context (NULL when not created) */
+	int        require_cert; /* checking of the server certificate */
+} tls_data;
+
+
+#if !defined(WIN32)
+/* Process-wide pool of LDAP connections, shared by every Lua state */
+typedef struct shared_pool {
+	char      *name;
+	char      *uri;
+	char      *who;
+	char      *password;
+	int        use_tls;
+	double     timeout;
+	int        race;         /* see connect_options */
+	double     cooldown;
+	tls_data   tls;          /* TLS context (ctx is NULL for none) */
+	char      *settings;     /* parameters of the pool, compared on attach */
+	int        max;          /* maximum number of connections */
+	int        size;         /* number of open connections */
+	LDAP     **idle;         /* idle connections (max of them) */
+	int        nidle;        /* number of idle connections */
+	pthread_mutex_t lock;    /* protects size, idle and nidle */
+	pthread_cond_t  available; /* signaled when a connection is given back */
+	unsigned long gets;      /* number of borrowed connections */
+	unsigned long exhausted; /* number of gets which timed out */
+	double     wait;         /* total time waited for a connection (seconds) */
+	pid_t      pid;          /* process which opened the idle connections */
+	struct shared_pool *next;
+} shared_pool;
+
+
+/* Handle of a process-wide pool in a Lua state */
+typedef struct {
+	shared_pool *pool;
+} shared_data;
+#endif
+
+
+/* Options of the connection to a server */
+typedef struct {
+	int        race;         /* number of hosts raced (0 for none, -1 for all) */
+	double     cooldown;     /* time unreachable hosts are tried last */
+	tls_data  *tls;          /* TLS context (or NULL) */
+} connect_options;
+
+
+#if !defined(WIN32)
+/* Connection attempt of a race between the hosts of a connection */
+typedef struct {
+	int        host;      /* stack index of the URI of the host */
+} race_attempt;
+#endif
+
+
+/* Types of the values of connection options */
+#define LUALDAP_OPT_INT    0
+#define LUALDAP_OPT_BOOL   1
+#define LUALDAP_OPT_ENUM   2
+#define LUALDAP_OPT_TIME   3
+#define LUALDAP_OPT_STRING 4
+
+
+/* Option of the LDAP connections */
+typedef struct {
+	const char        *name;
+	int                option;   /* LDAP_OPT_* */
+	int                type;     /* LUALDAP_OPT_* */
+	const char *const *names;    /* names of the values of an enumeration */
+	const int         *values;
+	int                tls;      /* is read when a TLS context is created */
+} conn_option;
+
+
+/* Connection of an authenticator */
+typedef struct {
+	int        msgid;        /* message id of the bind in progress (0 when idle) */
+	int        box;          /* reference to the table of its check */
+	double     start;        /* time the bind was sent */
+} auth_slot;
+
+
+/* Engine checking credentials with pipelined binds */
+typedef struct {
+	int        conns;        /* reference to the array of connections */
+	int        n;            /* number of connections */
+	int        next;         /* next connection to use (round-robin) */
+	auth_slot  slots[LUALDAP_MAX_AUTH_CONNECTIONS];
+} auth_data;
+
+
+/* Routing of operations between a provider and its replicas */
+typedef struct {
+	int        provider;     /* reference to the provider connection */
+	int        replicas;     /* reference to the array of replica connections */
+	int        n;            /* number of replicas */
+	int        next;         /* last replica chosen (round-robin) */
+	int        least;        /* choose the replica with the fewest pending operations */
+	double     window;       /* time reads go to the provider after a write */
+	double     last_write;   /* time of the last write */
+} router_data;
+
+
+/* Method of a router */
+typedef struct {
+	const char    *name;
+	lua_CFunction  func;     /* connection method */
+	int            write;    /* is sent to the provider */
+} router_method;
+
+
+#if defined(LUALDAP_SASL) && !defined(WINLDAP)
+/* Answers to the prompts of a SASL mechanism */
+typedef struct {
+	const char *authcid;    /* authentication identity */
+	const char *password;
+	const char *realm;
+	const char *authzid;    /* authorization identity */
+} sasl_data;
+#endif
+
+
 /* LDAP attribute modification structure */
 typedef struct {
 	LDAPMod   *attrs[LUALDAP_MAX_ATTRS + 1];
 	LDAPMod    mods[LUALDAP_MAX_ATTRS];
 	int        ai;
-	BerValue  *values[LUALDAP_ARRAY_VALUES_SIZE];
+	BerValue **values;     /* vals, or the buffer of A_reserve */
 	int        vi;
-	BerValue   bvals[LUALDAP_MAX_VALUES];
+	int        maxvi;
+	BerValue  *bvals;      /* bvs, or the buffer of A_reserve */
 	int        bi;
+	int        maxbi;
+	BerValue  *vals[LUALDAP_ARRAY_VALUES_SIZE];
+	BerValue   bvs[LUALDAP_MAX_VALUES];
 } attrs_data;
 
 
+/* List of values of a modification which is split in chunks */
+typedef struct {
+	int         param;  /* stack index of the table of operations */
+	const char *name;   /* attribute's name */
+	int         op;     /* LDAP_MOD operation code */
+	int         n;      /* number of values */
+} chunk_data;
+
+
+/* Hash set of attribute values */
+typedef struct {
+	BerValue  *vals;    /* values indexed by the set */
+	int       *slots;   /* index + 1 of the values (0 when empty) */
+	unsigned   mask;    /* number of slots - 1 */
+} bvset_data;
+
+
+/* Entry of a subtree to be deleted */
+typedef struct {
+	char      *dn;
+	int        depth;   /* number of RDNs */
+} tree_entry;
+
+
+/* Entries of a subtree to be deleted */
+typedef struct {
+	tree_entry *entries;
+	size_t      n;
+	size_t      size;
+} tree_data;
+
+
+/* Delete operation in progress on a subtree */
+typedef struct {
+	conn_data *conn;
+	int        msgid;
+	size_t     entry;
+	double     start;
+} tree_op;
+
+
+/* LDAP request controls structure */
+typedef struct {
+	LDAPControl *ctrls[LUALDAP_MAX_CONTROLS + 1];
+	int          ci;
+} ctrls_data;
+
+
 int luaopen_lualdap (lua_State *L);
+#if !defined(WINLDAP)
+int luaopen_lualdap_codec (lua_State *L);
+#endif
+#if !defined(WIN32)
+static void conn_check_fork (lua_State *L, conn_data *conn);
+#else
+#define conn_check_fork(L, conn) ((void)0)
+#endif
+
+
+/*
+** Get a monotonic time in seconds.
+*/
+static double monotonic (void) {
+#if defined(WIN32)
+	return (double)GetTickCount64 () / 1000.0;
+#else
+	struct timespec ts;
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+#endif
+}
 
 
 /*
@@ -106,16 +511,169 @@ static int faildirect (lua_State *L, const char *errmsg) {
 }
 
 
+#if !defined(WIN32)
+/*
+** Debug output of the LDAP library, kept until it is delivered to the sink
+** of set_debug by a Lua state (the library may print it from any thread,
+** holding its own locks, so the sink is not called from there).
+*/
+static pthread_mutex_t debug_lock = PTHREAD_MUTEX_INITIALIZER;
+static char debug_buf[LUALDAP_DEBUG_BUFFER];
+static size_t debug_len = 0;
+static unsigned long debug_dropped = 0; /* lines dropped since the last delivery */
+static double debug_rate = 0.0;         /* maximum number of lines per second */
+static double debug_window = 0.0;       /* start of the current second */
+static double debug_lines = 0.0;        /* lines kept in the current second */
+static int debug_sink = 0;              /* 1 when a Lua sink is set, -1 for stderr */
+static unsigned debug_owner = 0;        /* set_debug call of the sink */
+static volatile int debug_pending = 0;  /* output is waiting */
+
+
+/*
+** Print function of the LDAP library (LBER_OPT_LOG_PRINT_FN).
+*/
+static void debug_print (const char *line) {
+	size_t len = strlen (line);
+	double now;
+	if (debug_sink < 0) {
+		fputs (line, stderr);
+		fflush (stderr);
+		return;
+	}
+	now = monotonic ();
+	pthread_mutex_lock (&debug_lock);
+	if (now - debug_window >= 1.0) {
+		debug_window = now;
+		debug_lines = 0.0;
+	}
+	if (debug_sink == 0 || (debug_rate > 0.0 && debug_lines >= debug_rate)
+		|| debug_len + len > sizeof(debug_buf))
+		debug_dropped++;
+	else {
+		memcpy (debug_buf + debug_len, line, len);
+		debug_len += len;
+		debug_lines += 1.0;
+	}
+	debug_pending = 1;
+	pthread_mutex_unlock (&debug_lock);
+}
+
+
+/*
+** Call the sink of set_debug with a line, in protected mode.
+** @return 0 or 1 when the sink raised an error, pushed on the stack unless
+**	an error is already there.
+*/
+static int debug_deliver (lua_State *L, int sink, int failed) {
+	lua_getfield (L, sink, "func");
+	lua_insert (L, -2);
+	if (lua_pcall (L, 1, 0, 0) == 0)
+		return failed;
+	if (failed) /* keep the first error */
+		lua_pop (L, 1);
+	else
+		lua_replace (L, sink - 1);
+	return 1;
+}
+
+
+/*
+** Deliver the debug output waiting in the buffer to the sink of set_debug,
+** when it was set by this Lua state, line by line.
+** The buffer is emptied before the sink is called and all the lines are
+** delivered even if the sink raises errors.
+** @return 0 or 1 when the sink raised an error, whose message is pushed.
+*/
+static int debug_flush (lua_State *L) {
+	char *copy = NULL;
+	const char *text;
+	size_t len = 0, start = 0, i;
+	unsigned long dropped;
+	int sink, failed = 0;
+	if (!debug_pending)
+		return 0;
+	lua_pushnil (L); /* room for an error message */
+	lua_getfield (L, LUA_REGISTRYINDEX, LUALDAP_DEBUG_SINK);
+	sink = lua_gettop (L);
+	lua_getfield (L, sink, "owner");
+	if (!lua_isnumber (L, -1) || (unsigned)lua_tonumber (L, -1) != debug_owner) {
+		lua_settop (L, sink - 2);
+		return 0;
+	}
+	/* no Lua error may be raised while the lock is held */
+	pthread_mutex_lock (&debug_lock);
+	if (debug_len > 0 && (copy = (char *)malloc (debug_len)) != NULL) {
+		memcpy (copy, debug_buf, debug_len);
+		len = debug_len;
+	} else
+		debug_dropped += (debug_len > 0);
+	dropped = debug_dropped;
+	debug_len = 0;
+	debug_dropped = 0;
+	debug_pending = 0;
+	pthread_mutex_unlock (&debug_lock);
+	lua_pushlstring (L, copy, len);
+	free (copy);
+	text = lua_tostring (L, -1);
+	for (i = 0; i < len; i++)
+		if (text[i] == '\n' || i == len - 1) {
+			size_t end = (text[i] == '\n') ? i : len;
+			lua_pushlstring (L, text + start, end - start);
+			failed = debug_deliver (L, sink, failed);
+			start = i + 1;
+		}
+	if (dropped > 0) {
+		lua_pushfstring (L, LUALDAP_PREFIX"%d lines of debug output dropped", (int)dropped);
+		failed = debug_deliver (L, sink, failed);
+	}
+	lua_settop (L, sink - 1 - !failed);
+	return failed;
+}
+#endif
+
+
 /*
 ** Get a connection object from the first stack position.
+** The debug output is delivered first: the sink may close the connection.
 */
 static conn_data *getconnection (lua_State *L) {
 	conn_data *conn = (conn_data *)luaL_checkudata (L, 1, LUALDAP_CONNECTION_METATABLE);
+#if !defined(WIN32)
+	if (debug_flush (L)) /* the errors of the sink are reported by flush_debug only */
+		lua_pop (L, 1);
+#endif
+	conn_check_fork (L, conn);
 	luaL_argcheck(L, conn->ld, 1, LUALDAP_PREFIX"LDAP connection is closed");
 	return conn;
 }
 
 
+/*
+** Get the userdata at the given index if it has the given metatable
+** (NULL otherwise).
+*/
+static void *toudata (lua_State *L, int idx, const char *tname) {
+	void *p = lua_touserdata (L, idx);
+	int ok;
+	if (p == NULL || !lua_getmetatable (L, idx))
+		return NULL;
+	luaL_getmetatable (L, tname);
+	ok = lua_rawequal (L, -1, -2);
+	lua_pop (L, 2);
+	return ok ? p : NULL;
+}
+
+
+/*
+** Get a connection object from the given stack position
+** (NULL when there is no open connection at that position).
+*/
+static conn_data *toconnection (lua_State *L, int idx) {
+	conn_data *conn = (conn_data *)toudata (L, idx, LUALDAP_CONNECTION_METATABLE);
+	return (conn != NULL && conn->ld != NULL) ? conn : NULL;
+}
+
+
 /*
 ** Get a search object from the first upvalue position.
 */
@@ -136,11 +694,10 @@ static int option_error (lua_State *L, const char *name, const char *type) {
 
 
 /*
-** Get the field named name as a string.
-** The table MUST be at position 2.
+** Get the field named name of the table at position tab as a string.
 */
-static const char *strtabparam (lua_State *L, const char *name, char *def) {
-	lua_getfield(L, 2, name);
+static const char *strtabparam (lua_State *L, int tab, const char *name, char *def) {
+	lua_getfield(L, tab, name);
 	if (lua_isnil (L, -1))
 		return def;
 	else if (lua_isstring (L, -1))
@@ -153,11 +710,10 @@ static const char *strtabparam (lua_State *L, const char *name, char *def) {
 
 
 /*
-** Get the field named name as an integer.
-** The table MUST be at position 2.
+** Get the field named name of the table at position tab as an integer.
 */
-static long longtabparam (lua_State *L, const char *name, int def) {
-	lua_getfield(L, 2, name);
+static long longtabparam (lua_State *L, int tab, const char *name, int def) {
+	lua_getfield(L, tab, name);
 	if (lua_isnil (L, -1))
 		return def;
 	else if (lua_isnumber (L, -1))
@@ -168,11 +724,10 @@ static long longtabparam (lua_State *L, const char *name, int def) {
 
 
 /*
-** Get the field named name as a double.
-** The table MUST be at position 2.
+** Get the field named name of the table at position tab as a double.
 */
-static double numbertabparam (lua_State *L, const char *name, double def) {
-	lua_getfield(L, 2, name);
+static double numbertabparam (lua_State *L, int tab, const char *name, double def) {
+	lua_getfield(L, tab, name);
 	if (lua_isnil (L, -1))
 		return def;
 	else if (lua_isnumber (L, -1))
@@ -183,11 +738,10 @@ static double numbertabparam (lua_State *L, const char *name, double def) {
 
 
 /*
-** Get the field named name as a boolean.
-** The table MUST be at position 2.
+** Get the field named name of the table at position tab as a boolean.
 */
-static int booltabparam (lua_State *L, const char *name, int def) {
-	lua_getfield(L, 2, name);
+static int booltabparam (lua_State *L, int tab, const char *name, int def) {
+	lua_getfield(L, tab, name);
 	if (lua_isnil (L, -1))
 		return def;
 	else if (lua_isboolean (L, -1))
@@ -212,9 +766,30 @@ static void value_error (lua_State *L, const char *name) {
 static void A_init (attrs_data *attrs) {
 	attrs->ai = 0;
 	attrs->attrs[0] = NULL;
+	attrs->values = attrs->vals;
 	attrs->vi = 0;
+	attrs->maxvi = LUALDAP_ARRAY_VALUES_SIZE;
 	attrs->values[0] = NULL;
+	attrs->bvals = attrs->bvs;
 	attrs->bi = 0;
+	attrs->maxbi = LUALDAP_MAX_VALUES;
+}
+
+
+/*
+** Make room for n values (and the attributes holding them) when the arrays
+** of the structure are too small: the buffer is a userdata left on the stack.
+*/
+static void A_reserve (lua_State *L, attrs_data *a, int n) {
+	if (n > LUALDAP_MAX_VALUES) {
+		int maxvi = n + LUALDAP_MAX_ATTRS;
+		char *buf = (char *)lua_newuserdata (L, maxvi * sizeof(BerValue *) + n * sizeof(BerValue));
+		a->values = (BerValue **)buf;
+		a->maxvi = maxvi;
+		a->values[0] = NULL;
+		a->bvals = (BerValue *)(buf + maxvi * sizeof(BerValue *));
+		a->maxbi = n;
+	}
 }
 
 
@@ -225,7 +800,7 @@ static void A_init (attrs_data *attrs) {
 static BerValue *A_setbval (lua_State *L, attrs_data *a, const char *n) {
 	size_t len;
 	BerValue *ret = &(a->bvals[a->bi]);
-	if (a->bi >= LUALDAP_MAX_VALUES) {
+	if (a->bi >= a->maxbi) {
 		luaL_error (L, LUALDAP_PREFIX"too many values");
 		return NULL;
 	} else if (!lua_isstring (L, -1)) {
@@ -244,7 +819,7 @@ static BerValue *A_setbval (lua_State *L, attrs_data *a, const char *n) {
 */
 static BerValue **A_setval (lua_State *L, attrs_data *a, const char *n) {
 	BerValue **ret = &(a->values[a->vi]);
-	if (a->vi >= LUALDAP_ARRAY_VALUES_SIZE) {
+	if (a->vi >= a->maxvi) {
 		luaL_error (L, LUALDAP_PREFIX"too many values");
 		return NULL;
 	}
@@ -259,7 +834,7 @@ static BerValue **A_setval (lua_State *L, attrs_data *a, const char *n) {
 */
 static BerValue **A_nullval (lua_State *L, attrs_data *a) {
 	BerValue **ret = &(a->values[a->vi]);
-	if (a->vi >= LUALDAP_ARRAY_VALUES_SIZE) {
+	if (a->vi >= a->maxvi) {
 		luaL_error (L, LUALDAP_PREFIX"too many values");
 		return NULL;
 	}
@@ -289,8 +864,8 @@ static BerValue **A_tab2val (lua_State *L, attrs_data *a, const char *name) {
 		for (i = 1; i <= n; i++) {
 			lua_rawgeti (L, tab, i); /* push table element */
 			A_setval (L, a, name);
+			lua_pop (L, 1); /* the string is kept by the table */
 		}
-		lua_pop (L, n);
 	} else {
 		value_error (L, name);
 		return NULL;
@@ -333,224 +908,5815 @@ static void A_tab2mod (lua_State *L, attrs_data *a, int tab, int op) {
 
 
 /*
-** Terminate the array of attributes.
+** Set a modification with the values first..last of the list
+** (which MUST be on top of the stack).
 */
-static void A_lastattr (lua_State *L, attrs_data *a) {
+static void A_setmodrange (lua_State *L, attrs_data *a, int op, const char *name, int first, int last) {
+	int i;
 	if (a->ai >= LUALDAP_MAX_ATTRS) {
 		luaL_error (L, LUALDAP_PREFIX"too many attributes");
 		return;
 	}
-	a->attrs[a->ai] = NULL;
+	a->mods[a->ai].mod_op = op;
+	a->mods[a->ai].mod_type = (char *)name;
+	a->mods[a->ai].mod_bvalues = &(a->values[a->vi]);
+	for (i = first; i <= last; i++) {
+		lua_rawgeti (L, -1, i); /* push table element */
+		A_setval (L, a, name);
+		lua_pop (L, 1);
+	}
+	A_nullval (L, a);
+	a->attrs[a->ai] = &a->mods[a->ai];
 	a->ai++;
 }
 
 
 /*
-** Get the result message of an operation.
-** #1 upvalue == connection
-** #2 upvalue == msgid
-** #3 upvalue == result code of the message (ADD, DEL etc.) to be received.
+** Convert a Lua table into an array of modifications, keeping only
+** the first chunk of the lists of values longer than the chunk size.
+** The lists of values of replace operations are never split.
+** The split lists are recorded on the chunks array.
 */
-static int result_message (lua_State *L) {
-	struct timeval *timeout = NULL; /* ??? function parameter ??? */
-	LDAPMessage *res;
-	int rc;
-	conn_data *conn = (conn_data *)lua_touserdata (L, lua_upvalueindex (1));
-	int msgid = (int)lua_tonumber (L, lua_upvalueindex (2));
-	/*int res_code = (int)lua_tonumber (L, lua_upvalueindex (3));*/
-
-	luaL_argcheck (L, conn->ld, 1, LUALDAP_PREFIX"LDAP connection is closed");
-	rc = ldap_result (conn->ld, msgid, LDAP_MSG_ONE, timeout, &res);
-	if (rc == 0)
-		return faildirect (L, LUALDAP_PREFIX"result timeout expired");
-	else if (rc < 0) {
-		ldap_msgfree (res);
-		return faildirect (L, LUALDAP_PREFIX"result error");
-	} else {
-		int err, ret = 1;
-		char *mdn, *msg;
-		rc = ldap_parse_result (conn->ld, res, &err, &mdn, &msg, NULL, NULL, 1);
-		if (rc != LDAP_SUCCESS)
-			return faildirect (L, ldap_err2string (rc));
-		switch (err) {
-			case LDAP_SUCCESS:
-			case LDAP_COMPARE_TRUE:
-				lua_pushboolean (L, 1);
-				break;
-			case LDAP_COMPARE_FALSE:
-				lua_pushboolean (L, 0);
-				break;
-			default:
-				lua_pushnil (L);
-				lua_pushliteral (L, LUALDAP_PREFIX);
-				lua_pushstring (L, ldap_err2string(err));
-				lua_concat (L, 2);
-				if (msg != NULL) {
-					lua_pushliteral (L, " (");
-					lua_pushstring (L, msg);
-					lua_pushliteral (L, ")");
-					lua_concat (L, 4);
-				}
-				ret = 2;
+static void A_tab2chunks (lua_State *L, attrs_data *a, int tab, int op, int chunk, chunk_data *chunks, int *nchunks) {
+	lua_pushnil (L); /* first key for lua_next */
+	while (lua_next (L, tab) != 0) {
+		/* attribute must be a string and not a number */
+		if ((!lua_isnumber (L, -2)) && (lua_isstring (L, -2))) {
+			const char *name = lua_tostring (L, -2);
+			int n = lua_istable (L, -1) ? (int)lua_rawlen (L, -1) : 0;
+			if (op != LUALDAP_MOD_REP && n > chunk) {
+				if (*nchunks >= LUALDAP_MAX_ATTRS)
+					luaL_error (L, LUALDAP_PREFIX"too many attributes");
+				chunks[*nchunks].param = tab;
+				chunks[*nchunks].name = name;
+				chunks[*nchunks].op = op;
+				chunks[*nchunks].n = n;
+				(*nchunks)++;
+				A_setmodrange (L, a, op, name, 1, chunk);
+			} else
+				A_setmod (L, a, op, name);
 		}
-		ldap_memfree (mdn);
-		ldap_memfree (msg);
-		return ret;
+		/* pop value and leave last key on the stack as next key for lua_next */
+		lua_pop (L, 1);
 	}
 }
 
 
 /*
-** Push a function to process the LDAP result.
+** Count the values of a table of modifications sent in the first request
+** when the lists of values are split in chunks (see A_tab2chunks).
 */
-static int create_future (lua_State *L, ldap_int_t rc, int conn, ldap_int_t msgid, int code) {
-	if (rc != LDAP_SUCCESS)
-		return faildirect (L, ldap_err2string (rc));
-	lua_pushvalue (L, conn); /* push connection as #1 upvalue */
-	lua_pushnumber (L, msgid); /* push msgid as #2 upvalue */
-	lua_pushnumber (L, code); /* push code as #3 upvalue */
-	lua_pushcclosure (L, result_message, 3);
-	return 1;
+static int A_countchunks (lua_State *L, int tab, int op, int chunk) {
+	int count = 0;
+	lua_pushnil (L); /* first key for lua_next */
+	while (lua_next (L, tab) != 0) {
+		if (lua_istable (L, -1)) {
+			int n = (int)lua_rawlen (L, -1);
+			count += (op != LUALDAP_MOD_REP && n > chunk) ? chunk : n;
+		} else
+			count++;
+		lua_pop (L, 1);
+	}
+	return count;
 }
 
+
 /*
-** Unbind from the directory.
-** @param #1 LDAP connection.
-** @return 1 in case of success; nothing when already closed.
+** Terminate the array of attributes.
 */
-static int lualdap_close (lua_State *L) {
-	conn_data *conn = (conn_data *)luaL_checkudata (L, 1, LUALDAP_CONNECTION_METATABLE);
-	if (conn->ld == NULL) /* already closed */
-		return 0;
-#if defined(LDAP_API_FEATURE_X_OPENLDAP) && LDAP_API_FEATURE_X_OPENLDAP >= 20300
-	ldap_unbind_ext (conn->ld, NULL, NULL);
-#else
-	ldap_unbind (conn->ld);
-#endif
-	conn->ld = NULL;
-	lua_pushnumber (L, 1);
-	return 1;
+static void A_lastattr (lua_State *L, attrs_data *a) {
+	if (a->ai >= LUALDAP_MAX_ATTRS) {
+		luaL_error (L, LUALDAP_PREFIX"too many attributes");
+		return;
+	}
+	a->attrs[a->ai] = NULL;
+	a->ai++;
 }
 
 
+/* Names of the fields accepted on a table of options */
+static const char *const option_names[] = { "assert", "authzid", "chunk", NULL };
+
+
 /*
-** Bind to the directory.
-** @param #1 LDAP connection.
-** @param #2 String with username.
-** @param #3 String with password.
-** @return LDAP connection on success.
+** Initialize controls structure.
 */
-static int lualdap_bind_simple (lua_State *L) {
-	conn_data *conn = getconnection (L);
-	ldap_pchar_t who = (ldap_pchar_t) luaL_checkstring (L, 2);
-	const char *password = luaL_checkstring (L, 3);
-	int err;
+static void C_init (ctrls_data *c) {
+	c->ci = 0;
+	c->ctrls[0] = NULL;
+}
+
+
+/*
+** Append a control to the controls structure.
+** The structure takes ownership of the control.
+*/
+static int C_add (ctrls_data *c, LDAPControl *ctrl) {
+	if (c->ci >= LUALDAP_MAX_CONTROLS) {
+		ldap_control_free (ctrl);
+		return LDAP_PARAM_ERROR;
+	}
+	c->ctrls[c->ci] = ctrl;
+	c->ci++;
+	c->ctrls[c->ci] = NULL;
+	return LDAP_SUCCESS;
+}
+
+
+/*
+** Get the NULL-terminated array of controls (NULL when there is none).
+*/
+static LDAPControl **C_array (ctrls_data *c) {
+	return (c->ci == 0) ? NULL : c->ctrls;
+}
+
+
+/*
+** Release the controls.
+*/
+static void C_free (ctrls_data *c) {
+	int i;
+	for (i = 0; i < c->ci; i++)
+		ldap_control_free (c->ctrls[i]);
+	C_init (c);
+}
+
+
+/*
+** Check whether the table at the given index is a table of options,
+** that is, a non-empty table whose keys are all option names.
+*/
+static int is_options (lua_State *L, int tab) {
+	int found = 0;
+	lua_pushnil (L); /* first key for lua_next */
+	while (lua_next (L, tab) != 0) {
+		int i = 0;
+		if (lua_type (L, -2) == LUA_TSTRING) {
+			const char *key = lua_tostring (L, -2);
+			while (option_names[i] != NULL && strcmp (option_names[i], key) != 0)
+				i++;
+		} else
+			i = -1;
+		lua_pop (L, 1); /* pop value */
+		if (i < 0 || option_names[i] == NULL) {
+			lua_pop (L, 1); /* pop key */
+			return 0;
+		}
+		found = 1;
+	}
+	return found;
+}
+
+
+/*
+** Build the request controls according to the table of options
+** at the given index (which may be absent or 0).
+** Valid options are:
+**	assert => filter for the assertion control (RFC 4528);
+**	authzid => authorization identity of the proxied authorization
+**		control (RFC 4370).
+** The transaction specification control is added to updates when a
+** transaction is in progress on the connection.
+** @param update Boolean indicating if the request is an update.
+** @return LDAP_SUCCESS or an LDAP error code.
+*/
+static int get_ctrls_param (lua_State *L, conn_data *conn, int tab, ctrls_data *c, int update) {
+	const char *assertion = NULL, *authzid = NULL;
+	int rc = LDAP_SUCCESS;
+	C_init (c);
+	if (tab != 0 && !lua_isnoneornil (L, tab)) {
+		luaL_checktype (L, tab, LUA_TTABLE);
+		/* read every option before allocating any control */
+		lua_getfield (L, tab, "assert");
+		if (lua_isstring (L, -1))
+			assertion = lua_tostring (L, -1);
+		else if (!lua_isnil (L, -1))
+			return option_error (L, "assert", "string");
+		lua_getfield (L, tab, "authzid");
+		if (lua_isstring (L, -1))
+			authzid = lua_tostring (L, -1);
+		else if (!lua_isnil (L, -1))
+			return option_error (L, "authzid", "string");
+	}
+
+	if (assertion != NULL) {
+#if defined(LDAP_CONTROL_ASSERT) && !defined(WINLDAP)
+		LDAPControl *ctrl;
+		rc = ldap_create_assertion_control (conn->ld, (char *)assertion, 1, &ctrl);
+		if (rc == LDAP_SUCCESS)
+			rc = C_add (c, ctrl);
+#else
+		rc = LDAP_NOT_SUPPORTED;
+#endif
+	}
+	if (rc == LDAP_SUCCESS && authzid != NULL) {
+#if !defined(WINLDAP)
+		LDAPControl *ctrl;
+		BerValue value; /* the control value is the authzId itself */
+		value.bv_val = (char *)authzid;
+		value.bv_len = strlen (authzid);
+		rc = ldap_control_create (LDAP_CONTROL_PROXY_AUTHZ, 1, &value, 1, &ctrl);
+		if (rc == LDAP_SUCCESS)
+			rc = C_add (c, ctrl);
+#else
+		rc = LDAP_NOT_SUPPORTED;
+#endif
+	}
+#if !defined(WINLDAP)
+	if (rc == LDAP_SUCCESS && update && conn->txn != NULL) {
+		LDAPControl *ctrl;
+		rc = ldap_control_create (LDAP_CONTROL_TXN_SPEC, 1, conn->txn, 1, &ctrl);
+		if (rc == LDAP_SUCCESS)
+			rc = C_add (c, ctrl);
+	}
+#endif
+	if (rc != LDAP_SUCCESS)
+		C_free (c);
+	return rc;
+}
+
+
+/*
+** Get the result code of the last failed libldap call.
+*/
+static int ld_errno (LDAP *ld) {
+	int err = LDAP_OTHER;
+	ldap_get_option (ld, LDAP_OPT_RESULT_CODE, &err);
+	return err;
+}
+
+
+#if !defined(WINLDAP)
+/*
+** Sockbuf IO layer counting the bytes of the LDAP messages of a connection
+** (above TLS, if any).
+*/
+static int stats_io_setup (Sockbuf_IO_Desc *sbiod, void *arg) {
+	sbiod->sbiod_pvt = arg;
+	return 0;
+}
+
+
+static int stats_io_remove (Sockbuf_IO_Desc *sbiod) {
+	sbiod->sbiod_pvt = NULL;
+	return 0;
+}
+
+
+static int stats_io_ctrl (Sockbuf_IO_Desc *sbiod, int opt, void *arg) {
+	return LBER_SBIOD_CTRL_NEXT (sbiod, opt, arg);
+}
+
+
+static ber_slen_t stats_io_read (Sockbuf_IO_Desc *sbiod, void *buf, ber_len_t len) {
+	ber_slen_t n = LBER_SBIOD_READ_NEXT (sbiod, buf, len);
+	if (n > 0)
+		((stats_data *)sbiod->sbiod_pvt)->bytes_in += (unsigned long)n;
+	return n;
+}
+
+
+static ber_slen_t stats_io_write (Sockbuf_IO_Desc *sbiod, void *buf, ber_len_t len) {
+	ber_slen_t n = LBER_SBIOD_WRITE_NEXT (sbiod, buf, len);
+	if (n > 0)
+		((stats_data *)sbiod->sbiod_pvt)->bytes_out += (unsigned long)n;
+	return n;
+}
+
+
+static int stats_io_close (Sockbuf_IO_Desc *sbiod) {
+	(void)sbiod;
+	return 0;
+}
+
+
+static Sockbuf_IO stats_io = {
+	stats_io_setup, stats_io_remove, stats_io_ctrl,
+	stats_io_read, stats_io_write, stats_io_close
+};
+#endif
+
+
+/*
+** Count the bytes of the LDAP connection in the statistics of the
+** connection object (again, when the LDAP connection changed hands).
+*/
+static void stats_attach (conn_data *conn) {
+#if !defined(WINLDAP)
+	Sockbuf *sb = NULL;
+	if (ldap_get_option (conn->ld, LDAP_OPT_SOCKBUF, &sb) == LDAP_OPT_SUCCESS && sb != NULL) {
+		ber_sockbuf_remove_io (sb, &stats_io, LBER_SBIOD_LEVEL_APPLICATION);
+		ber_sockbuf_add_io (sb, &stats_io, LBER_SBIOD_LEVEL_APPLICATION, &conn->stats);
+	}
+#else
+	(void)conn;
+#endif
+}
+
+
+/*
+** Stop counting the bytes of the LDAP connection, before it is handed over.
+*/
+static void stats_detach (conn_data *conn) {
+#if !defined(WINLDAP)
+	Sockbuf *sb = NULL;
+	if (ldap_get_option (conn->ld, LDAP_OPT_SOCKBUF, &sb) == LDAP_OPT_SUCCESS && sb != NULL)
+		ber_sockbuf_remove_io (sb, &stats_io, LBER_SBIOD_LEVEL_APPLICATION);
+#else
+	(void)conn;
+#endif
+}
+
+
+/*
+** Record the result code of an operation (failures are counted).
+*/
+static void stats_result (conn_data *conn, int code) {
+	conn->result = code;
+	if (code == LDAP_SUCCESS || code == LDAP_COMPARE_TRUE || code == LDAP_COMPARE_FALSE)
+		return;
+	if (code < 0 || code > LUALDAP_MAX_RESULT_CODE)
+		code = LUALDAP_MAX_RESULT_CODE + 1;
+	conn->stats.results[code]++;
+}
+
+
+/*
+** Count a completed operation and its latency.
+** @param op LUALDAP_OP_* (nothing is counted when negative).
+** @param start Time the request was sent.
+*/
+static void stats_op (conn_data *conn, int op, double start, int failed) {
+	op_stats *s;
+	double t = monotonic () - start;
+	double us = t * 1000000.0;
+	int b = 0;
+	if (op < 0)
+		return;
+	s = &conn->stats.ops[op];
+	while (b < LUALDAP_HIST_BUCKETS - 1 && us >= 2.0) {
+		us /= 2.0;
+		b++;
+	}
+	s->count++;
+	s->errors += (failed != 0);
+	s->time += t;
+	s->hist[b]++;
+}
+
+
+/*
+** Add statistics to others.
+*/
+static void stats_add (stats_data *t, const stats_data *s) {
+	int op, i;
+	for (op = 0; op < LUALDAP_NOPS; op++) {
+		t->ops[op].count += s->ops[op].count;
+		t->ops[op].errors += s->ops[op].errors;
+		t->ops[op].time += s->ops[op].time;
+		for (i = 0; i < LUALDAP_HIST_BUCKETS; i++)
+			t->ops[op].hist[i] += s->ops[op].hist[i];
+	}
+	for (i = 0; i <= LUALDAP_MAX_RESULT_CODE + 1; i++)
+		t->results[i] += s->results[i];
+	t->entries += s->entries;
+	t->bytes_in += s->bytes_in;
+	t->bytes_out += s->bytes_out;
+}
+
+
+/*
+** Get the counters kept for metrics_text when the statistics of a
+** connection are reset, or when a connection or pool is collected.
+** @return Counters (NULL when the module was not opened in this Lua state).
+*/
+static metrics_data *metrics_retired (lua_State *L) {
+	metrics_data *m;
+	lua_getfield (L, LUA_REGISTRYINDEX, LUALDAP_RETIRED);
+	m = (metrics_data *)lua_touserdata (L, -1);
+	lua_pop (L, 1);
+	return m;
+}
+
+
+/* Names of the operation types (LUALDAP_OP_*) */
+static const char *const op_names[LUALDAP_NOPS] = {
+	"add", "bind", "compare", "delete", "extended", "modify", "rename", "search"
+};
+
+
+/*
+** Get the operation type (LUALDAP_OP_*) of a result message type.
+*/
+static int res2op (int code) {
+	switch (code) {
+		case LDAP_RES_ADD: return LUALDAP_OP_ADD;
+		case LDAP_RES_COMPARE: return LUALDAP_OP_COMPARE;
+		case LDAP_RES_DELETE: return LUALDAP_OP_DELETE;
+		case LDAP_RES_EXTENDED: return LUALDAP_OP_EXTENDED;
+		case LDAP_RES_MODIFY: return LUALDAP_OP_MODIFY;
+		case LDAP_RES_MODDN: return LUALDAP_OP_RENAME;
+		default: return -1;
+	}
+}
+
+
+/*
+** Push the record of an operation for the hook and the slow operation log
+** of the connection, or nil when the connection has none of them.
+** @param dn Stack index of the DN of the operation (0 for none).
+** @param msgid Message id of the request (negative for none).
+** @return Boolean indicating if a record was pushed.
+*/
+static int hook_record (lua_State *L, conn_data *conn, int op, int dn, int msgid, double start) {
+	if ((conn->hook == LUA_NOREF && conn->slowlog.sink == LUA_NOREF) || op < 0) {
+		lua_pushnil (L);
+		return 0;
+	}
+	lua_newtable (L);
+	lua_pushstring (L, op_names[op]);
+	lua_setfield (L, -2, "op");
+	if (dn != 0) {
+		lua_pushvalue (L, dn);
+		lua_setfield (L, -2, "dn");
+	}
+	if (msgid >= 0) {
+		lua_pushinteger (L, msgid);
+		lua_setfield (L, -2, "msgid");
+	}
+	lua_pushnumber (L, start);
+	lua_setfield (L, -2, "start");
+	return 1;
+}
+
+
+/*
+** Call the hook of the connection (if any) with an event and the record of
+** an operation (left on the stack).
+** Errors of the hook are dropped: the result of the operation, already taken
+** from the library, must still reach the caller.
+*/
+static void hook_call (lua_State *L, conn_data *conn, const char *event, int record) {
+	if (conn->hook == LUA_NOREF)
+		return;
+	lua_pushvalue (L, record);
+	lua_rawgeti (L, LUA_REGISTRYINDEX, conn->hook);
+	lua_pushstring (L, event);
+	lua_pushvalue (L, -3);
+	if (lua_pcall (L, 2, 0, 0) != 0)
+		lua_pop (L, 1); /* error message */
+	lua_pop (L, 1);
+}
+
+
+/*
+** Report the completed operation of the given record to the slow operation
+** log of the connection when it took longer than the threshold (and it is
+** part of the sample).
+*/
+static void slowlog_report (lua_State *L, conn_data *conn, int record, double first, double finish) {
+	slowlog_data *slow = &conn->slowlog;
+	double start;
+	lua_getfield (L, record, "start");
+	start = lua_tonumber (L, -1);
+	lua_pop (L, 1);
+	if (finish - start < slow->threshold)
+		return;
+	slow->credit += slow->sample;
+	if (slow->credit < 1.0)
+		return;
+	slow->credit -= 1.0;
+	lua_pushnumber (L, first - start);
+	lua_setfield (L, record, "first_response");
+	lua_pushnumber (L, finish - start);
+	lua_setfield (L, record, "total");
+	lua_pushvalue (L, record);
+	lua_rawgeti (L, LUA_REGISTRYINDEX, slow->sink);
+	lua_pushvalue (L, -2);
+	if (lua_pcall (L, 1, 0, 0) != 0) /* dropped, as those of hook_call */
+		lua_pop (L, 1);
+	lua_pop (L, 1);
+}
+
+
+/*
+** Complete the record of an operation (when there is one) and call the hook
+** and the slow operation log of the connection with it.
+** @param first Time the first response was received (0 when it is the result).
+*/
+static void hook_done (lua_State *L, conn_data *conn, int record, int code, double first) {
+	double finish;
+	if (!lua_istable (L, record))
+		return;
+	finish = monotonic ();
+	if (first <= 0.0)
+		first = finish;
+	lua_pushinteger (L, code);
+	lua_setfield (L, record, "code");
+	lua_pushnumber (L, first);
+	lua_setfield (L, record, "first");
+	lua_pushnumber (L, finish);
+	lua_setfield (L, record, "finish");
+	hook_call (L, conn, "done", record);
+	if (conn->slowlog.sink != LUA_NOREF)
+		slowlog_report (L, conn, record, first, finish);
+}
+
+
+/*
+** Register the object on top of the stack for metrics_text.
+*/
+static void track_object (lua_State *L) {
+	lua_getfield (L, LUA_REGISTRYINDEX, LUALDAP_OBJECTS);
+	if (lua_istable (L, -1)) {
+		lua_pushvalue (L, -2);
+		lua_pushboolean (L, 1);
+		lua_rawset (L, -3);
+	}
+	lua_pop (L, 1);
+}
+
+
+/*
+** Create a connection object and leave it on top of the stack.
+*/
+static conn_data *create_connection (lua_State *L) {
+	conn_data *conn = (conn_data *)lua_newuserdata (L, sizeof(conn_data));
+	conn->version = 0;
+	conn->ld = NULL;
+	conn->txn = NULL;
+	conn->params = LUA_NOREF;
+	conn->reconnect = 0;
+	conn->generation = 0;
+	conn->msgids = NULL;
+	conn->pending = 0;
+	conn->maxpending = 0;
+	conn->lender = NULL;
+	memset (&conn->stats, 0, sizeof(conn->stats));
+	conn->result = LDAP_SUCCESS;
+	conn->hook = LUA_NOREF;
+	conn->slowlog.sink = LUA_NOREF;
+	conn->tree_delete = -1;
+#if !defined(WIN32)
+	conn->pid = getpid ();
+#endif
+	luaL_setmetatable (L, LUALDAP_CONNECTION_METATABLE);
+	track_object (L);
+	lua_newtable (L);
+	conn->params = luaL_ref (L, LUA_REGISTRYINDEX);
+	return conn;
+}
+
+
+/*
+** Register a request waiting for its result. A request which cannot be
+** registered is only left out of the count of pending operations.
+*/
+static void pending_add (conn_data *conn, int msgid) {
+	if (conn->pending == conn->maxpending) {
+		int max = (conn->maxpending > 0) ? 2 * conn->maxpending : 16;
+		int *msgids = (int *)realloc (conn->msgids, max * sizeof(int));
+		if (msgids == NULL)
+			return;
+		conn->msgids = msgids;
+		conn->maxpending = max;
+	}
+	conn->msgids[conn->pending++] = msgid;
+}
+
+
+/*
+** Unregister a request (the oldest ones come first).
+** @return 1 if the request was waiting for its result; 0 otherwise.
+*/
+static int pending_remove (conn_data *conn, int msgid) {
+	int i;
+	for (i = 0; i < conn->pending; i++)
+		if (conn->msgids[i] == msgid) {
+			conn->pending--;
+			memmove (conn->msgids + i, conn->msgids + i + 1, (conn->pending - i) * sizeof(int));
+			return 1;
+		}
+	return 0;
+}
+
+
+/*
+** Remember how a connection was opened, to be able to reopen it.
+*/
+static void conn_remember (lua_State *L, conn_data *conn, const char *uri, int use_tls, double timeout) {
+	lua_rawgeti (L, LUA_REGISTRYINDEX, conn->params);
+	lua_pushstring (L, uri);
+	lua_setfield (L, -2, "uri");
+	lua_pushboolean (L, use_tls);
+	lua_setfield (L, -2, "usetls");
+	lua_pushnumber (L, timeout);
+	lua_setfield (L, -2, "timeout");
+	lua_pop (L, 1);
+}
+
+
+/*
+** Remember the options of a connection (see get_connect_options).
+** @param tls Stack index of the TLS context (or nil).
+*/
+static void conn_remember_options (lua_State *L, conn_data *conn, const connect_options *opts, int tls) {
+	lua_rawgeti (L, LUA_REGISTRYINDEX, conn->params);
+	lua_pushnumber (L, opts->race);
+	lua_setfield (L, -2, "race");
+	lua_pushnumber (L, opts->cooldown);
+	lua_setfield (L, -2, "cooldown");
+	lua_pushvalue (L, tls);
+	lua_setfield (L, -2, "tls");
+	lua_pop (L, 1);
+}
+
+
+/*
+** Remember the credentials of a connection, to be able to bind it again.
+*/
+static void conn_remember_bind (lua_State *L, conn_data *conn, const char *who, const char *password) {
+	lua_rawgeti (L, LUA_REGISTRYINDEX, conn->params);
+	lua_pushstring (L, who);
+	lua_setfield (L, -2, "who");
+	lua_pushstring (L, password);
+	lua_setfield (L, -2, "password");
+	lua_pushnil (L);
+	lua_setfield (L, -2, "sasl");
+	lua_pop (L, 1);
+}
+
+
+#if !defined(WINLDAP)
+/*
+** Remember the SASL parameters of a connection (the table at position tab),
+** to be able to bind it again.
+*/
+static void conn_remember_sasl (lua_State *L, conn_data *conn, int tab) {
+	static const char *const names[] = {
+		"mech", "authcid", "password", "realm", "authzid", NULL
+	};
+	int i;
+	lua_rawgeti (L, LUA_REGISTRYINDEX, conn->params);
+	lua_newtable (L);
+	for (i = 0; names[i] != NULL; i++) {
+		lua_getfield (L, tab, names[i]);
+		lua_setfield (L, -2, names[i]);
+	}
+	lua_setfield (L, -2, "sasl");
+	lua_pushnil (L);
+	lua_setfield (L, -2, "who");
+	lua_pushnil (L);
+	lua_setfield (L, -2, "password");
+	lua_pop (L, 1);
+}
+#endif
+
+
+#if !defined(WIN32)
+/*
+** Detach an LDAP connection inherited from the parent process from the
+** socket it shares with it: the socket is replaced by /dev/null, so that
+** unbinding it sends nothing (not even a TLS alert) to the server.
+*/
+static void ld_orphan (LDAP *ld) {
+	int fd = -1, null;
+	if (ldap_get_option (ld, LDAP_OPT_DESC, &fd) == LDAP_OPT_SUCCESS && fd >= 0
+		&& (null = open ("/dev/null", O_RDWR)) >= 0) {
+		dup2 (null, fd);
+		close (null);
+	}
+}
+
+
+/* Process-wide pools */
+static pthread_mutex_t shared_pools_lock = PTHREAD_MUTEX_INITIALIZER;
+static shared_pool *shared_pools = NULL;
+
+
+/*
+** Give back a borrowed LDAP connection to its process-wide pool.
+** @param broken Boolean indicating that the connection must not be reused.
+*/
+static void shared_release (shared_pool *pool, LDAP *ld, int broken) {
+	if (broken)
+		ldap_unbind_ext (ld, NULL, NULL);
+	pthread_mutex_lock (&pool->lock);
+	if (broken)
+		pool->size--;
+	else
+		pool->idle[pool->nidle++] = ld;
+	pthread_cond_signal (&pool->available);
+	pthread_mutex_unlock (&pool->lock);
+}
+
+
+/*
+** Abandon the requests of a connection still waiting for their results,
+** dropping the messages already received for them, so that they do not
+** reach the next user of the LDAP connection.
+*/
+static void pending_abandon (conn_data *conn) {
+	struct timeval zero = {0, 0};
+	LDAPMessage *res;
+	int i;
+	for (i = 0; i < conn->pending; i++) {
+		if (ldap_result (conn->ld, conn->msgids[i], LDAP_MSG_RECEIVED, &zero, &res) > 0)
+			ldap_msgfree (res);
+		ldap_abandon_ext (conn->ld, conn->msgids[i], NULL, NULL);
+	}
+	conn->pending = 0;
+}
+#endif
+
+
+/*
+** Unbind the LDAP connection of a connection object, or give it back to the
+** process-wide pool it was borrowed from.
+** @param broken Boolean indicating that a borrowed connection must not be reused.
+*/
+static void conn_release (conn_data *conn, int broken) {
+#if !defined(WIN32)
+	int forked = (conn->pid != getpid ());
+	if (forked) /* the socket is shared with the parent process */
+		ld_orphan (conn->ld);
+#else
+	(void)broken;
+#endif
+	conn->txn = NULL; /* owned by the pending call to transaction */
+#if !defined(WIN32)
+	if (conn->lender != NULL) {
+		/* results of pending operations must not reach the next borrower */
+		if (!forked)
+			pending_abandon (conn);
+		stats_detach (conn);
+		shared_release (conn->lender, conn->ld, forked || broken);
+		conn->lender = NULL;
+		conn->ld = NULL;
+		conn->pending = 0;
+		return;
+	}
+#endif
 #if defined(LDAP_API_FEATURE_X_OPENLDAP) && LDAP_API_FEATURE_X_OPENLDAP >= 20300
-	struct berval *cred = ber_bvstrdup(password);
-	/* FIXME: According to `man 3 ldap_sasl_bind_s` we should pass `NULL` instead of `who`. */
-	err = ldap_sasl_bind_s (conn->ld, who, LDAP_SASL_SIMPLE, cred, NULL, NULL, NULL);
-	ber_bvfree(cred);
+	ldap_unbind_ext (conn->ld, NULL, NULL);
 #else
-	err = ldap_bind_s (conn->ld, who, password, LDAP_AUTH_SIMPLE);
+	ldap_unbind (conn->ld);
+#endif
+	conn->ld = NULL;
+	conn->pending = 0;
+}
+
+
+/*
+** Unbind the LDAP connection of a connection object.
+*/
+static void conn_close (conn_data *conn) {
+	conn_release (conn, 0);
+}
+
+
+/*
+** Simple bind of a connection object.
+** @return LDAP_SUCCESS or an LDAP error code.
+*/
+static int conn_bind (conn_data *conn, const char *who, const char *password) {
+	double start = monotonic ();
+	int err;
+#if defined(LDAP_API_FEATURE_X_OPENLDAP) && LDAP_API_FEATURE_X_OPENLDAP >= 20300
+	struct berval *cred = ber_bvstrdup(password);
+	/* FIXME: According to `man 3 ldap_sasl_bind_s` we should pass `NULL` instead of `who`. */
+	err = ldap_sasl_bind_s (conn->ld, who, LDAP_SASL_SIMPLE, cred, NULL, NULL, NULL);
+	ber_bvfree(cred);
+#else
+	err = ldap_bind_s (conn->ld, (ldap_pchar_t)who, (ldap_pchar_t)password, LDAP_AUTH_SIMPLE);
+#endif
+	stats_result (conn, err);
+	stats_op (conn, LUALDAP_OP_BIND, start, err != LDAP_SUCCESS);
+	return err;
+}
+
+
+/*
+** Check that a connection is still usable with a Who am I? extended
+** operation, the lightest round-trip: any answer of the server, even an
+** error, proves the connection alive.
+** @return LDAP_SUCCESS when the server answered or an LDAP error code.
+*/
+static int conn_probe (conn_data *conn, double timeout) {
+	struct timeval tv, *tvp = NULL;
+	LDAPMessage *res = NULL;
+	ldap_int_t msgid;
+	int rc;
+	if (timeout > 0.0) {
+		tv.tv_sec = (long)timeout;
+		tv.tv_usec = (long)(1000000.0 * (timeout - (double)tv.tv_sec));
+		tvp = &tv;
+	}
+	rc = ldap_extended_operation (conn->ld, LDAP_EXOP_WHO_AM_I, NULL, NULL, NULL, &msgid);
+	if (rc != LDAP_SUCCESS)
+		return rc;
+	rc = ldap_result (conn->ld, msgid, LDAP_MSG_ALL, tvp, &res);
+	if (rc == 0) {
+#if !defined(WINLDAP)
+		ldap_abandon_ext (conn->ld, msgid, NULL, NULL);
+#else
+		ldap_abandon (conn->ld, msgid);
+#endif
+		return LDAP_TIMEOUT;
+	} else if (rc < 0)
+		return ld_errno (conn->ld);
+	ldap_msgfree (res);
+	return LDAP_SUCCESS;
+}
+
+
+#if !defined(WINLDAP)
+#if defined(LUALDAP_SASL)
+/*
+** Answer the prompts of a SASL mechanism with the parameters of bind_sasl.
+*/
+static int sasl_interact (LDAP *ld, unsigned flags, void *defaults, void *in) {
+	sasl_data *sasl = (sasl_data *)defaults;
+	sasl_interact_t *interact = (sasl_interact_t *)in;
+	(void)ld;
+	(void)flags;
+	for (; interact->id != SASL_CB_LIST_END; interact++) {
+		const char *value;
+		switch (interact->id) {
+			case SASL_CB_AUTHNAME: value = sasl->authcid; break;
+			case SASL_CB_PASS: value = sasl->password; break;
+			case SASL_CB_GETREALM: value = sasl->realm; break;
+			case SASL_CB_USER: value = sasl->authzid; break;
+			default: value = NULL;
+		}
+		if (value == NULL)
+			value = (interact->defresult != NULL) ? interact->defresult : "";
+		interact->result = value;
+		interact->len = (unsigned)strlen (value);
+	}
+	return LDAP_SUCCESS;
+}
+#endif
+
+
+/*
+** SASL bind of a connection object with the parameters of the table at
+** position tab (mech, authcid, password, realm, authzid).
+** EXTERNAL, which takes its identity from the transport (the peer
+** credentials of ldapi:// or a TLS client certificate), needs no exchange
+** and is sent as is; the other mechanisms need Cyrus SASL.
+** @return LDAP_SUCCESS or an LDAP error code.
+*/
+static int conn_sasl (lua_State *L, conn_data *conn, int tab) {
+	const char *mech = strtabparam (L, tab, "mech", (char *)"EXTERNAL");
+	const char *authzid = strtabparam (L, tab, "authzid", NULL);
+	int err;
+	if (strcmp (mech, "EXTERNAL") == 0) {
+		BerValue cred; /* the initial response is the authorization identity */
+		cred.bv_val = (char *)((authzid != NULL) ? authzid : "");
+		cred.bv_len = strlen (cred.bv_val);
+		err = ldap_sasl_bind_s (conn->ld, NULL, mech, &cred, NULL, NULL, NULL);
+	} else {
+#if defined(LUALDAP_SASL)
+		sasl_data sasl;
+		sasl.authcid = strtabparam (L, tab, "authcid", NULL);
+		sasl.password = strtabparam (L, tab, "password", NULL);
+		sasl.realm = strtabparam (L, tab, "realm", NULL);
+		sasl.authzid = authzid;
+		err = ldap_sasl_interactive_bind_s (conn->ld, NULL, mech, NULL, NULL,
+			LDAP_SASL_QUIET, sasl_interact, &sasl);
+		lua_pop (L, 3);
+#else
+		err = LDAP_AUTH_METHOD_NOT_SUPPORTED;
+#endif
+	}
+	lua_pop (L, 2);
+	return err;
+}
+#endif
+
+
+/*
+** Push the URI of the given hosts and return it.
+** A blank-separated list of hosts (of the form host[:port]) is converted
+** into a list of LDAP URIs, which ldap_initialize tries one after another.
+** Hosts which are absolute paths are local sockets (ldapi:// URIs).
+*/
+static const char *push_uri (lua_State *L, const char *host) {
+#if defined(LDAP_API_FEATURE_X_OPENLDAP) && LDAP_API_FEATURE_X_OPENLDAP >= 20300
+	if (strstr (host, "://") == NULL) {
+		luaL_Buffer b;
+		int first = 1;
+		luaL_buffinit (L, &b);
+		for (;;) {
+			size_t len = 0;
+			while (isspace ((unsigned char)*host))
+				host++;
+			while (host[len] != '\0' && !isspace ((unsigned char)host[len]))
+				len++;
+			if (len == 0)
+				break;
+			if (!first)
+				luaL_addchar (&b, ' ');
+			if (*host == '/') {
+				size_t i;
+				luaL_addstring (&b, "ldapi://");
+				for (i = 0; i < len; i++) {
+					unsigned char c = (unsigned char)host[i];
+					if (isalnum (c) || strchr ("-._~", c) != NULL)
+						luaL_addchar (&b, (char)c);
+					else {
+						luaL_addchar (&b, '%');
+						luaL_addchar (&b, "0123456789ABCDEF"[c >> 4]);
+						luaL_addchar (&b, "0123456789ABCDEF"[c & 15]);
+					}
+				}
+			} else {
+				luaL_addstring (&b, "ldap://");
+				luaL_addlstring (&b, host, len);
+			}
+			host += len;
+			first = 0;
+		}
+		luaL_pushresult (&b);
+		return lua_tostring (L, -1);
+	}
+#endif
+	lua_pushstring (L, host);
+	return lua_tostring (L, -1);
+}
+
+
+#if !defined(WINLDAP)
+#if defined(LUALDAP_TLS_CTX_FREE)
+/*
+** Release a reference to a TLS context.
+** It is exported by libldap but declared in ldap_pvt.h, which is not installed:
+** the Makefile defines LUALDAP_TLS_CTX_FREE when it can be linked.
+** Without it, there is no public way to release the reference taken by
+** LDAP_OPT_X_TLS_CTX, so TLS contexts are never freed.
+*/
+extern void ldap_pvt_tls_ctx_free (void *ctx);
+#endif
+
+
+/* Values of the checking of the server certificate */
+static const char *const tls_check_names[] = {
+	"never", "hard", "demand", "allow", "try", NULL
+};
+static const int tls_check_values[] = {
+	LDAP_OPT_X_TLS_NEVER, LDAP_OPT_X_TLS_HARD, LDAP_OPT_X_TLS_DEMAND,
+	LDAP_OPT_X_TLS_ALLOW, LDAP_OPT_X_TLS_TRY
+};
+
+
+/*
+** Get a TLS context object from the given stack position
+** (NULL when there is no TLS context at that position).
+*/
+static tls_data *totls (lua_State *L, int idx) {
+	tls_data *tls = (tls_data *)lua_touserdata (L, idx);
+	int ok;
+	if (tls == NULL || !lua_getmetatable (L, idx))
+		return NULL;
+	luaL_getmetatable (L, LUALDAP_TLS_METATABLE);
+	ok = lua_rawequal (L, -1, -2);
+	lua_pop (L, 2);
+	return ok ? tls : NULL;
+}
+
+
+/*
+** Create a TLS context object from the settings of the table at position
+** tab and leave it on top of the stack.
+** Certificates are loaded once, when the context is created; connections
+** using the context share it instead of loading their own.
+** @return NULL on success or an error message.
+*/
+static const char *tls_new (lua_State *L, int tab) {
+	static const char *const names[] = {
+		"cacertfile", "cacertdir", "certfile", "keyfile", "ciphers", NULL
+	};
+	static const int options[] = {
+		LDAP_OPT_X_TLS_CACERTFILE, LDAP_OPT_X_TLS_CACERTDIR,
+		LDAP_OPT_X_TLS_CERTFILE, LDAP_OPT_X_TLS_KEYFILE,
+		LDAP_OPT_X_TLS_CIPHER_SUITE
+	};
+	const char *values[sizeof(options) / sizeof(options[0])];
+	const char *check, *errmsg = NULL;
+	int top = lua_gettop (L);
+	int is_server = 0, i;
+	tls_data *tls;
+	LDAP *ld;
+
+	/* Read the settings first: no error must be raised while ld is open */
+	for (i = 0; names[i] != NULL; i++)
+		values[i] = strtabparam (L, tab, names[i], NULL);
+	check = strtabparam (L, tab, "require_cert", (char *)"demand");
+	for (i = 0; tls_check_names[i] != NULL && strcmp (tls_check_names[i], check) != 0; i++)
+		;
+	if (tls_check_names[i] == NULL)
+		luaL_error (L, LUALDAP_PREFIX"invalid value on option `require_cert': %s", check);
+
+	tls = (tls_data *)lua_newuserdata (L, sizeof(tls_data));
+	tls->ctx = NULL;
+	tls->require_cert = tls_check_values[i];
+	luaL_setmetatable (L, LUALDAP_TLS_METATABLE);
+
+	/* The context is created by a handle which is not connected */
+	if (ldap_initialize (&ld, NULL) != LDAP_SUCCESS)
+		errmsg = LUALDAP_PREFIX"Error creating TLS context";
+	else {
+		if (ldap_set_option (ld, LDAP_OPT_X_TLS_REQUIRE_CERT, &tls->require_cert) != LDAP_OPT_SUCCESS)
+			errmsg = LUALDAP_PREFIX"Could not set TLS options";
+		for (i = 0; errmsg == NULL && names[i] != NULL; i++)
+			if (values[i] != NULL && ldap_set_option (ld, options[i], values[i]) != LDAP_OPT_SUCCESS)
+				errmsg = LUALDAP_PREFIX"Could not set TLS options";
+		if (errmsg == NULL && (ldap_set_option (ld, LDAP_OPT_X_TLS_NEWCTX, &is_server) != LDAP_OPT_SUCCESS
+			|| ldap_get_option (ld, LDAP_OPT_X_TLS_CTX, &tls->ctx) != LDAP_OPT_SUCCESS
+			|| tls->ctx == NULL))
+			errmsg = LUALDAP_PREFIX"Error creating TLS context";
+		ldap_unbind_ext (ld, NULL, NULL); /* the context keeps its own reference */
+	}
+	lua_replace (L, top + 1); /* keep only the context */
+	lua_settop (L, top + 1);
+	return errmsg;
+}
+#endif
+
+
+/*
+** Set the options of the LDAP connection of a connection object.
+** @param use_tls Boolean indicating if TLS must be used.
+** @param timeout Number for connection timeout (0 for none).
+** @param tls TLS context (or NULL).
+** @return NULL on success or an error message.
+*/
+static const char *conn_setup (conn_data *conn, int use_tls, double timeout, const tls_data *tls) {
+/* LDAP_OPT_TIMEOUT and LDAP_OPT_NETWORK_TIMEOUT are not supported by WinLDAP.
+ * WinLDAP does have LDAP_OPT_SEND_TIMEOUT; it is yet to be determined whether
+ * that would work as a connection timeout */
+#if !defined(WINLDAP)
+	/* Set timeout (optionally) */
+	if (timeout > 0.0) {
+		struct timeval optTimeout;
+		optTimeout.tv_sec = (long)timeout;
+		optTimeout.tv_usec = (long)(1000000.0 * (timeout - (double)optTimeout.tv_sec));
+		if (ldap_set_option (conn->ld, LDAP_OPT_TIMEOUT, &optTimeout) != LDAP_OPT_SUCCESS)
+			return LUALDAP_PREFIX"Could not set timeout";
+		if (ldap_set_option (conn->ld, LDAP_OPT_NETWORK_TIMEOUT, &optTimeout) != LDAP_OPT_SUCCESS)
+			return LUALDAP_PREFIX"Could not set network timeout";
+	}
+#else
+	(void)timeout;
+#endif
+	/* Set protocol version */
+	conn->version = LDAP_VERSION3;
+	if (ldap_set_option (conn->ld, LDAP_OPT_PROTOCOL_VERSION, &conn->version)
+		!= LDAP_OPT_SUCCESS)
+		return LUALDAP_PREFIX"Error setting LDAP version";
+	stats_attach (conn);
+#if !defined(WINLDAP)
+	/* Share the TLS context (also used by ldaps:// URIs) */
+	if (tls != NULL) {
+		if (ldap_set_option (conn->ld, LDAP_OPT_X_TLS_REQUIRE_CERT, &tls->require_cert) != LDAP_OPT_SUCCESS
+			|| ldap_set_option (conn->ld, LDAP_OPT_X_TLS_CTX, tls->ctx) != LDAP_OPT_SUCCESS)
+			return LUALDAP_PREFIX"Could not set TLS context";
+	}
+#else
+	(void)tls;
+#endif
+	/* Use TLS */
+	if (use_tls) {
+		int rc = ldap_start_tls_s (conn->ld, NULL, NULL);
+		if (rc != LDAP_SUCCESS)
+			return ldap_err2string (rc);
+	}
+	return NULL;
+}
+
+
+/*
+** Connect a connection object to a server.
+** @param uri String with the URI (see push_uri).
+** @param use_tls Boolean indicating if TLS must be used.
+** @param timeout Number for connection timeout (0 for none).
+** @param tls TLS context (or NULL).
+** @return NULL on success or an error message.
+*/
+static const char *conn_connect (conn_data *conn, const char *uri, int use_tls, double timeout, const tls_data *tls) {
+#if defined(LDAP_API_FEATURE_X_OPENLDAP) && LDAP_API_FEATURE_X_OPENLDAP >= 20300
+	if (ldap_initialize (&conn->ld, uri) != LDAP_SUCCESS)
+#else
+	conn->ld = ldap_init ((ldap_pchar_t)uri, LDAP_PORT);
+	if (conn->ld == NULL)
+#endif
+		return LUALDAP_PREFIX"Error connecting to server";
+	return conn_setup (conn, use_tls, timeout, tls);
+}
+
+
+#if !defined(WIN32)
+/*
+** Start the connection attempts to the addresses of a host.
+** @param idx Stack index of the URI of the host.
+** @return The new number of attempts.
+*/
+static int race_start (race_attempt *attempts, struct pollfd *fds, int n, LDAPURLDesc *lud, int idx) {
+	struct addrinfo hints, *res, *ai;
+	char service[16];
+	const char *host = (lud->lud_host != NULL && *lud->lud_host != '\0') ? lud->lud_host : "localhost";
+	memset (&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	sprintf (service, "%d", lud->lud_port > 0 ? lud->lud_port : LDAP_PORT);
+	if (getaddrinfo (host, service, &hints, &res) != 0)
+		return n;
+	for (ai = res; ai != NULL && n < LUALDAP_MAX_RACE; ai = ai->ai_next) {
+		int fd = socket (ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+		if (fd < 0)
+			continue;
+		fcntl (fd, F_SETFL, fcntl (fd, F_GETFL) | O_NONBLOCK);
+		if (connect (fd, ai->ai_addr, ai->ai_addrlen) != 0 && errno != EINPROGRESS) {
+			close (fd);
+			continue;
+		}
+		attempts[n].host = idx;
+		fds[n].fd = fd;
+		fds[n].events = POLLOUT;
+		fds[n].revents = 0;
+		n++;
+	}
+	freeaddrinfo (res);
+	return n;
+}
+
+
+/*
+** Set the time until which a host is tried last (0 when it is healthy).
+*/
+static void race_health (lua_State *L, int health, int idx, double dead_until) {
+	lua_pushvalue (L, idx);
+	if (dead_until > 0.0)
+		lua_pushnumber (L, dead_until);
+	else
+		lua_pushnil (L);
+	lua_rawset (L, health);
+}
+
+
+/*
+** Connect a connection object to the first host of a list which answers:
+** connections to the hosts (the first opts->race of them, all when it is -1)
+** are attempted in parallel. Hosts which could not be reached are tried
+** last during cooldown seconds.
+** Lists which are not made of ldap:// URIs are connected as usual.
+** @return NULL on success or an error message.
+*/
+static const char *conn_race (lua_State *L, conn_data *conn, const char *uri, int use_tls, double timeout, const connect_options *opts) {
+	race_attempt attempts[LUALDAP_MAX_RACE];
+	struct pollfd fds[LUALDAP_MAX_RACE];
+	double dead[LUALDAP_MAX_RACE];
+	int order[LUALDAP_MAX_RACE];
+	int top = lua_gettop (L);
+	int health, nhosts = 0, n = 0, pending, winner = -1, race = opts->race, i, j;
+	double cooldown = opts->cooldown;
+	double now = monotonic ();
+	double deadline = (timeout > 0.0) ? now + timeout : 0.0;
+	const char *p = uri;
+	const char *errmsg = NULL;
+
+	/* health of the hosts, kept by the Lua state */
+	lua_getfield (L, LUA_REGISTRYINDEX, LUALDAP_HEALTH);
+	if (!lua_istable (L, -1)) {
+		lua_pop (L, 1);
+		lua_newtable (L);
+		lua_pushvalue (L, -1);
+		lua_setfield (L, LUA_REGISTRYINDEX, LUALDAP_HEALTH);
+	}
+	health = lua_gettop (L);
+
+	/* split the list of URIs; known-dead hosts go last */
+	for (;;) {
+		LDAPURLDesc *lud;
+		size_t len = 0;
+		int ldap;
+		while (isspace ((unsigned char)*p))
+			p++;
+		while (p[len] != '\0' && !isspace ((unsigned char)p[len]))
+			len++;
+		if (len == 0)
+			break;
+		lua_pushlstring (L, p, len);
+		p += len;
+		ldap = ldap_url_parse (lua_tostring (L, -1), &lud) == LDAP_SUCCESS;
+		if (ldap) {
+			ldap = strcmp (lud->lud_scheme, "ldap") == 0;
+			ldap_free_urldesc (lud);
+		}
+		if (!ldap || nhosts == LUALDAP_MAX_RACE) {
+			lua_settop (L, top);
+			return conn_connect (conn, uri, use_tls, timeout, opts->tls);
+		}
+		lua_pushvalue (L, -1);
+		lua_rawget (L, health);
+		dead[nhosts] = (lua_tonumber (L, -1) > now) ? lua_tonumber (L, -1) : 0.0;
+		lua_pop (L, 1);
+		for (i = nhosts; i > 0 && dead[order[i - 1]] > dead[nhosts]; i--)
+			order[i] = order[i - 1];
+		order[i] = nhosts++;
+	}
+	if (race <= 0 || race > nhosts)
+		race = nhosts;
+
+	/* start the attempts */
+	for (i = 0; i < race; i++) {
+		LDAPURLDesc *lud;
+		int idx = health + 1 + order[i];
+		if (ldap_url_parse (lua_tostring (L, idx), &lud) != LDAP_SUCCESS)
+			continue;
+		j = race_start (attempts, fds, n, lud, idx);
+		ldap_free_urldesc (lud);
+		if (j == n) /* could not even be tried */
+			race_health (L, health, idx, now + cooldown);
+		n = j;
+	}
+
+	/* wait for the first of them to succeed */
+	pending = n;
+	while (winner < 0 && pending > 0) {
+		int ms = -1, ready;
+		if (deadline > 0.0) {
+			double left = deadline - monotonic ();
+			if (left <= 0.0)
+				break;
+			ms = (int)(left * 1000.0) + 1;
+		}
+		ready = poll (fds, n, ms);
+		if (ready < 0 && errno == EINTR)
+			continue;
+		if (ready <= 0)
+			break;
+		for (i = 0; i < n; i++) {
+			int err = 0;
+			socklen_t len = sizeof(err);
+			if (fds[i].fd < 0 || fds[i].revents == 0)
+				continue;
+			if (getsockopt (fds[i].fd, SOL_SOCKET, SO_ERROR, &err, &len) != 0)
+				err = errno;
+			if (err == 0) {
+				if (winner < 0)
+					winner = i;
+				continue;
+			}
+			close (fds[i].fd);
+			fds[i].fd = -1; /* ignored by poll from now on */
+			pending--;
+			race_health (L, health, attempts[i].host, monotonic () + cooldown);
+		}
+	}
+
+	/* keep the winner only */
+	for (i = 0; i < n; i++) {
+		if (i == winner || fds[i].fd < 0)
+			continue;
+		close (fds[i].fd);
+		if (winner < 0) /* did not answer in time */
+			race_health (L, health, attempts[i].host, monotonic () + cooldown);
+	}
+	if (winner < 0)
+		errmsg = LUALDAP_PREFIX"Error connecting to server";
+	else {
+		int fd = fds[winner].fd;
+		race_health (L, health, attempts[winner].host, 0.0);
+		fcntl (fd, F_SETFL, fcntl (fd, F_GETFL) & ~O_NONBLOCK);
+		if (ldap_init_fd (fd, LDAP_PROTO_TCP, lua_tostring (L, attempts[winner].host), &conn->ld) != LDAP_SUCCESS) {
+			close (fd);
+			conn->ld = NULL;
+			errmsg = LUALDAP_PREFIX"Error connecting to server";
+		} else
+			errmsg = conn_setup (conn, use_tls, timeout, opts->tls);
+	}
+	lua_settop (L, top);
+	return errmsg;
+}
+#endif
+
+
+/*
+** Connect a connection object, racing the hosts when opts->race is not 0
+** (see conn_race; not available on Microsoft Windows).
+** @return NULL on success or an error message.
+*/
+static const char *conn_open (lua_State *L, conn_data *conn, const char *uri, int use_tls, double timeout, const connect_options *opts) {
+#if !defined(WIN32)
+	if (opts->race != 0)
+		return conn_race (L, conn, uri, use_tls, timeout, opts);
+#else
+	(void)L;
+#endif
+	return conn_connect (conn, uri, use_tls, timeout, opts->tls);
+}
+
+
+/*
+** Get the options of the connection from the table at position tab
+** (if any): the number of hosts to race (race), the time unreachable
+** hosts are tried last (cooldown) and the TLS context (tls), which may be
+** given as a table of TLS settings.
+** The TLS context (or nil) is pushed, so that it is kept while in use.
+** @return NULL on success or an error message.
+*/
+static const char *get_connect_options (lua_State *L, int tab, connect_options *opts) {
+	opts->race = 0;
+	opts->cooldown = LUALDAP_COOLDOWN;
+	opts->tls = NULL;
+	if (!lua_istable (L, tab)) {
+		lua_pushnil (L);
+		return NULL;
+	}
+	lua_getfield (L, tab, "race");
+	if (lua_isboolean (L, -1))
+		opts->race = lua_toboolean (L, -1) ? -1 : 0;
+	else if (lua_isnumber (L, -1))
+		opts->race = (int)lua_tonumber (L, -1);
+	else if (!lua_isnil (L, -1))
+		option_error (L, "race", "number or boolean");
+	lua_pop (L, 1);
+	opts->cooldown = numbertabparam (L, tab, "cooldown", LUALDAP_COOLDOWN);
+	lua_pop (L, 1);
+	lua_getfield (L, tab, "tls");
+	if (lua_isnil (L, -1))
+		return NULL;
+#if !defined(WINLDAP)
+	if (lua_istable (L, -1)) {
+		const char *errmsg = tls_new (L, lua_gettop (L));
+		lua_replace (L, -2);
+		opts->tls = (tls_data *)lua_touserdata (L, -1);
+		return errmsg;
+	}
+	opts->tls = totls (L, -1);
+	if (opts->tls == NULL)
+		option_error (L, "tls", "table or TLS context");
+	return NULL;
+#else
+	return LUALDAP_PREFIX"TLS contexts are not available with WinLDAP";
+#endif
+}
+
+
+/*
+** Check if an LDAP error code means that the server of a connection
+** with automatic reconnection was lost.
+*/
+static int conn_lost (conn_data *conn, int rc) {
+	return conn->reconnect && (rc == LDAP_SERVER_DOWN || rc == LDAP_CONNECT_ERROR);
+}
+
+
+/*
+** Reopen a connection with its remembered parameters and bind it again.
+** The former LDAP connection is replaced only when the new one is ready,
+** so that the next operation tries again when the server is still down.
+** Operations sent on the former connection are lost: this is tracked
+** by the generation of the connection.
+** @return NULL on success or an error message.
+*/
+static const char *conn_reconnect (lua_State *L, conn_data *conn) {
+	int top = lua_gettop (L);
+	const char *uri, *who, *password, *errmsg;
+	int use_tls, sasl;
+	double timeout;
+	connect_options opts;
+	lua_rawgeti (L, LUA_REGISTRYINDEX, conn->params);
+	uri = strtabparam (L, top + 1, "uri", NULL);
+	use_tls = booltabparam (L, top + 1, "usetls", 0);
+	timeout = numbertabparam (L, top + 1, "timeout", 0.0);
+	get_connect_options (L, top + 1, &opts); /* the context is already created */
+	who = strtabparam (L, top + 1, "who", NULL);
+	password = strtabparam (L, top + 1, "password", (char *)"");
+	lua_getfield (L, top + 1, "sasl");
+	sasl = lua_gettop (L);
+	if (uri == NULL)
+		errmsg = LUALDAP_PREFIX"connection parameters unknown";
+	else {
+		conn_data fresh;
+		fresh.ld = NULL;
+		fresh.txn = NULL;
+		fresh.msgids = NULL;
+		fresh.pending = 0;
+		fresh.lender = NULL;
+		memset (&fresh.stats, 0, sizeof(fresh.stats));
+		fresh.hook = LUA_NOREF;
+		fresh.slowlog.sink = LUA_NOREF;
+#if !defined(WIN32)
+		fresh.pid = getpid ();
+#endif
+		errmsg = conn_open (L, &fresh, uri, use_tls, timeout, &opts);
+		if (errmsg == NULL && who != NULL) {
+			int err = conn_bind (&fresh, who, password);
+			if (err != LDAP_SUCCESS)
+				errmsg = ldap_err2string (err);
+		}
+#if !defined(WINLDAP)
+		if (errmsg == NULL && lua_istable (L, sasl)) {
+			int err = conn_sasl (L, &fresh, sasl);
+			if (err != LDAP_SUCCESS)
+				errmsg = ldap_err2string (err);
+		}
+#endif
+		if (errmsg == NULL) {
+			BerValue *txn = conn->txn; /* later writes must fail, not escape it */
+#if !defined(WIN32)
+			if (conn->lender != NULL) { /* the pool must not reuse the lost connection */
+				if (conn->pid != getpid ())
+					ld_orphan (conn->ld);
+				shared_release (conn->lender, conn->ld, 1);
+				conn->lender = NULL;
+				conn->ld = NULL;
+			}
+			if (conn->ld != NULL)
+#endif
+			conn_close (conn);
+			conn->ld = fresh.ld;
+			conn->txn = txn;
+			conn->version = fresh.version;
+			conn->generation++;
+			conn->pending = 0; /* the requests were lost with the connection */
+			conn->tree_delete = -1; /* the server may be another one */
+			stats_attach (conn); /* instead of the statistics of fresh */
+		} else if (fresh.ld != NULL)
+			conn_close (&fresh);
+	}
+	lua_settop (L, top);
+	return errmsg;
+}
+
+
+#if !defined(WIN32)
+/*
+** Reopen a connection inherited from the parent process after a fork, so
+** that the processes do not share a socket (nor its TLS state): the
+** inherited LDAP connection is dropped without sending anything on it.
+** The connection is closed when it cannot be reopened.
+*/
+static void conn_check_fork (lua_State *L, conn_data *conn) {
+	if (conn->ld == NULL || conn->pid == getpid ())
+		return;
+	conn->pending = 0; /* their results go to the parent process */
+	if (conn_reconnect (L, conn) != NULL)
+		conn_close (conn);
+	conn->pid = getpid ();
+}
+#endif
+
+
+/*
+** Wait for the result message of an operation and push its outcome.
+** @return Number of pushed values.
+*/
+static int push_result (lua_State *L, conn_data *conn, int msgid) {
+	struct timeval *timeout = NULL; /* ??? function parameter ??? */
+	LDAPMessage *res;
+	int rc = ldap_result (conn->ld, msgid, LDAP_MSG_ONE, timeout, &res);
+	if (rc == 0)
+		return faildirect (L, LUALDAP_PREFIX"result timeout expired");
+	else if (rc < 0) {
+		ldap_msgfree (res);
+		stats_result (conn, ld_errno (conn->ld));
+		if (conn_lost (conn, ld_errno (conn->ld))) {
+			const char *errmsg = conn_reconnect (L, conn);
+			return faildirect (L, errmsg != NULL ? errmsg : LUALDAP_PREFIX"connection lost");
+		}
+		return faildirect (L, LUALDAP_PREFIX"result error");
+	} else {
+		int err, ret = 1;
+		char *mdn, *msg, *oid = NULL;
+		BerValue *data = NULL;
+		int extended = (ldap_msgtype (res) == LDAP_RES_EXTENDED);
+		if (extended && (rc = ldap_parse_extended_result (conn->ld, res, &oid, &data, 0)) != LDAP_SUCCESS) {
+			ldap_msgfree (res);
+			return faildirect (L, ldap_err2string (rc));
+		}
+		rc = ldap_parse_result (conn->ld, res, &err, &mdn, &msg, NULL, NULL, 1);
+		if (rc != LDAP_SUCCESS) {
+			ldap_memfree (oid);
+			ber_bvfree (data);
+			return faildirect (L, ldap_err2string (rc));
+		}
+		stats_result (conn, err);
+		switch (err) {
+			case LDAP_SUCCESS:
+			case LDAP_COMPARE_TRUE:
+				lua_pushboolean (L, 1);
+				if (extended) { /* push the response name and value */
+					if (oid != NULL)
+						lua_pushstring (L, oid);
+					else
+						lua_pushnil (L);
+					if (data != NULL)
+						lua_pushlstring (L, data->bv_val, data->bv_len);
+					else
+						lua_pushnil (L);
+					ret = 3;
+				}
+				break;
+			case LDAP_COMPARE_FALSE:
+				lua_pushboolean (L, 0);
+				break;
+			default:
+				lua_pushnil (L);
+				lua_pushliteral (L, LUALDAP_PREFIX);
+				lua_pushstring (L, ldap_err2string(err));
+				lua_concat (L, 2);
+				if (msg != NULL) {
+					lua_pushliteral (L, " (");
+					lua_pushstring (L, msg);
+					lua_pushliteral (L, ")");
+					lua_concat (L, 4);
+				}
+				ret = 2;
+		}
+		ldap_memfree (mdn);
+		ldap_memfree (msg);
+		ldap_memfree (oid);
+		ber_bvfree (data);
+		return ret;
+	}
+}
+
+
+/*
+** Create the ticket of requests sent on the connection at stack index conn
+** and leave it on top of the stack.
+*/
+static future_data *create_ticket (lua_State *L, int conn, int n) {
+	future_data *f = (future_data *)lua_newuserdata (L, sizeof(future_data) + (n - 1) * sizeof(int));
+	luaL_setmetatable (L, LUALDAP_FUTURE_METATABLE);
+	f->conn = LUA_NOREF;
+	f->generation = ((conn_data *)lua_touserdata (L, conn))->generation;
+	f->reads = 0;
+	f->n = 0;
+	lua_pushvalue (L, conn);
+	f->conn = luaL_ref (L, LUA_REGISTRYINDEX);
+	return f;
+}
+
+
+/*
+** Record a request sent for a ticket.
+*/
+static void ticket_add (lua_State *L, future_data *f, int msgid) {
+	conn_data *conn;
+	lua_rawgeti (L, LUA_REGISTRYINDEX, f->conn);
+	conn = (conn_data *)lua_touserdata (L, -1);
+	lua_pop (L, 1);
+	f->msgids[f->n++] = msgid;
+	pending_add (conn, msgid);
+}
+
+
+/*
+** Release the requests of a ticket.
+** Only the requests which read the directory are abandoned: writes whose
+** results are not read are still carried out, and their results are
+** discarded when they have already arrived.
+** @param abandon Boolean indicating that the results will not be read.
+*/
+static void ticket_close (lua_State *L, future_data *f, int abandon) {
+	conn_data *conn;
+	int i;
+	if (f->conn == LUA_NOREF)
+		return;
+	lua_rawgeti (L, LUA_REGISTRYINDEX, f->conn);
+	conn = (conn_data *)lua_touserdata (L, -1);
+	lua_pop (L, 1);
+	if (conn->ld != NULL && f->generation == conn->generation
+#if !defined(WIN32)
+		&& conn->pid == getpid ()
+#endif
+	) {
+		for (i = 0; i < f->n; i++) {
+			if (!pending_remove (conn, f->msgids[i]) || !abandon)
+				continue;
+			if (f->reads)
+				ldap_abandon_ext (conn->ld, f->msgids[i], NULL, NULL);
+			else {
+				struct timeval none = {0, 0};
+				LDAPMessage *res = NULL;
+				if (ldap_result (conn->ld, f->msgids[i], LDAP_MSG_ALL, &none, &res) > 0)
+					ldap_msgfree (res);
+			}
+		}
+	}
+	luaL_unref (L, LUA_REGISTRYINDEX, f->conn);
+	f->conn = LUA_NOREF;
+}
+
+
+/*
+** Release the requests of a ticket whose results were not read.
+*/
+static int lualdap_future_gc (lua_State *L) {
+	ticket_close (L, (future_data *)luaL_checkudata (L, 1, LUALDAP_FUTURE_METATABLE), 1);
+	return 0;
+}
+
+
+/*
+** Wait for the result message of the operation of result_message.
+*/
+static int wait_result (lua_State *L) {
+	conn_data *conn = (conn_data *)lua_touserdata (L, lua_upvalueindex (1));
+	future_data *f = (future_data *)lua_touserdata (L, lua_upvalueindex (2));
+	int msgid = f->msgids[0];
+	int res_code = (int)lua_tonumber (L, lua_upvalueindex (3));
+	unsigned generation = f->generation;
+	int top = lua_gettop (L);
+	int ret;
+
+	conn_check_fork (L, conn);
+	luaL_argcheck (L, conn->ld, 1, LUALDAP_PREFIX"LDAP connection is closed");
+	ticket_close (L, f, 0); /* the result is read now */
+	if (generation == conn->generation) {
+		ret = push_result (L, conn, msgid);
+		if (ret != 2 || generation == conn->generation || res_code != LDAP_RES_COMPARE)
+			return ret;
+		lua_settop (L, top); /* the connection was lost, then reopened */
+	} else if (res_code != LDAP_RES_COMPARE)
+		return faildirect (L, LUALDAP_PREFIX"connection lost");
+
+	/* compare operations are idempotent: send it again */
+	{
+		BerValue bvalue;
+		ctrls_data ctrls;
+		size_t len;
+		ldap_int_t rc;
+		bvalue.bv_val = (char *)lua_tolstring (L, lua_upvalueindex (8), &len);
+		bvalue.bv_len = len;
+		rc = get_ctrls_param (L, conn, lua_upvalueindex (9), &ctrls, 0);
+		if (rc == LDAP_SUCCESS) {
+			rc = ldap_compare_ext (conn->ld, (ldap_pchar_t)lua_tostring (L, lua_upvalueindex (6)),
+				(ldap_pchar_t)lua_tostring (L, lua_upvalueindex (7)), &bvalue, C_array (&ctrls), NULL, &msgid);
+			C_free (&ctrls);
+		}
+		if (rc != LDAP_SUCCESS)
+			return faildirect (L, ldap_err2string (rc));
+	}
+	f->msgids[0] = msgid;
+	f->generation = conn->generation;
+	return push_result (L, conn, msgid);
+}
+
+
+/*
+** Get the result message of an operation.
+** #1 upvalue == connection
+** #2 upvalue == ticket of the request (msgid and generation of the connection)
+** #3 upvalue == result code of the message (ADD, DEL etc.) to be received.
+** #4 upvalue == time the request was sent.
+** #5 upvalue == record of the operation for the hook of the connection (or nil).
+** #6, #7, #8, #9 upvalues == DN, attribute, value and options of a compare
+**	operation, which is sent again when the connection was lost in the meantime.
+*/
+static int result_message (lua_State *L) {
+	conn_data *conn = (conn_data *)lua_touserdata (L, lua_upvalueindex (1));
+	int res_code = (int)lua_tonumber (L, lua_upvalueindex (3));
+	double start = lua_tonumber (L, lua_upvalueindex (4));
+	int ret;
+	conn->result = LDAP_OTHER;
+	ret = wait_result (L);
+	stats_op (conn, res2op (res_code), start, ret == 2);
+	hook_done (L, conn, lua_upvalueindex (5), conn->result, 0.0);
+	return ret;
+}
+
+
+/*
+** Get the result messages of a group of operations.
+** #1 upvalue == connection
+** #2 upvalue == ticket of the requests (msgids and generation of the connection)
+** #3 upvalue == error message of a request which could not be sent (or nil)
+** #4 upvalue == time the requests were sent.
+** #5 upvalue == record of the operation for the hook of the connection (or nil).
+** @return True if every operation succeeded; nil and the first error message otherwise.
+*/
+static int result_messages (lua_State *L) {
+	conn_data *conn = (conn_data *)lua_touserdata (L, lua_upvalueindex (1));
+	future_data *f = (future_data *)lua_touserdata (L, lua_upvalueindex (2));
+	double start = lua_tonumber (L, lua_upvalueindex (4));
+	unsigned generation = f->generation;
+	int i;
+	int base = lua_gettop (L);
+	int failed = !lua_isnil (L, lua_upvalueindex (3));
+	int code = failed ? LDAP_OTHER : LDAP_SUCCESS;
+
+	conn_check_fork (L, conn);
+	luaL_argcheck (L, conn->ld, 1, LUALDAP_PREFIX"LDAP connection is closed");
+	ticket_close (L, f, 0); /* the results are read now */
+	if (failed) {
+		lua_pushnil (L);
+		lua_pushvalue (L, lua_upvalueindex (3));
+	}
+	/* wait for every operation, keeping the first error */
+	for (i = 0; i < f->n; i++) {
+		int top = lua_gettop (L);
+		lua_pushnumber (L, f->msgids[i]);
+		if (generation != conn->generation) /* the requests were lost */
+			faildirect (L, LUALDAP_PREFIX"connection lost");
+		else
+			push_result (L, conn, f->msgids[i]);
+		if (!failed && lua_isnil (L, top + 2)) {
+			failed = 1;
+			code = conn->result;
+			lua_remove (L, top + 1); /* remove msgid */
+			lua_settop (L, top + 2); /* keep nil, error message */
+		} else
+			lua_settop (L, top);
+	}
+	stats_op (conn, LUALDAP_OP_MODIFY, start, failed);
+	hook_done (L, conn, lua_upvalueindex (5), code, 0.0);
+	if (failed)
+		return lua_gettop (L) - base;
+	lua_pushboolean (L, 1);
+	return 1;
+}
+
+
+/*
+** Push a function to process the LDAP result.
+** @param start Time taken before the request was sent.
+*/
+static int create_future (lua_State *L, ldap_int_t rc, int conn, ldap_int_t msgid, int code, double start) {
+	conn_data *c = (conn_data *)lua_touserdata (L, conn);
+	future_data *f;
+	if (rc != LDAP_SUCCESS) {
+		stats_result (c, rc);
+		stats_op (c, res2op (code), monotonic (), 1);
+		if (conn_lost (c, rc))
+			conn_reconnect (L, c); /* for the next operations */
+		return faildirect (L, ldap_err2string (rc));
+	}
+	lua_pushvalue (L, conn); /* push connection as #1 upvalue */
+	f = create_ticket (L, conn, 1); /* push ticket as #2 upvalue */
+	f->reads = (code == LDAP_RES_COMPARE);
+	ticket_add (L, f, msgid);
+	lua_pushnumber (L, code); /* push code as #3 upvalue */
+	lua_pushnumber (L, start); /* push time as #4 upvalue */
+	/* push record as #5 upvalue (extended operations have an OID instead of a DN) */
+	if (hook_record (L, c, res2op (code), (code == LDAP_RES_EXTENDED) ? 0 : conn + 1, msgid, start)) {
+		if (code == LDAP_RES_EXTENDED) {
+			lua_pushvalue (L, conn + 1);
+			lua_setfield (L, -2, "oid");
+		}
+		hook_call (L, c, "start", lua_gettop (L));
+	}
+	if (code == LDAP_RES_COMPARE) {
+		lua_pushvalue (L, conn + 1); /* push DN, attribute, value and options */
+		lua_pushvalue (L, conn + 2);
+		lua_pushvalue (L, conn + 3);
+		lua_pushvalue (L, conn + 4);
+		lua_pushcclosure (L, result_message, 9);
+	} else
+		lua_pushcclosure (L, result_message, 5);
+	return 1;
+}
+
+/*
+** Unbind from the directory.
+** @param #1 LDAP connection.
+** @return 1 in case of success; nothing when already closed.
+*/
+static int lualdap_close (lua_State *L) {
+	conn_data *conn = (conn_data *)luaL_checkudata (L, 1, LUALDAP_CONNECTION_METATABLE);
+	if (conn->ld == NULL) /* already closed */
+		return 0;
+	conn_close (conn);
+	lua_pushnumber (L, 1);
+	return 1;
+}
+
+
+/*
+** Release a connection object.
+*/
+static int lualdap_conn_gc (lua_State *L) {
+	conn_data *conn = (conn_data *)luaL_checkudata (L, 1, LUALDAP_CONNECTION_METATABLE);
+	metrics_data *m;
+	if (conn->ld != NULL)
+		conn_close (conn);
+	luaL_unref (L, LUA_REGISTRYINDEX, conn->params);
+	conn->params = LUA_NOREF;
+	luaL_unref (L, LUA_REGISTRYINDEX, conn->hook);
+	conn->hook = LUA_NOREF;
+	luaL_unref (L, LUA_REGISTRYINDEX, conn->slowlog.sink);
+	conn->slowlog.sink = LUA_NOREF;
+	free (conn->msgids);
+	conn->msgids = NULL;
+	conn->pending = conn->maxpending = 0;
+	/* keep its counters for metrics_text (it may still be listed until the next cycle) */
+	if ((m = metrics_retired (L)) != NULL) {
+		stats_add (&m->stats, &conn->stats);
+		m->reconnects += conn->generation;
+	}
+	memset (&conn->stats, 0, sizeof(conn->stats));
+	conn->generation = 0;
+	return 0;
+}
+
+
+/*
+** Enable or disable automatic reconnection.
+** When the server is lost, the connection is reopened and bound again with
+** the parameters it was opened and bound with. Pending compare and search
+** operations are sent again (searches only when no entry was returned yet);
+** other operations report the loss of the connection.
+** @param #1 LDAP connection.
+** @param #2 Boolean (optional, defaults to true).
+** @return LDAP connection.
+*/
+static int lualdap_auto_reconnect (lua_State *L) {
+	conn_data *conn = getconnection (L);
+	conn->reconnect = lua_isnone (L, 2) || lua_toboolean (L, 2);
+	lua_pushvalue (L, 1);
+	return 1;
+}
+
+
+/* Values of enumerated options */
+static const char *const deref_names[] = {
+	"never", "searching", "finding", "always", NULL
+};
+static const int deref_values[] = {
+	LDAP_DEREF_NEVER, LDAP_DEREF_SEARCHING, LDAP_DEREF_FINDING, LDAP_DEREF_ALWAYS
+};
+
+
+/* Options of the LDAP connections (see get_option and set_option) */
+static const conn_option conn_options[] = {
+#if !defined(WINLDAP)
+	{"debug_level", LDAP_OPT_DEBUG_LEVEL, LUALDAP_OPT_INT, NULL, NULL, 0},
+#endif
+	{"deref", LDAP_OPT_DEREF, LUALDAP_OPT_ENUM, deref_names, deref_values, 0},
+#if defined(LDAP_OPT_X_KEEPALIVE_IDLE) && !defined(WINLDAP)
+	{"keepalive_idle", LDAP_OPT_X_KEEPALIVE_IDLE, LUALDAP_OPT_INT, NULL, NULL, 0},
+	{"keepalive_interval", LDAP_OPT_X_KEEPALIVE_INTERVAL, LUALDAP_OPT_INT, NULL, NULL, 0},
+	{"keepalive_probes", LDAP_OPT_X_KEEPALIVE_PROBES, LUALDAP_OPT_INT, NULL, NULL, 0},
+#endif
+#if !defined(WINLDAP)
+	{"network_timeout", LDAP_OPT_NETWORK_TIMEOUT, LUALDAP_OPT_TIME, NULL, NULL, 0},
+#endif
+	{"referrals", LDAP_OPT_REFERRALS, LUALDAP_OPT_BOOL, NULL, NULL, 0},
+	{"restart", LDAP_OPT_RESTART, LUALDAP_OPT_BOOL, NULL, NULL, 0},
+	{"sizelimit", LDAP_OPT_SIZELIMIT, LUALDAP_OPT_INT, NULL, NULL, 0},
+	{"timelimit", LDAP_OPT_TIMELIMIT, LUALDAP_OPT_INT, NULL, NULL, 0},
+#if !defined(WINLDAP)
+	{"timeout", LDAP_OPT_TIMEOUT, LUALDAP_OPT_TIME, NULL, NULL, 0},
+	{"tls_cacertdir", LDAP_OPT_X_TLS_CACERTDIR, LUALDAP_OPT_STRING, NULL, NULL, 1},
+	{"tls_cacertfile", LDAP_OPT_X_TLS_CACERTFILE, LUALDAP_OPT_STRING, NULL, NULL, 1},
+	{"tls_certfile", LDAP_OPT_X_TLS_CERTFILE, LUALDAP_OPT_STRING, NULL, NULL, 1},
+	{"tls_cipher_suite", LDAP_OPT_X_TLS_CIPHER_SUITE, LUALDAP_OPT_STRING, NULL, NULL, 1},
+	{"tls_keyfile", LDAP_OPT_X_TLS_KEYFILE, LUALDAP_OPT_STRING, NULL, NULL, 1},
+	{"tls_require_cert", LDAP_OPT_X_TLS_REQUIRE_CERT, LUALDAP_OPT_ENUM, tls_check_names, tls_check_values, 1},
+#endif
+	{NULL, 0, 0, NULL, NULL, 0}
+};
+
+/*
+** Find the connection option named by the string at position idx.
+*/
+static const conn_option *getoption (lua_State *L, int idx) {
+	const char *name = luaL_checkstring (L, idx);
+	const conn_option *o;
+	for (o = conn_options; o->name != NULL; o++)
+		if (strcmp (o->name, name) == 0)
+			return o;
+	luaL_argerror (L, idx, lua_pushfstring (L, LUALDAP_PREFIX"unknown option `%s'", name));
+	return NULL;
+}
+
+
+/*
+** Set an option of the LDAP connection.
+** Changes of TLS options take effect for the TLS sessions which are
+** established afterwards.
+** @param #1 LDAP connection.
+** @param #2 String with the name of the option.
+** @param #3 Value of the option (a number of seconds for timeouts,
+**	nil or a negative number meaning none).
+** @return #1 The connection itself.
+*/
+static int lualdap_set_option (lua_State *L) {
+	conn_data *conn = getconnection (L);
+	const conn_option *o = getoption (L, 2);
+	int rc, i;
+	switch (o->type) {
+		case LUALDAP_OPT_INT:
+			i = (int)luaL_checkinteger (L, 3);
+			rc = ldap_set_option (conn->ld, o->option, &i);
+			break;
+		case LUALDAP_OPT_BOOL:
+			luaL_checktype (L, 3, LUA_TBOOLEAN);
+			rc = ldap_set_option (conn->ld, o->option, lua_toboolean (L, 3) ? LDAP_OPT_ON : LDAP_OPT_OFF);
+			break;
+		case LUALDAP_OPT_ENUM:
+			i = luaL_checkoption (L, 3, NULL, o->names);
+			rc = ldap_set_option (conn->ld, o->option, &o->values[i]);
+			break;
+#if !defined(WINLDAP)
+		case LUALDAP_OPT_TIME: {
+			double t = luaL_optnumber (L, 3, -1.0);
+			struct timeval tv;
+			tv.tv_sec = (long)t;
+			tv.tv_usec = (long)(1000000.0 * (t - (double)tv.tv_sec));
+			rc = ldap_set_option (conn->ld, o->option, (t < 0.0) ? NULL : &tv);
+			break;
+		}
+#endif
+		default: /* LUALDAP_OPT_STRING */
+			rc = ldap_set_option (conn->ld, o->option, luaL_optstring (L, 3, NULL));
+	}
+#if !defined(WINLDAP)
+	if (rc == LDAP_OPT_SUCCESS && o->tls) { /* settings are read by a new TLS context */
+		i = 0;
+		rc = ldap_set_option (conn->ld, LDAP_OPT_X_TLS_NEWCTX, &i);
+	}
+#endif
+	if (rc != LDAP_OPT_SUCCESS)
+		return faildirect (L, lua_pushfstring (L, LUALDAP_PREFIX"could not set option `%s'", o->name));
+	lua_pushvalue (L, 1);
+	return 1;
+}
+
+
+/*
+** Get an option of the LDAP connection.
+** @param #1 LDAP connection.
+** @param #2 String with the name of the option.
+** @return #1 Value of the option.
+*/
+static int lualdap_get_option (lua_State *L) {
+	conn_data *conn = getconnection (L);
+	const conn_option *o = getoption (L, 2);
+	int rc, i = 0;
+	switch (o->type) {
+		case LUALDAP_OPT_INT:
+			rc = ldap_get_option (conn->ld, o->option, &i);
+			lua_pushinteger (L, i);
+			break;
+		case LUALDAP_OPT_BOOL: /* the library writes an int */
+			rc = ldap_get_option (conn->ld, o->option, &i);
+			lua_pushboolean (L, i);
+			break;
+		case LUALDAP_OPT_ENUM: {
+			int value = -1;
+			rc = ldap_get_option (conn->ld, o->option, &value);
+			while (o->names[i] != NULL && o->values[i] != value)
+				i++;
+			lua_pushstring (L, o->names[i]);
+			break;
+		}
+#if !defined(WINLDAP)
+		case LUALDAP_OPT_TIME: {
+			struct timeval *tv = NULL;
+			rc = ldap_get_option (conn->ld, o->option, &tv);
+			if (tv == NULL)
+				lua_pushnil (L);
+			else {
+				lua_pushnumber (L, (double)tv->tv_sec + (double)tv->tv_usec / 1000000.0);
+				ldap_memfree (tv);
+			}
+			break;
+		}
+#endif
+		default: { /* LUALDAP_OPT_STRING */
+			char *s = NULL;
+			rc = ldap_get_option (conn->ld, o->option, &s);
+			lua_pushstring (L, s);
+			if (s != NULL)
+				ldap_memfree (s);
+		}
+	}
+	if (rc != LDAP_OPT_SUCCESS)
+		return faildirect (L, lua_pushfstring (L, LUALDAP_PREFIX"could not get option `%s'", o->name));
+	return 1;
+}
+
+
+/*
+** Set a field of the table on top of the stack to a counter.
+*/
+static void set_counter (lua_State *L, const char *name, unsigned long n) {
+	lua_pushnumber (L, (lua_Number)n);
+	lua_setfield (L, -2, name);
+}
+
+
+/*
+** Get the statistics of the operations of a connection.
+** @param #1 LDAP connection.
+** @param #2 Boolean indicating if the statistics should be reset after
+**	being read (optional).
+** @return #1 Table of statistics.
+*/
+static int lualdap_stats (lua_State *L) {
+	conn_data *conn = getconnection (L);
+	stats_data *st = &conn->stats;
+	int reset = lua_toboolean (L, 2);
+	int op, i;
+	lua_newtable (L);
+	for (op = 0; op < LUALDAP_NOPS; op++) {
+		op_stats *s = &st->ops[op];
+		lua_newtable (L);
+		set_counter (L, "count", s->count);
+		set_counter (L, "errors", s->errors);
+		lua_pushnumber (L, s->time);
+		lua_setfield (L, -2, "time");
+		lua_newtable (L);
+		for (i = 0; i < LUALDAP_HIST_BUCKETS; i++) {
+			lua_pushnumber (L, (lua_Number)s->hist[i]);
+			lua_rawseti (L, -2, i + 1);
+		}
+		lua_setfield (L, -2, "histogram");
+		lua_setfield (L, -2, op_names[op]);
+	}
+	lua_newtable (L);
+	for (i = 0; i <= LUALDAP_MAX_RESULT_CODE + 1; i++)
+		if (st->results[i] > 0) {
+			lua_pushnumber (L, (lua_Number)st->results[i]);
+			lua_rawseti (L, -2, i);
+		}
+	lua_setfield (L, -2, "results");
+	set_counter (L, "entries", st->entries);
+	set_counter (L, "bytes_in", st->bytes_in);
+	set_counter (L, "bytes_out", st->bytes_out);
+	if (reset) {
+		metrics_data *m = metrics_retired (L); /* the metrics are not reset */
+		if (m != NULL)
+			stats_add (&m->stats, st);
+		memset (st, 0, sizeof(stats_data));
+	}
+	return 1;
+}
+
+
+/*
+** Set the function called when each operation of the connection starts and
+** completes, with the event ("start" or "done") and the record of the
+** operation (the same table for both events).
+** @param #1 LDAP connection.
+** @param #2 Function (nil removes the hook).
+** @return LDAP connection.
+*/
+static int lualdap_on_operation (lua_State *L) {
+	conn_data *conn = getconnection (L);
+	if (!lua_isnoneornil (L, 2))
+		luaL_checktype (L, 2, LUA_TFUNCTION);
+	luaL_unref (L, LUA_REGISTRYINDEX, conn->hook);
+	conn->hook = LUA_NOREF;
+	if (!lua_isnoneornil (L, 2)) {
+		lua_pushvalue (L, 2);
+		conn->hook = luaL_ref (L, LUA_REGISTRYINDEX);
+	}
+	lua_pushvalue (L, 1);
+	return 1;
+}
+
+
+/*
+** Set the reporting of the slow operations of the connection.
+** @param #1 LDAP connection.
+** @param #2 Table with the threshold (threshold_ms), the function
+**	called with the record of each slow operation (sink) and the fraction
+**	of them to report (sample); nil stops the reporting.
+** @return LDAP connection.
+*/
+static int lualdap_set_slowlog (lua_State *L) {
+	conn_data *conn = getconnection (L);
+	slowlog_data *slow = &conn->slowlog;
+	double threshold = 0.0, sample = 1.0;
+	if (!lua_isnoneornil (L, 2)) {
+		luaL_checktype (L, 2, LUA_TTABLE);
+		lua_settop (L, 2);
+		threshold = numbertabparam (L, 2, "threshold_ms", 0.0);
+		sample = numbertabparam (L, 2, "sample", 1.0);
+		lua_getfield (L, 2, "sink");
+		if (!lua_isfunction (L, -1))
+			return option_error (L, "sink", "function");
+		luaL_argcheck (L, threshold >= 0.0, 2, LUALDAP_PREFIX"invalid threshold");
+		luaL_argcheck (L, sample > 0.0 && sample <= 1.0, 2, LUALDAP_PREFIX"invalid sample");
+	}
+	luaL_unref (L, LUA_REGISTRYINDEX, slow->sink);
+	slow->sink = LUA_NOREF;
+	if (!lua_isnoneornil (L, 2)) {
+		slow->sink = luaL_ref (L, LUA_REGISTRYINDEX);
+		slow->threshold = threshold / 1000.0;
+		slow->sample = sample;
+		slow->credit = 1.0 - sample; /* the first slow operation is reported */
+	}
+	lua_pushvalue (L, 1);
+	return 1;
+}
+
+
+/*
+** Bind to the directory.
+** @param #1 LDAP connection.
+** @param #2 String with username.
+** @param #3 String with password.
+** @return LDAP connection on success.
+*/
+static int lualdap_bind_simple (lua_State *L) {
+	conn_data *conn = getconnection (L);
+	ldap_pchar_t who = (ldap_pchar_t) luaL_checkstring (L, 2);
+	const char *password = luaL_checkstring (L, 3);
+	int err;
+	lua_settop (L, 3);
+	if (hook_record (L, conn, LUALDAP_OP_BIND, 2, -1, monotonic ()))
+		hook_call (L, conn, "start", 4);
+	luaL_argcheck (L, conn->ld, 1, LUALDAP_PREFIX"LDAP connection is closed"); /* by the hook */
+	err = conn_bind (conn, who, password);
+	hook_done (L, conn, 4, err, 0.0);
+	if (err != LDAP_SUCCESS)
+		return faildirect (L, ldap_err2string (err));
+	conn_remember_bind (L, conn, who, password);
+
+	lua_pushvalue (L, 1);
+	return 1;
+}
+
+
+#if !defined(WINLDAP)
+/*
+** Bind to a directory server with SASL.
+** @param #1 LDAP connection.
+** @param #2 Table of SASL parameters (optional): mech (default "EXTERNAL"),
+**	authcid, password, realm and authzid.
+** @return #1 The connection itself.
+*/
+static int lualdap_bind_sasl (lua_State *L) {
+	conn_data *conn = getconnection (L);
+	int err;
+	if (lua_isnoneornil (L, 2)) {
+		lua_settop (L, 1);
+		lua_newtable (L);
+	} else
+		luaL_checktype (L, 2, LUA_TTABLE);
+	lua_settop (L, 2);
+	if (hook_record (L, conn, LUALDAP_OP_BIND, 0, -1, monotonic ())) {
+		lua_getfield (L, 2, "mech");
+		lua_setfield (L, 3, "mech");
+		hook_call (L, conn, "start", 3);
+	}
+	luaL_argcheck (L, conn->ld, 1, LUALDAP_PREFIX"LDAP connection is closed"); /* by the hook */
+	err = conn_sasl (L, conn, 2);
+	hook_done (L, conn, 3, err, 0.0);
+	if (err != LDAP_SUCCESS)
+		return faildirect (L, ldap_err2string (err));
+	conn_remember_sasl (L, conn, 2);
+
+	lua_pushvalue (L, 1);
+	return 1;
+}
+#endif
+
+
+/*
+** Add a new entry to the directory.
+** @param #1 LDAP connection.
+** @param #2 String with new entry's DN.
+** @param #3 Table with new entry's attributes and values.
+** @param #4 Table of options (optional).
+** @return Function to process the LDAP result.
+*/
+static int lualdap_add (lua_State *L) {
+	conn_data *conn = getconnection (L);
+	ldap_pchar_t dn = (ldap_pchar_t) luaL_checkstring (L, 2);
+	attrs_data attrs;
+	ctrls_data ctrls;
+	ldap_int_t rc, msgid;
+	double start = 0.0;
+	A_init (&attrs);
+	if (lua_istable (L, 3))
+		A_tab2mod (L, &attrs, 3, LUALDAP_MOD_ADD);
+	A_lastattr (L, &attrs);
+	rc = get_ctrls_param (L, conn, 4, &ctrls, 1);
+	if (rc == LDAP_SUCCESS) {
+		start = monotonic ();
+		rc = ldap_add_ext (conn->ld, dn, attrs.attrs, C_array (&ctrls), NULL, &msgid);
+		C_free (&ctrls);
+	}
+	return create_future (L, rc, 1, msgid, LDAP_RES_ADD, start);
+}
+
+
+/*
+** Compare a value against an entry.
+** @param #1 LDAP connection.
+** @param #2 String with entry's DN.
+** @param #3 String with attribute's name.
+** @param #4 String with attribute's value.
+** @param #5 Table of options (optional).
+** @return Function to process the LDAP result.
+*/
+static int lualdap_compare (lua_State *L) {
+	conn_data *conn = getconnection (L);
+	ldap_pchar_t dn = (ldap_pchar_t) luaL_checkstring (L, 2);
+	ldap_pchar_t attr = (ldap_pchar_t) luaL_checkstring (L, 3);
+	BerValue bvalue;
+	ldap_int_t rc, msgid;
+	size_t len;
+	ctrls_data ctrls;
+	double start = 0.0;
+	bvalue.bv_val = (char *)luaL_checklstring (L, 4, &len);
+	bvalue.bv_len = len;
+	lua_settop (L, 5);
+	rc = get_ctrls_param (L, conn, 5, &ctrls, 0);
+	if (rc == LDAP_SUCCESS) {
+		start = monotonic ();
+		rc = ldap_compare_ext (conn->ld, dn, attr, &bvalue, C_array (&ctrls), NULL, &msgid);
+		if (conn_lost (conn, rc) && conn_reconnect (L, conn) == NULL)
+			rc = ldap_compare_ext (conn->ld, dn, attr, &bvalue, C_array (&ctrls), NULL, &msgid);
+		C_free (&ctrls);
+	}
+	return create_future (L, rc, 1, msgid, LDAP_RES_COMPARE, start);
+}
+
+
+/*
+** Delete an entry.
+** @param #1 LDAP connection.
+** @param #2 String with entry's DN.
+** @param #3 Table of options (optional).
+** @return Boolean.
+*/
+static int lualdap_delete (lua_State *L) {
+	conn_data *conn = getconnection (L);
+	ldap_pchar_t dn = (ldap_pchar_t) luaL_checkstring (L, 2);
+	ctrls_data ctrls;
+	ldap_int_t rc, msgid;
+	double start = 0.0;
+	rc = get_ctrls_param (L, conn, 3, &ctrls, 1);
+	if (rc == LDAP_SUCCESS) {
+		start = monotonic ();
+		rc = ldap_delete_ext (conn->ld, dn, C_array (&ctrls), NULL, &msgid);
+		C_free (&ctrls);
+	}
+	return create_future (L, rc, 1, msgid, LDAP_RES_DELETE, start);
+}
+
+
+/*
+** Send an extended operation.
+** @param #1 LDAP connection.
+** @param #2 String with the name (OID) of the operation.
+** @param #3 String with the value of the request (optional).
+** @param #4 Table of options (optional).
+** @return Function to process the LDAP result: it returns true, the name
+**	and the value of the response (nil when absent).
+*/
+static int lualdap_extended (lua_State *L) {
+	conn_data *conn = getconnection (L);
+	ldap_pchar_t oid = (ldap_pchar_t) luaL_checkstring (L, 2);
+	BerValue bvalue, *data = NULL;
+	ctrls_data ctrls;
+	ldap_int_t rc, msgid;
+	size_t len;
+	double start = 0.0;
+	if (!lua_isnoneornil (L, 3)) {
+		bvalue.bv_val = (char *)luaL_checklstring (L, 3, &len);
+		bvalue.bv_len = len;
+		data = &bvalue;
+	}
+	rc = get_ctrls_param (L, conn, 4, &ctrls, 0);
+	if (rc == LDAP_SUCCESS) {
+		start = monotonic ();
+		rc = ldap_extended_operation (conn->ld, oid, data, C_array (&ctrls), NULL, &msgid);
+		C_free (&ctrls);
+	}
+	return create_future (L, rc, 1, msgid, LDAP_RES_EXTENDED, start);
+}
+
+
+/*
+** Get the authorization identity of the result of a Who am I? operation.
+** #1 upvalue == function to process the LDAP result of the operation.
+*/
+static int whoami_result (lua_State *L) {
+	lua_settop (L, 0);
+	lua_pushvalue (L, lua_upvalueindex (1));
+	lua_call (L, 0, 3);
+	if (lua_isnil (L, 1))
+		return 2; /* nil, error message */
+	if (lua_isnil (L, 3))
+		lua_pushliteral (L, ""); /* anonymous */
+	return 1;
+}
+
+
+/*
+** Ask the server the authorization identity of the connection with
+** a Who am I? extended operation (RFC 4532).
+** @param #1 LDAP connection.
+** @param #2 Table of options (optional).
+** @return Function to process the LDAP result: it returns the
+**	authorization identity ("" when anonymous).
+*/
+static int lualdap_whoami (lua_State *L) {
+	getconnection (L);
+	lua_settop (L, 2);
+	lua_pushliteral (L, LDAP_EXOP_WHO_AM_I);
+	lua_insert (L, 2);
+	lua_pushnil (L);
+	lua_insert (L, 3);
+	if (lualdap_extended (L) != 1)
+		return 2; /* nil, error message */
+	lua_pushcclosure (L, whoami_result, 1);
+	return 1;
+}
+
+
+/*
+** Check that the server of the connection answers, with a Who am I?
+** operation (any answer, even an error, is fine).
+** @param #1 LDAP connection.
+** @param #2 Number with the maximum time to wait in seconds (optional).
+** @return #1 Number with the round-trip time in seconds.
+*/
+static int lualdap_ping (lua_State *L) {
+	conn_data *conn = getconnection (L);
+	double timeout = luaL_optnumber (L, 2, 0.0);
+	double start = monotonic ();
+	int rc = conn_probe (conn, timeout);
+	if (rc != LDAP_SUCCESS) {
+		if (conn_lost (conn, rc))
+			conn_reconnect (L, conn); /* for the next operations */
+		return faildirect (L, ldap_err2string (rc));
+	}
+	lua_pushnumber (L, monotonic () - start);
+	return 1;
+}
+
+
+/*
+** Convert a string into an internal LDAP_MOD operation code.
+*/
+static int op2code (const char *s) {
+	if (!s)
+		return LUALDAP_NO_OP;
+	switch (*s) {
+		case '+':
+			return LUALDAP_MOD_ADD;
+		case '-':
+			return LUALDAP_MOD_DEL;
+		case '=':
+			return LUALDAP_MOD_REP;
+		default:
+			return LUALDAP_NO_OP;
+	}
+}
+
+
+/*
+** Modify an entry.
+** @param #1 LDAP connection.
+** @param #2 String with entry's DN.
+** @param #3, #4... Tables with modifications to apply.
+** @param #n Table of options (optional, must be the last argument).
+** @return True on success or nil, error message otherwise.
+*/
+static int lualdap_modify (lua_State *L) {
+	conn_data *conn = getconnection (L);
+	ldap_pchar_t dn = (ldap_pchar_t) luaL_checkstring (L, 2);
+	attrs_data attrs;
+	ctrls_data ctrls;
+	chunk_data chunks[LUALDAP_MAX_ATTRS];
+	ldap_int_t rc, msgid;
+	int param = 3;
+	int top = lua_gettop (L);
+	int options = 0;
+	int chunk = 0;
+	int i, nchunks = 0, nrequests = 1;
+	future_data *f;
+	double start;
+
+	/* the last argument may be a table of options */
+	if (top > 2 && lua_istable (L, top) && is_options (L, top)) {
+		options = top;
+		lua_getfield (L, options, "chunk");
+		if (lua_isnumber (L, -1))
+			chunk = (int)lua_tonumber (L, -1);
+		else if (!lua_isnil (L, -1))
+			return option_error (L, "chunk", "number");
+		luaL_argcheck (L, lua_isnil (L, -1) || chunk > 0, options, LUALDAP_PREFIX"invalid chunk size");
+		lua_getfield (L, options, "assert");
+		/* the assertion would not cover the requests of the other chunks */
+		luaL_argcheck (L, chunk == 0 || lua_isnil (L, -1), options,
+			LUALDAP_PREFIX"options `assert' and `chunk' cannot be combined");
+		lua_pop (L, 2);
+	}
+	A_init (&attrs);
+	if (chunk > 0) { /* a request may hold more values than the arrays of attrs */
+		int n = 0; /* the first request holds the most values */
+		for (i = param; i != options && lua_istable (L, i); i++) {
+			lua_rawgeti (L, i, 1);
+			n += A_countchunks (L, i, op2code (lua_tostring (L, -1)), chunk);
+			lua_pop (L, 1);
+		}
+		A_reserve (L, &attrs, n);
+	}
+	while (param != options && lua_istable (L, param)) {
+		int op;
+		/* get operation ('+','-','=' operations allowed) */
+		lua_rawgeti (L, param, 1);
+		op = op2code (lua_tostring (L, -1));
+		if (op == LUALDAP_NO_OP)
+			return luaL_error (L, LUALDAP_PREFIX"forgotten operation on argument #%d", param);
+		/* get array of attributes and values */
+		if (chunk > 0)
+			A_tab2chunks (L, &attrs, param, op, chunk, chunks, &nchunks);
+		else
+			A_tab2mod (L, &attrs, param, op);
+		param++;
+	}
+	A_lastattr (L, &attrs);
+	rc = get_ctrls_param (L, conn, options, &ctrls, 1);
+	start = monotonic ();
+	if (rc != LDAP_SUCCESS || nchunks == 0) {
+		if (rc == LDAP_SUCCESS) {
+			rc = ldap_modify_ext (conn->ld, dn, attrs.attrs, C_array (&ctrls), NULL, &msgid);
+			C_free (&ctrls);
+		}
+		return create_future (L, rc, 1, msgid, LDAP_RES_MODIFY, start);
+	}
+
+	/* send the remaining chunks as pipelined requests */
+	for (i = 0; i < nchunks; i++)
+		nrequests += (chunks[i].n - 1) / chunk;
+	lua_pushvalue (L, 1); /* push connection as #1 upvalue */
+	f = create_ticket (L, 1, nrequests); /* push ticket as #2 upvalue */
+	rc = ldap_modify_ext (conn->ld, dn, attrs.attrs, C_array (&ctrls), NULL, &msgid);
+	if (rc == LDAP_SUCCESS)
+		ticket_add (L, f, msgid);
+	for (i = 0; i < nchunks && rc == LDAP_SUCCESS; i++) {
+		int first;
+		for (first = chunk + 1; first <= chunks[i].n && rc == LDAP_SUCCESS; first += chunk) {
+			int last = (first + chunk - 1 < chunks[i].n) ? first + chunk - 1 : chunks[i].n;
+			attrs.ai = attrs.vi = attrs.bi = 0; /* keep the buffer of A_reserve */
+			lua_getfield (L, chunks[i].param, chunks[i].name);
+			A_setmodrange (L, &attrs, chunks[i].op, chunks[i].name, first, last);
+			lua_pop (L, 1);
+			A_lastattr (L, &attrs);
+			rc = ldap_modify_ext (conn->ld, dn, attrs.attrs, C_array (&ctrls), NULL, &msgid);
+			if (rc == LDAP_SUCCESS)
+				ticket_add (L, f, msgid);
+		}
+	}
+	C_free (&ctrls);
+	if (rc != LDAP_SUCCESS) { /* push error message as #3 upvalue */
+		lua_pushliteral (L, LUALDAP_PREFIX);
+		lua_pushstring (L, ldap_err2string (rc));
+		lua_concat (L, 2);
+	} else
+		lua_pushnil (L);
+	lua_pushnumber (L, start); /* push time as #4 upvalue */
+	if (hook_record (L, conn, LUALDAP_OP_MODIFY, 2, -1, start)) /* push record as #5 upvalue */
+		hook_call (L, conn, "start", lua_gettop (L));
+	lua_pushcclosure (L, result_messages, 5);
+	return 1;
+}
+
+
+/*
+** Change the distinguished name of an entry.
+** @param #1 LDAP connection.
+** @param #2 String with entry's DN.
+** @param #3 String with entry's new RDN.
+** @param #4 String with entry's new parent DN (optional).
+** @param #5 Number indicating if the old RDN must be deleted (optional).
+** @param #6 Table of options (optional).
+** @return Function to process the LDAP result.
+*/
+static int lualdap_rename (lua_State *L) {
+	conn_data *conn = getconnection (L);
+	ldap_pchar_t dn = (ldap_pchar_t) luaL_checkstring (L, 2);
+	ldap_pchar_t rdn = (ldap_pchar_t) luaL_checkstring (L, 3);
+	ldap_pchar_t par = (ldap_pchar_t) luaL_optlstring (L, 4, NULL, NULL);
+	const int del = luaL_optnumber (L, 5, 0);
+	ctrls_data ctrls;
+	ldap_int_t msgid;
+	double start = 0.0;
+	ldap_int_t rc = get_ctrls_param (L, conn, 6, &ctrls, 1);
+	if (rc == LDAP_SUCCESS) {
+		start = monotonic ();
+		rc = ldap_rename (conn->ld, dn, rdn, par, del, C_array (&ctrls), NULL, &msgid);
+		C_free (&ctrls);
+	}
+	return create_future (L, rc, 1, msgid, LDAP_RES_MODDN, start);
+}
+
+
+#if !defined(WINLDAP)
+/*
+** Settle the given transaction.
+** @param commit Boolean indicating if the transaction must be committed
+**	(it is aborted otherwise).
+** @return LDAP_SUCCESS or an LDAP error code.
+*/
+static int txn_end (LDAP *ld, BerValue *txn, int commit) {
+	BerElement *ber = ber_alloc_t (LBER_USE_DER);
+	BerValue data;
+	char *oid = NULL;
+	BerValue *retdata = NULL;
+	int rc;
+	if (ber == NULL)
+		return LDAP_NO_MEMORY;
+	/* commit is a BOOLEAN DEFAULT TRUE, thus omitted when true */
+	if (commit)
+		rc = ber_printf (ber, "{O}", txn);
+	else
+		rc = ber_printf (ber, "{bO}", (ber_int_t)0, txn);
+	if (rc == -1 || ber_flatten2 (ber, &data, 0) == -1) {
+		ber_free (ber, 1);
+		return LDAP_ENCODING_ERROR;
+	}
+	rc = ldap_extended_operation_s (ld, LDAP_EXOP_TXN_END, &data, NULL, NULL, &oid, &retdata);
+	ber_free (ber, 1);
+	ldap_memfree (oid);
+	if (retdata != NULL)
+		ber_bvfree (retdata);
+	return rc;
+}
+
+
+/*
+** Group write operations in a transaction (RFC 5805).
+** The function is called with the connection as its only argument;
+** every add, delete, modify and rename it issues on the connection
+** belongs to the transaction, which is committed when the function returns
+** and aborted when it raises an error (the error is then propagated).
+** @param #1 LDAP connection.
+** @param #2 Function issuing the write operations.
+** @return True on success or nil, error message otherwise.
+*/
+static int lualdap_transaction (lua_State *L) {
+	conn_data *conn = getconnection (L);
+	BerValue *txn = NULL;
+	char *oid = NULL;
+	int rc, status;
+	luaL_checktype (L, 2, LUA_TFUNCTION);
+	luaL_argcheck (L, conn->txn == NULL, 1, LUALDAP_PREFIX"transaction already in progress");
+	rc = ldap_extended_operation_s (conn->ld, LDAP_EXOP_TXN_START, NULL, NULL, NULL, &oid, &txn);
+	ldap_memfree (oid);
+	if (rc == LDAP_SUCCESS && txn == NULL)
+		rc = LDAP_PROTOCOL_ERROR;
+	if (rc != LDAP_SUCCESS) {
+		if (txn != NULL)
+			ber_bvfree (txn);
+		return faildirect (L, ldap_err2string (rc));
+	}
+
+	conn->txn = txn;
+	lua_pushvalue (L, 2);
+	lua_pushvalue (L, 1);
+	status = lua_pcall (L, 1, 0, 0);
+	conn->txn = NULL;
+	if (conn->ld != NULL) /* the function may have closed the connection */
+		rc = txn_end (conn->ld, txn, status == 0);
+	else
+		rc = LDAP_SERVER_DOWN;
+	ber_bvfree (txn);
+
+	if (status != 0)
+		return lua_error (L); /* propagate the error of the function */
+	if (rc != LDAP_SUCCESS)
+		return faildirect (L, ldap_err2string (rc));
+	lua_pushboolean (L, 1);
+	return 1;
+}
+#endif
+
+
+/*
+** Push a NULL-terminated array of values: true when there are no values,
+** a string when there is just one value or a table of strings otherwise.
+*/
+static void push_bervals (lua_State *L, BerValue **vals) {
+	int i, n = 0;
+	while (vals != NULL && vals[n] != NULL)
+		n++;
+	if (n == 0) /* no values */
+		lua_pushboolean (L, 1);
+	else if (n == 1) /* just one value */
+		lua_pushlstring (L, vals[0]->bv_val, vals[0]->bv_len);
+	else { /* Multiple values */
+		lua_newtable (L);
+		for (i = 0; i < n; i++) {
+			lua_pushlstring (L, vals[i]->bv_val, vals[i]->bv_len);
+			lua_rawseti (L, -2, i+1);
+		}
+	}
+}
+
+
+/*
+** Push an attribute value (or a table of values) on top of the stack.
+** @param L lua_State.
+** @param ld LDAP Connection.
+** @param entry Current entry.
+** @param attr Name of entry's attribute to get values from.
+** @return 1 in case of success.
+*/
+static int push_values (lua_State *L, LDAP *ld, LDAPMessage *entry, char *attr) {
+	BerValue **vals = ldap_get_values_len (ld, entry, attr);
+	push_bervals (L, vals);
+	ldap_value_free_len (vals);
+	return 1;
+}
+
+
+/*
+** Store entry's attributes and values at the given table.
+** @param entry Current entry.
+** @param tab Absolute stack index of the table.
+*/
+static void set_attribs (lua_State *L, LDAP *ld, LDAPMessage *entry, int tab) {
+	char *attr;
+	BerElement *ber = NULL;
+	for (attr = ldap_first_attribute (ld, entry, &ber);
+		attr != NULL;
+		attr = ldap_next_attribute (ld, entry, ber))
+	{
+		lua_pushstring (L, attr);
+		push_values (L, ld, entry, attr);
+		lua_rawset (L, tab); /* tab[attr] = vals */
+		ldap_memfree (attr);
+	}
+	ber_free (ber, 0); /* don't need to test if (ber == NULL) */
+}
+
+
+/*
+** Get the distinguished name of the given entry and pushes it on the stack.
+*/
+static void push_dn (lua_State *L, LDAP *ld, LDAPMessage *entry) {
+	char *dn = ldap_get_dn (ld, entry);
+	lua_pushstring (L, dn);
+	ldap_memfree (dn);
+}
+
+
+/*
+** Release connection reference.
+** @param abandon Boolean indicating that the remaining results will not be read.
+*/
+static void search_close (lua_State *L, search_data *search, int abandon) {
+	conn_data *conn;
+	lua_rawgeti (L, LUA_REGISTRYINDEX, search->conn);
+	conn = (conn_data *)lua_touserdata (L, -1);
+	if (conn != NULL && conn->ld != NULL && search->generation == conn->generation
+#if !defined(WIN32)
+		&& conn->pid == getpid ()
+#endif
+		&& pending_remove (conn, search->msgid) && abandon)
+		ldap_abandon_ext (conn->ld, search->msgid, NULL, NULL);
+	lua_pop (L, 1);
+	luaL_unref (L, LUA_REGISTRYINDEX, search->conn);
+	search->conn = LUA_NOREF;
+	luaL_unref (L, LUA_REGISTRYINDEX, search->spec);
+	search->spec = LUA_NOREF;
+	luaL_unref (L, LUA_REGISTRYINDEX, search->record);
+	search->record = LUA_NOREF;
+}
+
+
+/*
+** Convert a string to one of the possible scopes of the search.
+*/
+static int string2scope (lua_State *L, const char *s) {
+	if ((s == NULL) || (*s == '\0'))
+		return LDAP_SCOPE_DEFAULT;
+	switch (*s) {
+		case 'b':
+			return LDAP_SCOPE_BASE;
+		case 'o':
+			return LDAP_SCOPE_ONELEVEL;
+		case 's':
+			return LDAP_SCOPE_SUBTREE;
+		default:
+			return luaL_error (L, LUALDAP_PREFIX"invalid search scope `%s'", s);
+	}
+}
+
+
+/*
+** Close the search object.
+*/
+static int lualdap_search_close (lua_State *L) {
+	search_data *search = (search_data *)luaL_checkudata (L, 1, LUALDAP_SEARCH_METATABLE);
+	if (search->conn == LUA_NOREF)
+		return 0;
+	search_close (L, search, 1);
+	lua_pushnumber (L, 1);
+	return 1;
+}
+
+
+/*
+** Create a search object and leaves it on top of the stack.
+*/
+static search_data *create_search (lua_State *L, int conn_index, int msgid, double start) {
+	conn_data *conn = (conn_data *)lua_touserdata (L, conn_index);
+	search_data *search = (search_data *)lua_newuserdata (L, sizeof (search_data));
+	luaL_setmetatable (L, LUALDAP_SEARCH_METATABLE);
+	search->conn = LUA_NOREF;
+	search->msgid = msgid;
+	search->spec = LUA_NOREF;
+	search->entries = 0;
+	search->generation = conn->generation;
+	search->start = start;
+	search->first = 0.0;
+	search->record = LUA_NOREF;
+	pending_add (conn, msgid);
+	lua_pushvalue (L, conn_index);
+	search->conn = luaL_ref (L, LUA_REGISTRYINDEX);
+	return search;
+}
+
+
+/*
+** Fill in the attrs array, according to the attrs parameter.
+*/
+static void get_attrs_param (lua_State *L, int tab, char *attrs[]) {
+	lua_getfield(L, tab, "attrs");
+	if (lua_isstring (L, -1)) {
+		attrs[0] = (char *)lua_tostring (L, -1);
+		attrs[1] = NULL;
+	} else if (!lua_istable (L, -1))
+		attrs[0] = NULL;
+	else {
+		int i;
+		int n = lua_rawlen(L, -1);
+		if (LUALDAP_MAX_ATTRS < (n+1))
+			luaL_error (L, LUALDAP_PREFIX"too many arguments");
+		luaL_checkstack(L, n, NULL);
+		for (i = 0; i < n; i++) {
+			lua_rawgeti (L, -1, i+1); /* push table element */
+			if (lua_isstring (L, -1)) {
+				attrs[i] = (char *)lua_tostring (L, -1);
+				lua_pop(L, 1);
+			} else {
+				luaL_error (L, LUALDAP_PREFIX"invalid value #%d", i+1);
+			}
+		}
+		attrs[n] = NULL;
+	}
+}
+
+
+/*
+** Fill in the struct timeval, according to the timeout parameter.
+*/
+static struct timeval *get_timeout_param (lua_State *L, int tab, struct timeval *st) {
+	double t = numbertabparam (L, tab, "timeout", 0.0);
+	if(t <= 0.0)
+		return NULL; /* No timeout, block */
+	st->tv_sec = (long)t;
+	st->tv_usec = (long)(1000000.0 * (t - (double)st->tv_sec));
+	return st;
+}
+
+
+/*
+** Send a search request.
+** @param tab Stack index of the table of search parameters.
+** @return LDAP_SUCCESS or an LDAP error code.
+*/
+static int search_send (lua_State *L, conn_data *conn, int tab, int *msgid) {
+	ldap_pchar_t base;
+	ldap_pchar_t filter;
+	char *attrs[LUALDAP_MAX_ATTRS];
+	int scope, attrsonly, sizelimit, rc;
+	int top = lua_gettop (L);
+	struct timeval st, *timeout;
+	ctrls_data ctrls;
+
+	get_attrs_param (L, tab, attrs);
+	/* get other parameters */
+	attrsonly = booltabparam (L, tab, "attrsonly", 0);
+	base = (ldap_pchar_t) strtabparam (L, tab, "base", NULL);
+	filter = (ldap_pchar_t) strtabparam (L, tab, "filter", NULL);
+	scope = string2scope (L, strtabparam (L, tab, "scope", NULL));
+	sizelimit = longtabparam (L, tab, "sizelimit", LDAP_NO_LIMIT);
+	timeout = get_timeout_param (L, tab, &st);
+
+	rc = get_ctrls_param (L, conn, tab, &ctrls, 0);
+	if (rc == LDAP_SUCCESS) {
+		rc = ldap_search_ext (conn->ld, base, scope, filter, attrs, attrsonly,
+			C_array (&ctrls), NULL, timeout, sizelimit, msgid);
+		C_free (&ctrls);
+	}
+	lua_settop (L, top);
+	return rc;
+}
+
+
+/*
+** Send a search again on a reopened connection, when no entry was returned yet.
+** @return LDAP_SUCCESS or an LDAP error code.
+*/
+static int search_replay (lua_State *L, conn_data *conn, search_data *search) {
+	int rc;
+	if (search->spec == LUA_NOREF || search->entries)
+		return LDAP_SERVER_DOWN;
+	lua_rawgeti (L, LUA_REGISTRYINDEX, search->spec);
+	rc = search_send (L, conn, lua_gettop (L), &search->msgid);
+	lua_pop (L, 1);
+	search->generation = conn->generation;
+	if (rc == LDAP_SUCCESS)
+		pending_add (conn, search->msgid);
+	return rc;
+}
+
+
+/*
+** Record the statistics of a search on its final message and call the hook
+** of the connection.
+*/
+static void search_done (lua_State *L, conn_data *conn, search_data *search, LDAPMessage *res) {
+	int err = LDAP_OTHER;
+	if (ldap_parse_result (conn->ld, res, &err, NULL, NULL, NULL, NULL, 0) != LDAP_SUCCESS)
+		err = LDAP_OTHER;
+	stats_result (conn, err);
+	stats_op (conn, LUALDAP_OP_SEARCH, search->start, err != LDAP_SUCCESS);
+	if (search->record != LUA_NOREF) {
+		lua_rawgeti (L, LUA_REGISTRYINDEX, search->record);
+		lua_pushinteger (L, search->entries);
+		lua_setfield (L, -2, "entries");
+		hook_done (L, conn, lua_gettop (L), err, search->first);
+		lua_pop (L, 1);
+	}
+}
+
+
+/*
+** Retrieve next message...
+** @return #1 entry's distinguished name.
+** @return #2 table with entry's attributes and values.
+*/
+static int next_message (lua_State *L) {
+	search_data *search = getsearch (L);
+	conn_data *conn;
+	struct timeval *timeout = NULL; /* ??? function parameter ??? */
+	LDAPMessage *res;
+	int rc;
+	int ret;
+
+	lua_rawgeti (L, LUA_REGISTRYINDEX, search->conn);
+	conn = (conn_data *)lua_touserdata (L, -1); /* get connection */
+	conn_check_fork (L, conn);
+
+	if (search->generation != conn->generation /* the request was lost */
+		&& search_replay (L, conn, search) != LDAP_SUCCESS)
+		return faildirect (L, LUALDAP_PREFIX"connection lost");
+	rc = ldap_result (conn->ld, search->msgid, LDAP_MSG_ONE, timeout, &res);
+	if (rc == -1 && conn_lost (conn, ld_errno (conn->ld))) {
+		const char *errmsg;
+		ldap_msgfree (res);
+		errmsg = conn_reconnect (L, conn);
+		if (errmsg != NULL)
+			return faildirect (L, errmsg);
+		if (search_replay (L, conn, search) != LDAP_SUCCESS)
+			return faildirect (L, LUALDAP_PREFIX"connection lost");
+		rc = ldap_result (conn->ld, search->msgid, LDAP_MSG_ONE, timeout, &res);
+	}
+	if (rc > 0 && search->first <= 0.0)
+		search->first = monotonic ();
+	if (rc == 0)
+		return faildirect (L, LUALDAP_PREFIX"result timeout expired");
+	else if (rc == -1)
+		return faildirect (L, LUALDAP_PREFIX"result error");
+	else if (rc == LDAP_RES_SEARCH_RESULT) { /* last message => nil */
+		search_done (L, conn, search, res);
+		/* close search object to avoid reuse */
+		search_close (L, search, 0);
+		ret = 0;
+	} else {
+		LDAPMessage *msg = ldap_first_message (conn->ld, res);
+		switch (ldap_msgtype (msg)) {
+			case LDAP_RES_SEARCH_ENTRY: {
+				LDAPMessage *entry = ldap_first_entry (conn->ld, msg);
+				push_dn (L, conn->ld, entry);
+				lua_newtable (L);
+				set_attribs (L, conn->ld, entry, lua_gettop (L));
+				search->entries++;
+				conn->stats.entries++;
+				ret = 2; /* two return values */
+				break;
+			}
+/*No reference to LDAP_RES_SEARCH_REFERENCE on MSDN. Maybe there is a replacement to it?*/
+#ifdef LDAP_RES_SEARCH_REFERENCE
+			case LDAP_RES_SEARCH_REFERENCE: {
+				LDAPMessage *ref = ldap_first_reference (conn->ld, msg);
+				push_dn (L, conn->ld, ref); /* is this supposed to work? */
+				lua_pushnil (L);
+				ret = 2; /* two return values */
+				break;
+			}
+#endif
+			case LDAP_RES_SEARCH_RESULT:
+				search_done (L, conn, search, msg);
+				/* close search object to avoid reuse */
+				search_close (L, search, 0);
+				ret = 0;
+				break;
+			default:
+				ldap_msgfree (res);
+				return luaL_error (L, LUALDAP_PREFIX"error on search result chain");
+		}
+	}
+	ldap_msgfree (res);
+	return ret;
+}
+
+
+/*
+** Perform a search operation.
+** @return #1 Function to iterate over the result entries.
+** @return #2 nil.
+** @return #3 nil as first entry.
+** The search result is defined as an upvalue of the iterator.
+*/
+static int lualdap_search (lua_State *L) {
+	conn_data *conn = getconnection (L);
+	search_data *search;
+	int msgid, rc;
+	double start = monotonic ();
+
+	if (!lua_istable (L, 2))
+		return luaL_error (L, LUALDAP_PREFIX"no search specification");
+	rc = search_send (L, conn, 2, &msgid);
+	if (conn_lost (conn, rc) && conn_reconnect (L, conn) == NULL)
+		rc = search_send (L, conn, 2, &msgid);
+	if (rc != LDAP_SUCCESS)
+		return luaL_error (L, LUALDAP_PREFIX"%s", ldap_err2string (rc));
+
+	search = create_search (L, 1, msgid, start);
+	if (conn->reconnect) { /* keep the specification to send it again */
+		lua_pushvalue (L, 2);
+		search->spec = luaL_ref (L, LUA_REGISTRYINDEX);
+	}
+	if (hook_record (L, conn, LUALDAP_OP_SEARCH, 0, msgid, search->start)) {
+		static const char *const fields[] = { "base", "scope", "filter", NULL };
+		int i;
+		for (i = 0; fields[i] != NULL; i++) {
+			lua_getfield (L, 2, fields[i]);
+			lua_setfield (L, -2, (i == 0) ? "dn" : fields[i]);
+		}
+		hook_call (L, conn, "start", lua_gettop (L));
+		search->record = luaL_ref (L, LUA_REGISTRYINDEX);
+	} else
+		lua_pop (L, 1);
+	lua_pushcclosure (L, next_message, 1);
+	lua_pushvalue(L, 2);
+	return 2;
+}
+
+
+#if !defined(WINLDAP)
+/*
+** Check if the server advertises the given control on its root DSE.
+*/
+static int supports_control (LDAP *ld, const char *oid) {
+	static char *attrs[] = { (char *)"supportedControl", NULL };
+	LDAPMessage *res = NULL;
+	int found = 0;
+	if (ldap_search_ext_s (ld, "", LDAP_SCOPE_BASE, "(objectClass=*)", attrs, 0,
+		NULL, NULL, NULL, LDAP_NO_LIMIT, &res) == LDAP_SUCCESS) {
+		LDAPMessage *entry = ldap_first_entry (ld, res);
+		if (entry != NULL) {
+			BerValue **vals = ldap_get_values_len (ld, entry, attrs[0]);
+			int i, n = ldap_count_values_len (vals);
+			for (i = 0; i < n && !found; i++)
+				found = (vals[i]->bv_len == strlen (oid)
+					&& memcmp (vals[i]->bv_val, oid, vals[i]->bv_len) == 0);
+			ldap_value_free_len (vals);
+		}
+	}
+	if (res != NULL)
+		ldap_msgfree (res);
+	return found;
+}
+
+
+/*
+** Get the depth of a distinguished name (its number of RDNs).
+*/
+static int dn_depth (const char *dn) {
+	int depth = 1;
+	int escaped = 0;
+	for (; *dn != '\0'; dn++) {
+		if (escaped)
+			escaped = 0;
+		else if (*dn == '\\')
+			escaped = 1;
+		else if (*dn == ',')
+			depth++;
+	}
+	return depth;
+}
+
+
+/*
+** Store a distinguished name (allocated by libldap) on the subtree structure.
+*/
+static int tree_add (tree_data *t, char *dn) {
+	if (dn == NULL)
+		return LDAP_NO_MEMORY;
+	if (t->n == t->size) {
+		size_t size = (t->size == 0) ? LUALDAP_PAGE_SIZE : 2 * t->size;
+		tree_entry *entries = (tree_entry *)realloc (t->entries, size * sizeof (tree_entry));
+		if (entries == NULL) {
+			ldap_memfree (dn);
+			return LDAP_NO_MEMORY;
+		}
+		t->entries = entries;
+		t->size = size;
+	}
+	t->entries[t->n].dn = dn;
+	t->entries[t->n].depth = dn_depth (dn);
+	t->n++;
+	return LDAP_SUCCESS;
+}
+
+
+/*
+** Release the subtree structure.
+*/
+static void tree_free (tree_data *t) {
+	size_t i;
+	for (i = 0; i < t->n; i++)
+		ldap_memfree (t->entries[i].dn);
+	free (t->entries);
+	t->entries = NULL;
+	t->n = t->size = 0;
+}
+
+
+/*
+** Collect the distinguished names of the entries of a subtree
+** (the paged results control is used to get past server size limits).
+** @return LDAP_SUCCESS or an LDAP error code.
+*/
+static int tree_collect (LDAP *ld, const char *base, tree_data *t) {
+	static char *attrs[] = { (char *)"1.1", NULL }; /* no attributes */
+	BerValue cookie;
+	int rc;
+	cookie.bv_len = 0;
+	cookie.bv_val = NULL;
+	do {
+		LDAPControl *ctrls[2];
+		LDAPControl **rctrls = NULL;
+		LDAPMessage *res;
+		int msgid, err;
+		rc = ldap_create_page_control (ld, LUALDAP_PAGE_SIZE, &cookie, 0, &ctrls[0]);
+		ber_memfree (cookie.bv_val);
+		cookie.bv_len = 0;
+		cookie.bv_val = NULL;
+		if (rc != LDAP_SUCCESS)
+			break;
+		ctrls[1] = NULL;
+		rc = ldap_search_ext (ld, base, LDAP_SCOPE_SUBTREE, "(objectClass=*)", attrs, 0,
+			ctrls, NULL, NULL, LDAP_NO_LIMIT, &msgid);
+		ldap_control_free (ctrls[0]);
+		if (rc != LDAP_SUCCESS)
+			break;
+		while ((rc = ldap_result (ld, msgid, LDAP_MSG_ONE, NULL, &res)) == LDAP_RES_SEARCH_ENTRY
+			|| rc == LDAP_RES_SEARCH_REFERENCE) {
+			if (rc == LDAP_RES_SEARCH_ENTRY && tree_add (t, ldap_get_dn (ld, res)) != LDAP_SUCCESS) {
+				ldap_msgfree (res);
+				ldap_abandon_ext (ld, msgid, NULL, NULL);
+				return LDAP_NO_MEMORY;
+			}
+			ldap_msgfree (res);
+		}
+		if (rc != LDAP_RES_SEARCH_RESULT) {
+			if (rc > 0)
+				ldap_msgfree (res);
+			return (rc < 0) ? ld_errno (ld) : LDAP_PROTOCOL_ERROR;
+		}
+		rc = ldap_parse_result (ld, res, &err, NULL, NULL, NULL, &rctrls, 1);
+		if (rc == LDAP_SUCCESS)
+			rc = err;
+		if (rc == LDAP_SUCCESS && rctrls != NULL) {
+			LDAPControl *ctrl = ldap_control_find (LDAP_CONTROL_PAGEDRESULTS, rctrls, NULL);
+			ber_int_t count;
+			if (ctrl != NULL)
+				rc = ldap_parse_pageresponse_control (ld, ctrl, &count, &cookie);
+		}
+		if (rctrls != NULL)
+			ldap_controls_free (rctrls);
+	} while (rc == LDAP_SUCCESS && cookie.bv_len > 0);
+	ber_memfree (cookie.bv_val);
+	return rc;
+}
+
+
+/*
+** Wait for the result of a delete operation.
+** @return The result code of the operation.
+*/
+static int tree_wait (LDAP *ld, int msgid) {
+	LDAPMessage *res;
+	int err;
+	int rc = ldap_result (ld, msgid, LDAP_MSG_ALL, NULL, &res);
+	if (rc <= 0)
+		return ld_errno (ld);
+	rc = ldap_parse_result (ld, res, &err, NULL, NULL, NULL, NULL, 1);
+	return (rc == LDAP_SUCCESS) ? err : rc;
+}
+
+
+/*
+** Compare the depth of two entries: deepest first.
+*/
+static int tree_order (const void *a, const void *b) {
+	return ((const tree_entry *)b)->depth - ((const tree_entry *)a)->depth;
+}
+
+
+/*
+** Delete the entries of a subtree, leaves first.
+** Entries with the same depth do not depend on each other, so they are
+** deleted by pipelined batches of at most `parallel' requests, which are
+** spread over the given connections.
+** Each request is counted and reported to the hook of its connection
+** as a delete operation (a hook may close the connection meanwhile).
+** @param records Stack index of the table of the records of the requests.
+** @param failed Index of the entry whose deletion failed.
+** @return LDAP_SUCCESS or an LDAP error code.
+*/
+static int tree_delete (lua_State *L, conn_data **conns, int nconns, tree_data *t,
+	tree_op *ops, int parallel, int records, size_t *failed)
+{
+	size_t i = 0, next = 0;
+	int rc = LDAP_SUCCESS;
+	qsort (t->entries, t->n, sizeof (tree_entry), tree_order);
+	while (i < t->n && rc == LDAP_SUCCESS) {
+		size_t end = i, j = i;
+		int head = 0, count = 0;
+		while (end < t->n && t->entries[end].depth == t->entries[i].depth)
+			end++;
+		while ((j < end && rc == LDAP_SUCCESS) || count > 0) {
+			if (j < end && rc == LDAP_SUCCESS && count < parallel) {
+				int slot = (head + count) % parallel;
+				tree_op *op = &ops[slot];
+				op->conn = conns[next++ % nconns];
+				op->entry = j++;
+				op->start = monotonic ();
+				if (op->conn->ld == NULL)
+					rc = LDAP_SERVER_DOWN;
+				else
+					rc = ldap_delete_ext (op->conn->ld, t->entries[op->entry].dn, NULL, NULL, &op->msgid);
+				if (rc == LDAP_SUCCESS) {
+					lua_pushstring (L, t->entries[op->entry].dn);
+					if (hook_record (L, op->conn, LUALDAP_OP_DELETE, lua_gettop (L), op->msgid, op->start))
+						hook_call (L, op->conn, "start", lua_gettop (L));
+					lua_rawseti (L, records, slot + 1);
+					lua_pop (L, 1); /* DN */
+					count++;
+				} else {
+					stats_result (op->conn, rc);
+					stats_op (op->conn, LUALDAP_OP_DELETE, op->start, 1);
+					*failed = op->entry;
+				}
+			} else {
+				tree_op *op = &ops[head];
+				int err = (op->conn->ld != NULL) ? tree_wait (op->conn->ld, op->msgid) : LDAP_SERVER_DOWN;
+				stats_result (op->conn, err);
+				stats_op (op->conn, LUALDAP_OP_DELETE, op->start, err != LDAP_SUCCESS);
+				lua_rawgeti (L, records, head + 1);
+				hook_done (L, op->conn, lua_gettop (L), err, 0.0);
+				lua_pop (L, 1);
+				head = (head + 1) % parallel;
+				count--;
+				/* entries deleted in the meantime are not an error */
+				if (err != LDAP_SUCCESS && err != LDAP_NO_SUCH_OBJECT && rc == LDAP_SUCCESS) {
+					rc = err;
+					*failed = op->entry;
+				}
+			}
+		}
+		i = end;
+	}
+	return rc;
+}
+
+
+/*
+** Delete a subtree by enumerating its entries.
+** #1 upvalue == connection
+** #2 upvalue == distinguished name of the subtree
+** #3 upvalue == maximum number of pipelined requests
+** #4 upvalue == table of additional connections (or nil)
+*/
+static int tree_delete_future (lua_State *L) {
+	conn_data *conn = (conn_data *)lua_touserdata (L, lua_upvalueindex (1));
+	const char *dn = lua_tostring (L, lua_upvalueindex (2));
+	int parallel = (int)lua_tonumber (L, lua_upvalueindex (3));
+	int i, nconns = 1, keep, records;
+	conn_data **conns;
+	tree_op *ops;
+	tree_data t;
+	size_t failed = (size_t)-1;
+	int rc;
+
+	conn_check_fork (L, conn);
+	luaL_argcheck (L, conn->ld, 1, LUALDAP_PREFIX"LDAP connection is closed");
+	if (lua_istable (L, lua_upvalueindex (4)))
+		nconns += (int)lua_rawlen (L, lua_upvalueindex (4));
+	conns = (conn_data **)lua_newuserdata (L, nconns * sizeof (conn_data *));
+	conns[0] = conn;
+	lua_newtable (L); /* keeps the connections even if a hook changes their list */
+	keep = lua_gettop (L);
+	for (i = 1; i < nconns; i++) {
+		conn_data *other;
+		lua_rawgeti (L, lua_upvalueindex (4), i);
+		other = toconnection (L, -1);
+		if (other != NULL)
+			conn_check_fork (L, other);
+		if (other == NULL || other->ld == NULL)
+			return luaL_error (L, LUALDAP_PREFIX"invalid connection #%d", i);
+		conns[i] = other;
+		lua_rawseti (L, keep, i);
+	}
+	ops = (tree_op *)lua_newuserdata (L, parallel * sizeof (tree_op));
+	lua_newtable (L);
+	records = lua_gettop (L);
+
+	t.entries = NULL;
+	t.n = t.size = 0;
+	rc = tree_collect (conn->ld, dn, &t);
+	if (rc == LDAP_SUCCESS)
+		rc = tree_delete (L, conns, nconns, &t, ops, parallel, records, &failed);
+	if (rc != LDAP_SUCCESS) {
+		lua_pushnil (L);
+		if (failed < t.n)
+			lua_pushfstring (L, LUALDAP_PREFIX"%s (%s)", ldap_err2string (rc), t.entries[failed].dn);
+		else
+			lua_pushfstring (L, LUALDAP_PREFIX"%s", ldap_err2string (rc));
+	} else
+		lua_pushboolean (L, 1);
+	tree_free (&t);
+	return (rc != LDAP_SUCCESS) ? 2 : 1;
+}
+
+
+/*
+** Delete an entry and all its descendants.
+** The tree delete control is used when the server advertises it;
+** otherwise the entries are deleted leaves first by the returned function.
+** @param #1 LDAP connection.
+** @param #2 String with the DN of the subtree.
+** @param #3 Table of options (optional):
+**	parallel => maximum number of pipelined delete requests
+**		(at most LUALDAP_MAX_PARALLEL);
+**	connections => list of additional connections to spread the requests.
+** @return Function to process the LDAP result.
+*/
+static int lualdap_delete_tree (lua_State *L) {
+	conn_data *conn = getconnection (L);
+	ldap_pchar_t dn = (ldap_pchar_t) luaL_checkstring (L, 2);
+	lua_Number parallel = 1;
+	int connections = 0;
+	if (!lua_isnoneornil (L, 3)) {
+		luaL_checktype (L, 3, LUA_TTABLE);
+		lua_getfield (L, 3, "parallel");
+		if (lua_isnumber (L, -1))
+			parallel = lua_tonumber (L, -1);
+		else if (!lua_isnil (L, -1))
+			return option_error (L, "parallel", "number");
+		luaL_argcheck (L, parallel >= 1, 3, LUALDAP_PREFIX"invalid number of parallel requests");
+		if (parallel > LUALDAP_MAX_PARALLEL)
+			parallel = LUALDAP_MAX_PARALLEL;
+		lua_getfield (L, 3, "connections");
+		if (lua_istable (L, -1))
+			connections = lua_gettop (L);
+		else if (!lua_isnil (L, -1))
+			return option_error (L, "connections", "table");
+	}
+
+	if (conn->tree_delete < 0) /* the root DSE is read once per connection */
+		conn->tree_delete = supports_control (conn->ld, LUALDAP_CONTROL_TREE_DELETE);
+	if (conn->tree_delete) {
+		LDAPControl *ctrls[2];
+		ldap_int_t rc, msgid;
+		double start = monotonic ();
+		rc = ldap_control_create (LUALDAP_CONTROL_TREE_DELETE, 1, NULL, 0, &ctrls[0]);
+		if (rc == LDAP_SUCCESS) {
+			ctrls[1] = NULL;
+			rc = ldap_delete_ext (conn->ld, dn, ctrls, NULL, &msgid);
+			ldap_control_free (ctrls[0]);
+		}
+		return create_future (L, rc, 1, msgid, LDAP_RES_DELETE, start);
+	}
+
+	lua_pushvalue (L, 1); /* push connection as #1 upvalue */
+	lua_pushvalue (L, 2); /* push DN as #2 upvalue */
+	lua_pushnumber (L, (int)parallel); /* push parallel as #3 upvalue */
+	if (connections) /* push connections as #4 upvalue */
+		lua_pushvalue (L, connections);
+	else
+		lua_pushnil (L);
+	lua_pushcclosure (L, tree_delete_future, 4);
+	return 1;
+}
+#endif
+
+
+/*
+** Check if two attribute names are equal (case insensitive).
+*/
+static int name_equal (const char *a, const char *b) {
+	for (; *a != '\0' && *b != '\0'; a++, b++)
+		if (tolower ((unsigned char)*a) != tolower ((unsigned char)*b))
+			return 0;
+	return *a == *b;
+}
+
+
+/*
+** Push the value of the named attribute of the entry table
+** (attribute names are case insensitive).
+*/
+static void push_attr (lua_State *L, int entry, const char *name) {
+	lua_getfield (L, entry, name);
+	if (!lua_isnil (L, -1))
+		return;
+	lua_pop (L, 1);
+	lua_pushnil (L); /* first key for lua_next */
+	while (lua_next (L, entry) != 0) {
+		if (lua_type (L, -2) == LUA_TSTRING && name_equal (lua_tostring (L, -2), name)) {
+			lua_remove (L, -2); /* remove key */
+			return;
+		}
+		lua_pop (L, 1); /* pop value */
+	}
+	lua_pushnil (L);
+}
+
+
+/*
+** Count the values of an attribute on the given stack position.
+*/
+static int V_count (lua_State *L, int idx) {
+	if (lua_isstring (L, idx))
+		return 1;
+	else if (lua_istable (L, idx))
+		return (int)lua_rawlen (L, idx);
+	return 0;
+}
+
+
+/*
+** Store the value on top of the stack and pop it.
+** Numbers are converted to strings, which are kept by the table at
+** position anchor until the request is sent.
+*/
+static void V_set (lua_State *L, BerValue *val, int anchor, const char *name) {
+	size_t len;
+	int number = (lua_type (L, -1) == LUA_TNUMBER);
+	if (!lua_isstring (L, -1))
+		value_error (L, name);
+	val->bv_val = (char *)lua_tolstring (L, -1, &len);
+	val->bv_len = len;
+	if (number)
+		lua_rawseti (L, anchor, (int)lua_rawlen (L, anchor) + 1);
+	else
+		lua_pop (L, 1); /* the string is kept by the table of values */
+}
+
+
+/*
+** Store the values of an attribute on the given stack position.
+** Valid values are:
+**	false or nil => no values;
+**	true => no values (only allowed for current values);
+**	string => one value; or
+**	table of strings => many values.
+** @param anchor Stack index of the table keeping the converted numbers.
+** @return Number of stored values.
+*/
+static int V_collect (lua_State *L, int idx, BerValue *vals, const char *name, int current, int anchor) {
+	int i, n = 0;
+	if (lua_isstring (L, idx)) {
+		lua_pushvalue (L, idx);
+		V_set (L, &vals[0], anchor, name);
+		n = 1;
+	} else if (lua_istable (L, idx)) {
+		n = (int)lua_rawlen (L, idx);
+		for (i = 0; i < n; i++) {
+			lua_rawgeti (L, idx, i+1); /* push table element */
+			V_set (L, &vals[i], anchor, name);
+		}
+	} else if (!lua_isnoneornil (L, idx) && !(lua_isboolean (L, idx) && (current || !lua_toboolean (L, idx))))
+		value_error (L, name);
+	return n;
+}
+
+
+/*
+** Hash an attribute value (FNV-1a).
+*/
+static unsigned bv_hash (const BerValue *bv) {
+	unsigned h = 2166136261U;
+	ber_len_t i;
+	for (i = 0; i < bv->bv_len; i++)
+		h = (h ^ (unsigned char)bv->bv_val[i]) * 16777619U;
+	return h;
+}
+
+
+/*
+** Find a value on the hash set.
+** @return Slot of the value or of the empty position where it belongs.
+*/
+static unsigned S_slot (bvset_data *set, const BerValue *bv) {
+	unsigned i = bv_hash (bv) & set->mask;
+	while (set->slots[i] != 0) {
+		const BerValue *v = &set->vals[set->slots[i] - 1];
+		if (v->bv_len == bv->bv_len && memcmp (v->bv_val, bv->bv_val, bv->bv_len) == 0)
+			break;
+		i = (i + 1) & set->mask;
+	}
+	return i;
+}
+
+
+/*
+** Build a hash set of values, removing the duplicated ones.
+** @return Number of distinct values (which are moved to the head of vals).
+*/
+static int S_build (bvset_data *set, int *slots, BerValue *vals, int n) {
+	int i, m = 0;
+	unsigned size = 2;
+	while (size < 2 * (unsigned)n)
+		size *= 2;
+	set->vals = vals;
+	set->slots = slots;
+	set->mask = size - 1;
+	memset (slots, 0, size * sizeof (int));
+	for (i = 0; i < n; i++) {
+		unsigned slot = S_slot (set, &vals[i]);
+		if (set->slots[slot] == 0) {
+			vals[m] = vals[i];
+			set->slots[slot] = ++m;
+		}
+	}
+	return m;
+}
+
+
+/*
+** Check if a value belongs to the hash set.
+*/
+static int S_has (bvset_data *set, const BerValue *bv) {
+	return set->slots[S_slot (set, bv)] != 0;
+}
+
+
+/*
+** Set a modification with the given values.
+*/
+static void sync_setmod (LDAPMod **attrs, LDAPMod *mods, int *nmods, int op, const char *name, BerValue **vals) {
+	mods[*nmods].mod_op = op;
+	mods[*nmods].mod_type = (char *)name;
+	mods[*nmods].mod_bvalues = vals;
+	attrs[*nmods] = &mods[*nmods];
+	(*nmods)++;
+	attrs[*nmods] = NULL;
+}
+
+
+/*
+** Fetch an entry and push a table with its attributes.
+** @return LDAP_SUCCESS or an LDAP error code.
+*/
+static int fetch_entry (lua_State *L, LDAP *ld, const char *dn, char **attrs) {
+	LDAPMessage *res = NULL, *entry;
+	int rc = ldap_search_ext_s (ld, dn, LDAP_SCOPE_BASE, "(objectClass=*)", attrs, 0,
+		NULL, NULL, NULL, LDAP_NO_LIMIT, &res);
+	if (rc == LDAP_SUCCESS) {
+		entry = ldap_first_entry (ld, res);
+		if (entry != NULL) {
+			lua_newtable (L);
+			set_attribs (L, ld, entry, lua_gettop (L));
+		} else
+			rc = LDAP_NO_SUCH_OBJECT;
+	}
+	if (res != NULL)
+		ldap_msgfree (res);
+	return rc;
+}
+
+
+/*
+** Function returned when there is nothing to be done.
+*/
+static int nothing_to_do (lua_State *L) {
+	lua_pushboolean (L, 1);
+	return 1;
+}
+
+
+/*
+** Synchronize an entry with the desired values of its attributes.
+** The current values are compared with the desired ones and the minimal
+** set of modifications is sent in a single modify request: for each
+** attribute, either its missing and extra values are added and deleted,
+** or the whole list is replaced, whichever sends less values.
+** Values are compared byte by byte.
+** @param #1 LDAP connection.
+** @param #2 String with entry's DN.
+** @param #3 Table with the desired attributes and values
+**	(false or an empty table means that the attribute must be removed).
+** @param #4 Table of options (optional):
+**	current => table with the current attributes and values (the entry
+**	is fetched from the directory otherwise);
+**	and the options of write operations.
+** @return Function to process the LDAP result.
+*/
+static int lualdap_sync_entry (lua_State *L) {
+	conn_data *conn = getconnection (L);
+	ldap_pchar_t dn = (ldap_pchar_t) luaL_checkstring (L, 2);
+	int current = 0;
+	int na = 0, totald = 0, totalc = 0, maxn = 1;
+	int nmods = 0, doff = 0, coff = 0, poff = 0, anchor;
+	unsigned nslots = 2;
+	LDAPMod **attrs;
+	LDAPMod *mods;
+	BerValue **ptrs, *dv, *cv;
+	int *slots;
+	char **names;
+	ctrls_data ctrls;
+	ldap_int_t rc, msgid;
+	double start = 0.0;
+
+	luaL_checktype (L, 3, LUA_TTABLE);
+	lua_settop (L, 4); /* the options stay at #4 */
+	if (!lua_isnil (L, 4)) {
+		luaL_checktype (L, 4, LUA_TTABLE);
+		lua_getfield (L, 4, "current");
+		if (lua_istable (L, -1))
+			current = lua_gettop (L);
+		else if (!lua_isnil (L, -1))
+			return option_error (L, "current", "table");
+	}
+
+	/* get the current values */
+	lua_pushnil (L); /* first key for lua_next */
+	while (lua_next (L, 3) != 0) {
+		if ((!lua_isnumber (L, -2)) && (lua_isstring (L, -2)))
+			na++;
+		lua_pop (L, 1);
+	}
+	if (!current) {
+		int i = 0;
+		names = (char **)lua_newuserdata (L, (na + 1) * sizeof (char *));
+		lua_pushnil (L); /* first key for lua_next */
+		while (lua_next (L, 3) != 0) {
+			if ((!lua_isnumber (L, -2)) && (lua_isstring (L, -2)))
+				names[i++] = (char *)lua_tostring (L, -2);
+			lua_pop (L, 1);
+		}
+		names[i] = NULL;
+		rc = fetch_entry (L, conn->ld, dn, (na > 0) ? names : NULL);
+		if (rc != LDAP_SUCCESS)
+			return faildirect (L, ldap_err2string (rc));
+		current = lua_gettop (L);
+	}
+
+	/* count the values to size the working buffers */
+	lua_pushnil (L); /* first key for lua_next */
+	while (lua_next (L, 3) != 0) {
+		if ((!lua_isnumber (L, -2)) && (lua_isstring (L, -2))) {
+			int nd = V_count (L, -1), nc;
+			push_attr (L, current, lua_tostring (L, -2));
+			nc = V_count (L, -1);
+			totald += nd;
+			totalc += nc;
+			if (nd > maxn)
+				maxn = nd;
+			if (nc > maxn)
+				maxn = nc;
+			lua_pop (L, 1);
+		}
+		lua_pop (L, 1);
+	}
+	while (nslots < 2 * (unsigned)maxn)
+		nslots *= 2;
+	attrs = (LDAPMod **)lua_newuserdata (L, (2 * na + 1) * sizeof (LDAPMod *));
+	mods = (LDAPMod *)lua_newuserdata (L, (2 * na + 1) * sizeof (LDAPMod));
+	ptrs = (BerValue **)lua_newuserdata (L, (totald + totalc + 2 * na + 1) * sizeof (BerValue *));
+	dv = (BerValue *)lua_newuserdata (L, (totald + 1) * sizeof (BerValue));
+	cv = (BerValue *)lua_newuserdata (L, (totalc + 1) * sizeof (BerValue));
+	slots = (int *)lua_newuserdata (L, nslots * sizeof (int));
+	lua_newtable (L); /* keeps the numbers converted to strings */
+	anchor = lua_gettop (L);
+	attrs[0] = NULL;
+
+	/* compute the modifications */
+	lua_pushnil (L); /* first key for lua_next */
+	while (lua_next (L, 3) != 0) {
+		if ((!lua_isnumber (L, -2)) && (lua_isstring (L, -2))) {
+			const char *name = lua_tostring (L, -2);
+			BerValue *d = &dv[doff], *c = &cv[coff];
+			int nd, nc, present;
+			push_attr (L, current, name);
+			present = !lua_isnil (L, -1) && !(lua_isboolean (L, -1) && !lua_toboolean (L, -1));
+			nd = V_collect (L, -2, d, name, 0, anchor);
+			nc = V_collect (L, -1, c, name, 1, anchor);
+			doff += nd;
+			coff += nc;
+			if (nd == 0) {
+				if (present) /* remove the attribute */
+					sync_setmod (attrs, mods, &nmods, LUALDAP_MOD_DEL, name, NULL);
+			} else {
+				bvset_data set;
+				int i, nadd = 0, ndel = 0;
+				BerValue **add = &ptrs[poff];
+				BerValue **del;
+				nd = S_build (&set, slots, d, nd);
+				nc = S_build (&set, slots, c, nc);
+				for (i = 0; i < nd; i++)
+					if (!S_has (&set, &d[i]))
+						add[nadd++] = &d[i];
+				add[nadd] = NULL;
+				del = &add[nadd + 1];
+				S_build (&set, slots, d, nd);
+				for (i = 0; i < nc; i++)
+					if (!S_has (&set, &c[i]))
+						del[ndel++] = &c[i];
+				del[ndel] = NULL;
+				if (nadd + ndel > nd) { /* replacing sends less values */
+					for (i = 0; i < nd; i++)
+						add[i] = &d[i];
+					add[nd] = NULL;
+					sync_setmod (attrs, mods, &nmods, LUALDAP_MOD_REP, name, add);
+					poff += nd + 1;
+				} else {
+					if (ndel > 0)
+						sync_setmod (attrs, mods, &nmods, LUALDAP_MOD_DEL, name, del);
+					if (nadd > 0)
+						sync_setmod (attrs, mods, &nmods, LUALDAP_MOD_ADD, name, add);
+					poff += nadd + ndel + 2;
+				}
+			}
+			lua_pop (L, 1);
+		}
+		lua_pop (L, 1);
+	}
+
+	if (nmods == 0) {
+		lua_pushcfunction (L, nothing_to_do);
+		return 1;
+	}
+	rc = get_ctrls_param (L, conn, 4, &ctrls, 1);
+	if (rc == LDAP_SUCCESS) {
+		start = monotonic ();
+		rc = ldap_modify_ext (conn->ld, dn, attrs, C_array (&ctrls), NULL, &msgid);
+		C_free (&ctrls);
+	}
+	return create_future (L, rc, 1, msgid, LDAP_RES_MODIFY, start);
+}
+
+
+/*
+** Return the name of the object's metatable.
+** This function is used by `tostring'.
+*/
+static int lualdap_conn_tostring (lua_State *L) {
+	conn_data *conn = luaL_checkudata(L, 1, LUALDAP_CONNECTION_METATABLE);
+	if (conn->ld == NULL)
+		lua_pushfstring (L, "%s (closed)", LUALDAP_CONNECTION_METATABLE);
+	else
+		lua_pushfstring (L, "%s (%p)", LUALDAP_CONNECTION_METATABLE, (void*)conn);
+	return 1;
+}
+
+
+/*
+** Return the name of the object's metatable.
+** This function is used by `tostring'.
+*/
+static int lualdap_search_tostring (lua_State *L) {
+	search_data *search = luaL_checkudata(L, 1, LUALDAP_SEARCH_METATABLE);
+	if (search->conn == LUA_NOREF)
+		lua_pushfstring (L, "%s (closed)", LUALDAP_SEARCH_METATABLE);
+	else
+		lua_pushfstring (L, "%s (%p)", LUALDAP_SEARCH_METATABLE, (void*)search);
+	return 1;
+}
+
+
+/*
+** Create a metatable.
+*/
+static void lualdap_createmeta_conn (lua_State *L) {
+	static const luaL_Reg metamethods[] = {
+		{"__gc", lualdap_conn_gc},
+		{"__tostring", lualdap_conn_tostring},
+		/* placeholders */
+		{"__index", NULL},
+		{"__metatable", NULL},
+		{NULL, NULL}
+	};
+	static const luaL_Reg methods[] = {
+		{"close", lualdap_close},
+		{"auto_reconnect", lualdap_auto_reconnect},
+		{"get_option", lualdap_get_option},
+		{"set_option", lualdap_set_option},
+		{"stats", lualdap_stats},
+		{"on_operation", lualdap_on_operation},
+		{"set_slowlog", lualdap_set_slowlog},
+		{"bind_simple", lualdap_bind_simple},
+#if !defined(WINLDAP)
+		{"bind_sasl", lualdap_bind_sasl},
+#endif
+		{"add", lualdap_add},
+		{"compare", lualdap_compare},
+		{"delete", lualdap_delete},
+#if !defined(WINLDAP)
+		{"delete_tree", lualdap_delete_tree},
+#endif
+		{"extended", lualdap_extended},
+		{"whoami", lualdap_whoami},
+		{"ping", lualdap_ping},
+		{"modify", lualdap_modify},
+		{"rename", lualdap_rename},
+		{"search", lualdap_search},
+		{"sync_entry", lualdap_sync_entry},
+#if !defined(WINLDAP)
+		{"transaction", lualdap_transaction},
+#endif
+		{NULL, NULL}
+	};
+
+	luaL_newmetatable (L, LUALDAP_CONNECTION_METATABLE);
+	luaL_setfuncs(L, metamethods, 0);  /* add metamethods to new metatable */
+
+	luaL_newlibtable(L, methods);  /* create method table */
+	luaL_setfuncs(L, methods, 0);  /* add file methods to method table */
+	lua_setfield(L, -2, "__index");  /* metatable.__index = method table */
+
+	lua_pushliteral(L,LUALDAP_PREFIX"you're not allowed to get this metatable");
+	lua_setfield (L, -2, "__metatable");
+
+	lua_pop(L, 1);  /* pop metatable */
+}
+
+
+/*
+** Create a metatable.
+*/
+static void lualdap_createmeta_search (lua_State *L) {
+	static const luaL_Reg metamethods[] = {
+		{"__gc", lualdap_search_close},
+		{"__tostring", lualdap_search_tostring},
+		/* placeholders */
+		{"__metatable", NULL},
+		{NULL, NULL}
+	};
+
+	luaL_newmetatable (L, LUALDAP_SEARCH_METATABLE);
+	luaL_setfuncs(L, metamethods, 0);  /* add metamethods to new metatable */
+
+	lua_pushliteral(L,LUALDAP_PREFIX"you're not allowed to get this metatable");
+	lua_setfield (L, -2, "__metatable");
+
+	lua_pop(L, 1);  /* pop metatable */
+}
+
+
+/*
+** Create a metatable.
+*/
+static void lualdap_createmeta_future (lua_State *L) {
+	static const luaL_Reg metamethods[] = {
+		{"__gc", lualdap_future_gc},
+		/* placeholders */
+		{"__metatable", NULL},
+		{NULL, NULL}
+	};
+
+	luaL_newmetatable (L, LUALDAP_FUTURE_METATABLE);
+	luaL_setfuncs(L, metamethods, 0);  /* add metamethods to new metatable */
+
+	lua_pushliteral(L,LUALDAP_PREFIX"you're not allowed to get this metatable");
+	lua_setfield (L, -2, "__metatable");
+
+	lua_pop(L, 1);  /* pop metatable */
+}
+
+
+#if !defined(WINLDAP)
+/*
+** Open and initialize a connection to a server (without binding).
+** @param #1 String with URI.
+** @return #1 Userdata with connection structure.
+*/
+static int lualdap_initialize (lua_State *L) {
+	ldap_pchar_t uri = (ldap_pchar_t) luaL_checkstring (L, 1);
+	conn_data *conn = create_connection (L);
+	int err;
+
+	/* Initialize */
+#if defined(LDAP_API_FEATURE_X_OPENLDAP) && LDAP_API_FEATURE_X_OPENLDAP >= 20300
+	err = ldap_initialize (&conn->ld, uri);
+	if (err != LDAP_SUCCESS)
+		return faildirect(L, ldap_err2string(err));
+#else
+#	error Unsupported LDAP library version
+#endif
+
+	/* Set protocol version */
+	conn->version = LDAP_VERSION3;
+	if (ldap_set_option (conn->ld, LDAP_OPT_PROTOCOL_VERSION, &conn->version)
+		!= LDAP_OPT_SUCCESS)
+		return faildirect(L, LUALDAP_PREFIX"Error setting LDAP version");
+	stats_attach (conn);
+	conn_remember (L, conn, uri, 0, 0.0);
+
+	return 1;
+}
+#endif
+
+/*
+** Open a connection to a server.
+** @param #1 String with hostname.
+** @param #2 Boolean indicating if TLS must be used.
+** @param #3 Number for connection timeout (optional).
+** @param #4 Table of connection options (optional).
+** @return #1 Userdata with connection structure.
+*/
+static int lualdap_open (lua_State *L) {
+	ldap_pchar_t host = (ldap_pchar_t) luaL_checkstring (L, 1);
+	int use_tls = lua_toboolean (L, 2);
+	double timeout = lua_tonumber (L, 3);
+	const char *uri, *errmsg;
+	conn_data *conn;
+	connect_options opts;
+	lua_settop (L, 4);
+	errmsg = get_connect_options (L, 4, &opts);
+	if (errmsg != NULL)
+		return faildirect (L, errmsg);
+	uri = push_uri (L, host);
+	conn = create_connection (L);
+	errmsg = conn_open (L, conn, uri, use_tls, timeout, &opts);
+	if (errmsg != NULL)
+		return faildirect (L, errmsg);
+	conn_remember (L, conn, uri, use_tls, timeout);
+	conn_remember_options (L, conn, &opts, 5);
+	return 1;
+}
+
+/*
+** Open and initialize a connection to a server.
+** @param #1 String with hostname.
+** @param #2 String with username.
+** @param #3 String with password.
+** @param #4 Boolean indicating if TLS must be used.
+** @param #5 Number for connection timeout (optional).
+** @param #6 Table of connection options (optional).
+** @return #1 Userdata with connection structure.
+*/
+static int lualdap_open_simple (lua_State *L) {
+	ldap_pchar_t host = (ldap_pchar_t) luaL_checkstring (L, 1);
+	const char *who = luaL_optstring (L, 2, "");
+	const char *password = luaL_optstring (L, 3, "");
+	int use_tls = lua_toboolean (L, 4);
+	double timeout = lua_tonumber (L, 5);
+	const char *uri, *errmsg;
+	conn_data *conn;
+	connect_options opts;
+	int err;
+	lua_settop (L, 6);
+	errmsg = get_connect_options (L, 6, &opts);
+	if (errmsg != NULL)
+		return faildirect (L, errmsg);
+	uri = push_uri (L, host);
+	conn = create_connection (L);
+	errmsg = conn_open (L, conn, uri, use_tls, timeout, &opts);
+	if (errmsg != NULL)
+		return faildirect (L, errmsg);
+
+	/* Bind to a server */
+	err = conn_bind (conn, who, password);
+	if (err != LDAP_SUCCESS)
+		return faildirect (L, ldap_err2string (err));
+	conn_remember (L, conn, uri, use_tls, timeout);
+	conn_remember_options (L, conn, &opts, 7);
+	conn_remember_bind (L, conn, who, password);
+	return 1;
+}
+
+
+/*
+** Get a pool object from the first stack position.
+*/
+static pool_data *getpool (lua_State *L) {
+	pool_data *pool = (pool_data *)luaL_checkudata (L, 1, LUALDAP_POOL_METATABLE);
+	luaL_argcheck (L, pool->params != LUA_NOREF, 1, LUALDAP_PREFIX"pool is closed");
+	return pool;
+}
+
+
+/*
+** Count the lent connections of a pool which are still open.
+*/
+static int pool_lent (lua_State *L, pool_data *pool) {
+	int n = 0;
+	lua_rawgeti (L, LUA_REGISTRYINDEX, pool->lent);
+	lua_pushnil (L);
+	while (lua_next (L, -2) != 0) {
+		lua_pop (L, 1);
+		if (toconnection (L, -1) != NULL)
+			n++;
+	}
+	lua_pop (L, 1);
+	return n;
+}
+
+
+/*
+** Open a connection with the parameters of a pool and push it.
+** @return NULL on success or an error message (nothing is pushed).
+*/
+static const char *pool_connect (lua_State *L, pool_data *pool) {
+	int params, use_tls, err;
+	double timeout;
+	connect_options opts;
+	const char *who, *password, *errmsg;
+	conn_data *conn;
+	lua_rawgeti (L, LUA_REGISTRYINDEX, pool->params);
+	params = lua_gettop (L);
+	get_connect_options (L, params, &opts); /* the context is already created */
+	use_tls = booltabparam (L, params, "usetls", 0);
+	timeout = numbertabparam (L, params, "timeout", 0.0);
+	who = strtabparam (L, params, "who", (char *)"");
+	password = strtabparam (L, params, "password", (char *)"");
+	lua_getfield (L, params, "uri");
+	conn = create_connection (L);
+	errmsg = conn_open (L, conn, lua_tostring (L, -2), use_tls, timeout, &opts);
+	if (errmsg == NULL) {
+		err = conn_bind (conn, who, password);
+		if (err != LDAP_SUCCESS)
+			errmsg = ldap_err2string (err);
+	}
+	if (errmsg != NULL) {
+		if (conn->ld != NULL)
+			conn_close (conn);
+		lua_settop (L, params - 1);
+		return errmsg;
+	}
+	conn_remember (L, conn, lua_tostring (L, -2), use_tls, timeout);
+	conn_remember_options (L, conn, &opts, params + 1);
+	conn_remember_bind (L, conn, who, password);
+	lua_replace (L, params); /* keep only the connection */
+	lua_settop (L, params);
+	return NULL;
+}
+
+
+/*
+** Push a connection on the stack of idle connections of a pool.
+** The connection is on top of the stack and is popped.
+*/
+static void pool_push_idle (lua_State *L, pool_data *pool) {
+	pool->nidle++;
+	lua_rawgeti (L, LUA_REGISTRYINDEX, pool->since);
+	lua_pushnumber (L, monotonic ());
+	lua_rawseti (L, -2, pool->nidle);
+	lua_pop (L, 1);
+	lua_rawgeti (L, LUA_REGISTRYINDEX, pool->idle);
+	lua_insert (L, -2);
+	lua_rawseti (L, -2, pool->nidle);
+	lua_pop (L, 1);
+}
+
+
+/*
+** Pop the most recently used idle connection of a pool and push it.
+** @return The time the connection became idle.
+*/
+static double pool_pop_idle (lua_State *L, pool_data *pool) {
+	double since;
+	lua_rawgeti (L, LUA_REGISTRYINDEX, pool->since);
+	lua_rawgeti (L, -1, pool->nidle);
+	since = lua_tonumber (L, -1);
+	lua_pop (L, 1);
+	lua_pushnil (L);
+	lua_rawseti (L, -2, pool->nidle);
+	lua_pop (L, 1);
+	lua_rawgeti (L, LUA_REGISTRYINDEX, pool->idle);
+	lua_rawgeti (L, -1, pool->nidle);
+	lua_pushnil (L);
+	lua_rawseti (L, -3, pool->nidle);
+	lua_remove (L, -2);
+	pool->nidle--;
+	return since;
+}
+
+
+/*
+** Close the idle connections of a pool which have been idle for too long
+** (beyond the minimum number of connections) or which are closed.
+** Idle connections are ordered from the least to the most recently used.
+*/
+static void pool_reap (lua_State *L, pool_data *pool) {
+	double now = monotonic ();
+	int i, j, open;
+	lua_rawgeti (L, LUA_REGISTRYINDEX, pool->idle);
+	lua_rawgeti (L, LUA_REGISTRYINDEX, pool->since);
+	open = pool_lent (L, pool) + pool->nidle;
+	for (i = j = 1; i <= pool->nidle; i++) {
+		conn_data *conn;
+		double since;
+		lua_rawgeti (L, -2, i);
+		lua_rawgeti (L, -2, i);
+		since = lua_tonumber (L, -1);
+		conn = toconnection (L, -2);
+		if (conn == NULL || (pool->idle_timeout > 0.0 && open > pool->min
+			&& now - since > pool->idle_timeout)) {
+			if (conn != NULL)
+				conn_close (conn);
+			open--;
+			lua_pop (L, 2);
+			continue;
+		}
+		lua_rawseti (L, -3, j);
+		lua_rawseti (L, -3, j);
+		j++;
+	}
+	for (i = j; i <= pool->nidle; i++) {
+		lua_pushnil (L);
+		lua_rawseti (L, -3, i);
+		lua_pushnil (L);
+		lua_rawseti (L, -2, i);
+	}
+	pool->nidle = j - 1;
+	lua_pop (L, 2);
+}
+
+
+/*
+** Open connections until a pool has its minimum number of connections.
+** @return NULL on success or an error message.
+*/
+static const char *pool_fill (lua_State *L, pool_data *pool) {
+	int open = pool_lent (L, pool) + pool->nidle;
+	for (; open < pool->min; open++) {
+		const char *errmsg = pool_connect (L, pool);
+		if (errmsg != NULL)
+			return errmsg;
+		pool_push_idle (L, pool);
+	}
+	return NULL;
+}
+
+
+/*
+** Create a pool of connections.
+** @param #1 Table with the connection parameters (uri or host, who,
+**	password, usetls, timeout, race, cooldown, tls) and the pool parameters (min, max,
+**	idle_timeout, probe_after).
+** @return #1 Userdata with pool structure.
+*/
+static int lualdap_pool (lua_State *L) {
+	pool_data *pool;
+	connect_options opts;
+	const char *host, *errmsg;
+	luaL_checktype (L, 1, LUA_TTABLE);
+	lua_settop (L, 1);
+	pool = (pool_data *)lua_newuserdata (L, sizeof(pool_data));
+	pool->params = pool->idle = pool->since = pool->lent = LUA_NOREF;
+	pool->nidle = 0;
+	pool->gets = pool->exhausted = 0;
+	pool->get_time = 0.0;
+	luaL_setmetatable (L, LUALDAP_POOL_METATABLE);
+	track_object (L);
+	pool->min = (int)longtabparam (L, 1, "min", 0);
+	pool->max = (int)longtabparam (L, 1, "max", 10);
+	pool->idle_timeout = numbertabparam (L, 1, "idle_timeout", 0.0);
+	pool->probe_after = numbertabparam (L, 1, "probe_after", 1.0);
+	lua_pop (L, 4);
+	luaL_argcheck (L, pool->min >= 0 && pool->max > 0 && pool->min <= pool->max, 1,
+		LUALDAP_PREFIX"invalid pool bounds");
+
+	/* Connection parameters */
+	lua_newtable (L);
+	host = strtabparam (L, 1, "uri", NULL);
+	if (host == NULL) {
+		lua_pop (L, 1);
+		host = strtabparam (L, 1, "host", NULL);
+		luaL_argcheck (L, host != NULL, 1, LUALDAP_PREFIX"no uri nor host given");
+	}
+	push_uri (L, host);
+	lua_setfield (L, -3, "uri");
+	lua_pop (L, 1);
+	lua_getfield (L, 1, "who");
+	lua_setfield (L, -2, "who");
+	lua_getfield (L, 1, "password");
+	lua_setfield (L, -2, "password");
+	lua_getfield (L, 1, "usetls");
+	lua_setfield (L, -2, "usetls");
+	lua_getfield (L, 1, "timeout");
+	lua_setfield (L, -2, "timeout");
+	lua_getfield (L, 1, "race");
+	lua_setfield (L, -2, "race");
+	lua_getfield (L, 1, "cooldown");
+	lua_setfield (L, -2, "cooldown");
+	errmsg = get_connect_options (L, 1, &opts); /* a single context for the pool */
+	if (errmsg != NULL)
+		return faildirect (L, errmsg);
+	lua_setfield (L, -2, "tls");
+	pool->params = luaL_ref (L, LUA_REGISTRYINDEX);
+
+	lua_newtable (L);
+	pool->idle = luaL_ref (L, LUA_REGISTRYINDEX);
+	lua_newtable (L);
+	pool->since = luaL_ref (L, LUA_REGISTRYINDEX);
+	lua_newtable (L); /* weak set, so dropped connections are not counted */
+	lua_newtable (L);
+	lua_pushliteral (L, "k");
+	lua_setfield (L, -2, "__mode");
+	lua_setmetatable (L, -2);
+	pool->lent = luaL_ref (L, LUA_REGISTRYINDEX);
+
+	errmsg = pool_fill (L, pool);
+	if (errmsg != NULL)
+		return faildirect (L, errmsg);
+	return 1;
+}
+
+
+/*
+** Check out a connection of the pool.
+** Idle connections are reused most recently used first and, when they have
+** been idle for longer than probe_after seconds, are probed beforehand.
+** A new connection is opened when there is no idle connection left and the
+** pool has not reached its maximum size.
+** @param #1 LDAP pool.
+** @return #1 Userdata with connection structure.
+*/
+static int lualdap_pool_get (lua_State *L) {
+	pool_data *pool = getpool (L);
+	double timeout, start = monotonic ();
+	lua_settop (L, 1);
+	pool->gets++;
+	pool_reap (L, pool);
+	lua_rawgeti (L, LUA_REGISTRYINDEX, pool->params);
+	timeout = numbertabparam (L, 2, "timeout", 0.0);
+	lua_settop (L, 1);
+	while (pool->nidle > 0) {
+		double since = pool_pop_idle (L, pool);
+		conn_data *conn = toconnection (L, -1);
+		if (conn != NULL)
+			conn_check_fork (L, conn);
+		if (conn != NULL && conn->ld != NULL && (monotonic () - since <= pool->probe_after
+			|| conn_probe (conn, timeout) == LDAP_SUCCESS))
+			break;
+		if (conn != NULL && conn->ld != NULL)
+			conn_close (conn);
+		lua_pop (L, 1);
+	}
+	if (lua_gettop (L) == 1) {
+		const char *errmsg;
+		if (pool_lent (L, pool) >= pool->max) {
+			pool->exhausted++;
+			pool->get_time += monotonic () - start;
+			return faildirect (L, LUALDAP_PREFIX"pool exhausted");
+		}
+		errmsg = pool_connect (L, pool);
+		pool->get_time += monotonic () - start;
+		if (errmsg != NULL)
+			return faildirect (L, errmsg);
+	} else
+		pool->get_time += monotonic () - start;
+	lua_rawgeti (L, LUA_REGISTRYINDEX, pool->lent);
+	lua_pushvalue (L, -2);
+	lua_pushboolean (L, 1);
+	lua_rawset (L, -3);
+	lua_pop (L, 1);
+	return 1;
+}
+
+
+/*
+** Give back a connection to the pool.
+** @param #1 LDAP pool.
+** @param #2 LDAP connection (got from the pool).
+** @param #3 Boolean indicating that the connection is broken (optional).
+** @return #1 True.
+*/
+static int lualdap_pool_put (lua_State *L) {
+	pool_data *pool = getpool (L);
+	conn_data *conn = (conn_data *)luaL_checkudata (L, 2, LUALDAP_CONNECTION_METATABLE);
+	int broken = lua_toboolean (L, 3);
+	lua_settop (L, 2);
+	lua_rawgeti (L, LUA_REGISTRYINDEX, pool->lent);
+	lua_pushvalue (L, 2);
+	lua_rawget (L, -2);
+	luaL_argcheck (L, lua_toboolean (L, -1), 2, LUALDAP_PREFIX"connection not lent by this pool");
+	lua_pop (L, 1);
+	lua_pushvalue (L, 2);
+	lua_pushnil (L);
+	lua_rawset (L, -3);
+	lua_pop (L, 1);
+	if (conn->ld != NULL) {
+		if (broken || conn->txn != NULL)
+			conn_close (conn);
+		else {
+			lua_pushvalue (L, 2);
+			pool_push_idle (L, pool);
+		}
+	}
+	pool_reap (L, pool);
+	pool_fill (L, pool); /* a broken server is reported by the next get */
+	lua_pushboolean (L, 1);
+	return 1;
+}
+
+
+/*
+** Close the idle connections of a pool and release it.
+** Lent connections are left open; they will not be given back.
+** @param #1 LDAP pool.
+** @return 1 in case of success; nothing when already closed.
+*/
+static int lualdap_pool_close (lua_State *L) {
+	pool_data *pool = (pool_data *)luaL_checkudata (L, 1, LUALDAP_POOL_METATABLE);
+	if (pool->params == LUA_NOREF) /* already closed */
+		return 0;
+	while (pool->nidle > 0) {
+		conn_data *conn;
+		pool_pop_idle (L, pool);
+		conn = toconnection (L, -1);
+		if (conn != NULL)
+			conn_close (conn);
+		lua_pop (L, 1);
+	}
+	luaL_unref (L, LUA_REGISTRYINDEX, pool->params);
+	luaL_unref (L, LUA_REGISTRYINDEX, pool->idle);
+	luaL_unref (L, LUA_REGISTRYINDEX, pool->since);
+	luaL_unref (L, LUA_REGISTRYINDEX, pool->lent);
+	pool->params = pool->idle = pool->since = pool->lent = LUA_NOREF;
+	lua_pushnumber (L, 1);
+	return 1;
+}
+
+
+/*
+** Release a pool, keeping its counters for metrics_text.
+*/
+static int lualdap_pool_gc (lua_State *L) {
+	pool_data *pool = (pool_data *)luaL_checkudata (L, 1, LUALDAP_POOL_METATABLE);
+	metrics_data *m = metrics_retired (L);
+	lualdap_pool_close (L);
+	if (m != NULL) {
+		m->gets += pool->gets;
+		m->exhausted += pool->exhausted;
+		m->get_time += pool->get_time;
+	}
+	pool->gets = pool->exhausted = 0;
+	pool->get_time = 0.0;
+	return 0;
+}
+
+
+/*
+** Return the name of the object's metatable.
+** This function is used by `tostring'.
+*/
+static int lualdap_pool_tostring (lua_State *L) {
+	pool_data *pool = luaL_checkudata(L, 1, LUALDAP_POOL_METATABLE);
+	if (pool->params == LUA_NOREF)
+		lua_pushfstring (L, "%s (closed)", LUALDAP_POOL_METATABLE);
+	else
+		lua_pushfstring (L, "%s (%p)", LUALDAP_POOL_METATABLE, (void*)pool);
+	return 1;
+}
+
+
+/*
+** Create a metatable.
+*/
+static void lualdap_createmeta_pool (lua_State *L) {
+	static const luaL_Reg metamethods[] = {
+		{"__gc", lualdap_pool_gc},
+		{"__tostring", lualdap_pool_tostring},
+		/* placeholders */
+		{"__index", NULL},
+		{"__metatable", NULL},
+		{NULL, NULL}
+	};
+	static const luaL_Reg methods[] = {
+		{"close", lualdap_pool_close},
+		{"get", lualdap_pool_get},
+		{"put", lualdap_pool_put},
+		{NULL, NULL}
+	};
+
+	luaL_newmetatable (L, LUALDAP_POOL_METATABLE);
+	luaL_setfuncs(L, metamethods, 0);  /* add metamethods to new metatable */
+
+	luaL_newlibtable(L, methods);  /* create method table */
+	luaL_setfuncs(L, methods, 0);  /* add file methods to method table */
+	lua_setfield(L, -2, "__index");  /* metatable.__index = method table */
+
+	lua_pushliteral(L,LUALDAP_PREFIX"you're not allowed to get this metatable");
+	lua_setfield (L, -2, "__metatable");
+
+	lua_pop(L, 1);  /* pop metatable */
+}
+
+
+/*
+** Get a router object from the first stack position.
+*/
+static router_data *getrouter (lua_State *L) {
+	router_data *router = (router_data *)luaL_checkudata (L, 1, LUALDAP_ROUTER_METATABLE);
+	luaL_argcheck (L, router->provider != LUA_NOREF, 1, LUALDAP_PREFIX"router is closed");
+	return router;
+}
+
+
+/*
+** Push the replica which should receive the next read operation
+** (nothing is pushed when no replica is open).
+*/
+static int router_replica (lua_State *L, router_data *router) {
+	int i, chosen = 0, fewest = 0;
+	lua_rawgeti (L, LUA_REGISTRYINDEX, router->replicas);
+	for (i = 1; i <= router->n; i++) {
+		/* round-robin starts from the replica after the last one chosen */
+		int r = (router->next + i - 1) % router->n + 1;
+		conn_data *conn;
+		lua_rawgeti (L, -1, r);
+		conn = toconnection (L, -1);
+		lua_pop (L, 1);
+		if (conn == NULL)
+			continue;
+		if (chosen == 0 || conn->pending < fewest) {
+			chosen = r;
+			fewest = conn->pending;
+		}
+		if (!router->least)
+			break;
+	}
+	if (chosen == 0) {
+		lua_pop (L, 1);
+		return 0;
+	}
+	router->next = chosen;
+	lua_rawgeti (L, -1, chosen);
+	lua_remove (L, -2);
+	return 1;
+}
+
+
+/*
+** Call a connection method on the connection chosen by the router.
+** #1 upvalue == connection method
+** #2 upvalue == boolean indicating that the operation is a write
+** @param #1 LDAP router.
+*/
+static int router_call (lua_State *L) {
+	router_data *router = getrouter (L);
+	lua_CFunction func = lua_tocfunction (L, lua_upvalueindex (1));
+	int write = lua_toboolean (L, lua_upvalueindex (2));
+	double now = monotonic ();
+	if (write || (router->window > 0.0 && now - router->last_write < router->window)
+		|| !router_replica (L, router))
+		lua_rawgeti (L, LUA_REGISTRYINDEX, router->provider);
+	if (write)
+		router->last_write = now;
+	lua_replace (L, 1);
+	return func (L);
+}
+
+
+/*
+** Create a router of operations.
+** @param #1 Table with the provider connection (provider), the array of
+**	replica connections (replicas), the replica choice policy (policy:
+**	"round-robin" or "least-outstanding") and the time reads go to the
+**	provider after a write (read_your_writes).
+** @return #1 Userdata with router structure.
+*/
+static int lualdap_router (lua_State *L) {
+	router_data *router;
+	const char *policy;
+	int i;
+	luaL_checktype (L, 1, LUA_TTABLE);
+	lua_settop (L, 1);
+	router = (router_data *)lua_newuserdata (L, sizeof(router_data));
+	router->provider = router->replicas = LUA_NOREF;
+	router->n = router->next = 0;
+	router->last_write = 0.0;
+	luaL_setmetatable (L, LUALDAP_ROUTER_METATABLE);
+	policy = strtabparam (L, 1, "policy", (char *)"round-robin");
+	if (strcmp (policy, "round-robin") == 0)
+		router->least = 0;
+	else if (strcmp (policy, "least-outstanding") == 0)
+		router->least = 1;
+	else
+		return luaL_error (L, LUALDAP_PREFIX"invalid routing policy `%s'", policy);
+	router->window = numbertabparam (L, 1, "read_your_writes", 0.0);
+	lua_pop (L, 2);
+
+	lua_getfield (L, 1, "provider");
+	luaL_argcheck (L, toconnection (L, -1) != NULL, 1, LUALDAP_PREFIX"provider is not an open connection");
+	router->provider = luaL_ref (L, LUA_REGISTRYINDEX);
+
+	lua_newtable (L);
+	lua_getfield (L, 1, "replicas");
+	if (!lua_isnil (L, -1)) {
+		luaL_argcheck (L, lua_istable (L, -1), 1, LUALDAP_PREFIX"replicas is not a table");
+		router->n = (int)lua_rawlen (L, -1);
+		for (i = 1; i <= router->n; i++) {
+			lua_rawgeti (L, -1, i);
+			luaL_argcheck (L, toconnection (L, -1) != NULL, 1, LUALDAP_PREFIX"replica is not an open connection");
+			lua_rawseti (L, -3, i);
+		}
+	}
+	lua_pop (L, 1);
+	router->replicas = luaL_ref (L, LUA_REGISTRYINDEX);
+	return 1;
+}
+
+
+/*
+** Close the connections of a router and release it.
+** @param #1 LDAP router.
+** @return 1 in case of success; nothing when already closed.
+*/
+static int lualdap_router_close (lua_State *L) {
+	router_data *router = (router_data *)luaL_checkudata (L, 1, LUALDAP_ROUTER_METATABLE);
+	int i;
+	if (router->provider == LUA_NOREF) /* already closed */
+		return 0;
+	lua_rawgeti (L, LUA_REGISTRYINDEX, router->provider);
+	lua_rawgeti (L, LUA_REGISTRYINDEX, router->replicas);
+	for (i = 0; i <= router->n; i++) {
+		conn_data *conn;
+		if (i > 0)
+			lua_rawgeti (L, -1, i);
+		else
+			lua_pushvalue (L, -2);
+		conn = toconnection (L, -1);
+		if (conn != NULL)
+			conn_close (conn);
+		lua_pop (L, 1);
+	}
+	lua_pop (L, 2);
+	luaL_unref (L, LUA_REGISTRYINDEX, router->provider);
+	luaL_unref (L, LUA_REGISTRYINDEX, router->replicas);
+	router->provider = router->replicas = LUA_NOREF;
+	lua_pushnumber (L, 1);
+	return 1;
+}
+
+
+/*
+** Release a router object (its connections are closed when collected).
+*/
+static int lualdap_router_gc (lua_State *L) {
+	router_data *router = (router_data *)luaL_checkudata (L, 1, LUALDAP_ROUTER_METATABLE);
+	luaL_unref (L, LUA_REGISTRYINDEX, router->provider);
+	luaL_unref (L, LUA_REGISTRYINDEX, router->replicas);
+	router->provider = router->replicas = LUA_NOREF;
+	return 0;
+}
+
+
+/*
+** Return the name of the object's metatable.
+** This function is used by `tostring'.
+*/
+static int lualdap_router_tostring (lua_State *L) {
+	router_data *router = luaL_checkudata(L, 1, LUALDAP_ROUTER_METATABLE);
+	if (router->provider == LUA_NOREF)
+		lua_pushfstring (L, "%s (closed)", LUALDAP_ROUTER_METATABLE);
+	else
+		lua_pushfstring (L, "%s (%p)", LUALDAP_ROUTER_METATABLE, (void*)router);
+	return 1;
+}
+
+
+/*
+** Create a metatable.
+*/
+static void lualdap_createmeta_router (lua_State *L) {
+	static const luaL_Reg metamethods[] = {
+		{"__gc", lualdap_router_gc},
+		{"__tostring", lualdap_router_tostring},
+		/* placeholders */
+		{"__index", NULL},
+		{"__metatable", NULL},
+		{NULL, NULL}
+	};
+	static const router_method methods[] = {
+		{"add", lualdap_add, 1},
+		{"compare", lualdap_compare, 0},
+		{"delete", lualdap_delete, 1},
+#if !defined(WINLDAP)
+		{"delete_tree", lualdap_delete_tree, 1},
+#endif
+		{"modify", lualdap_modify, 1},
+		{"rename", lualdap_rename, 1},
+		{"search", lualdap_search, 0},
+		{"sync_entry", lualdap_sync_entry, 1},
+#if !defined(WINLDAP)
+		{"transaction", lualdap_transaction, 1},
+#endif
+		{NULL, NULL, 0}
+	};
+	const router_method *m;
+
+	luaL_newmetatable (L, LUALDAP_ROUTER_METATABLE);
+	luaL_setfuncs(L, metamethods, 0);  /* add metamethods to new metatable */
+
+	lua_newtable (L);  /* create method table */
+	lua_pushcfunction (L, lualdap_router_close);
+	lua_setfield (L, -2, "close");
+	for (m = methods; m->name != NULL; m++) {
+		lua_pushcfunction (L, m->func);
+		lua_pushboolean (L, m->write);
+		lua_pushcclosure (L, router_call, 2);
+		lua_setfield (L, -2, m->name);
+	}
+	lua_setfield(L, -2, "__index");  /* metatable.__index = method table */
+
+	lua_pushliteral(L,LUALDAP_PREFIX"you're not allowed to get this metatable");
+	lua_setfield (L, -2, "__metatable");
+
+	lua_pop(L, 1);  /* pop metatable */
+}
+
+
+#if !defined(WINLDAP)
+/*
+** Get an authenticator object from the first stack position.
+*/
+static auth_data *getauth (lua_State *L) {
+	auth_data *auth = (auth_data *)luaL_checkudata (L, 1, LUALDAP_AUTH_METATABLE);
+	luaL_argcheck (L, auth->conns != LUA_NOREF, 1, LUALDAP_PREFIX"authenticator is closed");
+	return auth;
+}
+
+
+/*
+** Push the i-th connection of an authenticator and return it
+** (NULL when it is closed).
+*/
+static conn_data *auth_conn (lua_State *L, auth_data *auth, int i) {
+	conn_data *conn;
+	lua_rawgeti (L, LUA_REGISTRYINDEX, auth->conns);
+	lua_rawgeti (L, -1, i + 1);
+	lua_remove (L, -2);
+	conn = toconnection (L, -1);
+	if (conn != NULL) {
+		conn_check_fork (L, conn);
+		if (conn->ld == NULL)
+			conn = NULL;
+	}
+	return conn;
+}
+
+
+/*
+** Wait for the result of the bind in progress on the i-th connection of an
+** authenticator and store it in the table of its check: true when the
+** credentials are valid, false when they are not, or an error message.
+*/
+static void auth_wait (lua_State *L, auth_data *auth, int i) {
+	auth_slot *slot = &auth->slots[i];
+	conn_data *conn = auth_conn (L, auth, i);
+	lua_rawgeti (L, LUA_REGISTRYINDEX, slot->box);
+	if (conn == NULL)
+		lua_pushliteral (L, LUALDAP_PREFIX"LDAP connection is closed");
+	else {
+		LDAPMessage *res;
+		int code, rc = ldap_result (conn->ld, slot->msgid, LDAP_MSG_ALL, NULL, &res);
+		pending_remove (conn, slot->msgid);
+		if (rc <= 0)
+			code = ld_errno (conn->ld);
+		else if ((rc = ldap_parse_result (conn->ld, res, &code, NULL, NULL, NULL, NULL, 1)) != LDAP_SUCCESS)
+			code = rc;
+		stats_result (conn, code);
+		stats_op (conn, LUALDAP_OP_BIND, slot->start, code != LDAP_SUCCESS);
+		if (code == LDAP_SUCCESS || code == LDAP_INVALID_CREDENTIALS)
+			lua_pushboolean (L, code == LDAP_SUCCESS);
+		else
+			lua_pushstring (L, ldap_err2string (code));
+	}
+	lua_rawseti (L, -2, 1);
+	lua_pop (L, 2);
+	luaL_unref (L, LUA_REGISTRYINDEX, slot->box);
+	slot->box = LUA_NOREF;
+	slot->msgid = 0;
+}
+
+
+/*
+** Send a simple bind on the i-th connection of an authenticator, which
+** must be idle. The connection is reopened when its server was lost.
+** @param box Stack index of the table of the check.
+*/
+static void auth_send (lua_State *L, auth_data *auth, int i, const char *dn, const char *password, int box) {
+	auth_slot *slot = &auth->slots[i];
+	conn_data *conn = auth_conn (L, auth, i);
+	BerValue cred;
+	int rc = LDAP_SERVER_DOWN;
+	cred.bv_val = (char *)password;
+	cred.bv_len = strlen (password);
+	slot->start = monotonic ();
+	if (conn != NULL) {
+		rc = ldap_sasl_bind (conn->ld, dn, LDAP_SASL_SIMPLE, &cred, NULL, NULL, &slot->msgid);
+		if ((rc == LDAP_SERVER_DOWN || rc == LDAP_CONNECT_ERROR) && conn_reconnect (L, conn) == NULL)
+			rc = ldap_sasl_bind (conn->ld, dn, LDAP_SASL_SIMPLE, &cred, NULL, NULL, &slot->msgid);
+	}
+	lua_pop (L, 1);
+	if (rc != LDAP_SUCCESS) {
+		lua_pushstring (L, ldap_err2string (rc));
+		lua_rawseti (L, box, 1);
+		slot->msgid = 0;
+		return;
+	}
+	pending_add (conn, slot->msgid);
+	lua_pushvalue (L, box);
+	slot->box = luaL_ref (L, LUA_REGISTRYINDEX);
+	lua_pushinteger (L, i);
+	lua_rawseti (L, box, 2);
+}
+
+
+/*
+** Push the outcome of a credential check of an authenticator.
+** @param #1 The authenticator (upvalue).
+** @param #2 Table of the check (upvalue).
+** @return #1 Boolean indicating if the credentials are valid,
+**	or nil followed by an error message.
+*/
+static int auth_result (lua_State *L) {
+	auth_data *auth = (auth_data *)lua_touserdata (L, lua_upvalueindex (1));
+	int box = lua_upvalueindex (2);
+	lua_rawgeti (L, box, 1);
+	if (lua_isnil (L, -1) && auth->conns != LUA_NOREF) {
+		int i;
+		lua_pop (L, 1);
+		lua_rawgeti (L, box, 2);
+		i = (int)lua_tointeger (L, -1);
+		lua_pop (L, 1);
+		lua_rawgeti (L, LUA_REGISTRYINDEX, auth->slots[i].box);
+		if (lua_rawequal (L, -1, box)) /* still in progress */
+			auth_wait (L, auth, i);
+		lua_pop (L, 1);
+		lua_rawgeti (L, box, 1);
+	}
+	if (lua_isboolean (L, -1))
+		return 1;
+	return faildirect (L, lua_isnil (L, -1) ? LUALDAP_PREFIX"authenticator is closed" : lua_tostring (L, -1));
+}
+
+
+/*
+** Check a pair of DN and password with a simple bind.
+** The bind is sent on the next connection of the authenticator; when it is
+** still busy with a former check, the result of that one is read first.
+** An empty password is rejected without asking the server, since it would
+** be an unauthenticated bind, which succeeds.
+** @param #1 Authenticator.
+** @param #2 String with the DN.
+** @param #3 String with the password.
+** @return #1 Function returning the outcome of the check.
+*/
+static int lualdap_auth_check (lua_State *L) {
+	auth_data *auth = getauth (L);
+	const char *dn = luaL_checkstring (L, 2);
+	const char *password = luaL_checkstring (L, 3);
+	int i;
+	lua_settop (L, 3);
+	lua_createtable (L, 2, 0);
+	if (*password == '\0') {
+		lua_pushboolean (L, 0);
+		lua_rawseti (L, 4, 1);
+	} else {
+		/* the next connection, unless another one is idle */
+		for (i = 0; i < auth->n && auth->slots[(auth->next + i) % auth->n].msgid != 0; i++)
+			;
+		i = (i < auth->n) ? (auth->next + i) % auth->n : auth->next;
+		auth->next = (i + 1) % auth->n;
+		if (auth->slots[i].msgid != 0)
+			auth_wait (L, auth, i);
+		auth_send (L, auth, i, dn, password, 4);
+	}
+	lua_pushvalue (L, 1);
+	lua_pushvalue (L, 4);
+	lua_pushcclosure (L, auth_result, 2);
+	return 1;
+}
+
+
+/*
+** Create an authenticator, which checks credentials with simple binds
+** pipelined over a set of connections reserved for them.
+** @param #1 Table with the connection parameters (uri or host, usetls,
+**	timeout, race, cooldown, tls) and the number of connections.
+** @return #1 Userdata with authenticator structure.
+*/
+static int lualdap_authenticator (lua_State *L) {
+	auth_data *auth;
+	connect_options opts;
+	const char *host, *uri, *errmsg;
+	int use_tls, tls, i;
+	double timeout;
+	luaL_checktype (L, 1, LUA_TTABLE);
+	lua_settop (L, 1);
+	auth = (auth_data *)lua_newuserdata (L, sizeof(auth_data));
+	auth->conns = LUA_NOREF;
+	auth->n = auth->next = 0;
+	luaL_setmetatable (L, LUALDAP_AUTH_METATABLE);
+	auth->n = (int)longtabparam (L, 1, "connections", 4);
+	luaL_argcheck (L, auth->n > 0 && auth->n <= LUALDAP_MAX_AUTH_CONNECTIONS, 1,
+		LUALDAP_PREFIX"invalid number of connections");
+	use_tls = booltabparam (L, 1, "usetls", 0);
+	timeout = numbertabparam (L, 1, "timeout", 0.0);
+	host = strtabparam (L, 1, "uri", NULL);
+	if (host == NULL) {
+		lua_pop (L, 1);
+		host = strtabparam (L, 1, "host", NULL);
+		luaL_argcheck (L, host != NULL, 1, LUALDAP_PREFIX"no uri nor host given");
+	}
+	uri = push_uri (L, host);
+	errmsg = get_connect_options (L, 1, &opts);
+	if (errmsg != NULL)
+		return faildirect (L, errmsg);
+	tls = lua_gettop (L);
+
+	lua_createtable (L, auth->n, 0);
+	for (i = 0; i < auth->n; i++) {
+		conn_data *conn = create_connection (L);
+		auth->slots[i].msgid = 0;
+		auth->slots[i].box = LUA_NOREF;
+		errmsg = conn_open (L, conn, uri, use_tls, timeout, &opts);
+		if (errmsg != NULL) {
+			if (conn->ld != NULL)
+				conn_close (conn);
+			for (i--; i >= 0; i--) {
+				lua_rawgeti (L, -2, i + 1);
+				conn_close (toconnection (L, -1));
+				lua_pop (L, 1);
+			}
+			return faildirect (L, errmsg);
+		}
+		conn_remember (L, conn, uri, use_tls, timeout);
+		conn_remember_options (L, conn, &opts, tls);
+		lua_rawseti (L, -2, i + 1);
+	}
+	auth->conns = luaL_ref (L, LUA_REGISTRYINDEX);
+	lua_pushvalue (L, 2);
+	return 1;
+}
+
+
+/*
+** Close the connections of an authenticator.
+** Checks in progress report that the authenticator is closed.
+** @param #1 Authenticator.
+** @return #1 Number 1 (nothing when already closed).
+*/
+static int lualdap_auth_close (lua_State *L) {
+	auth_data *auth = (auth_data *)luaL_checkudata (L, 1, LUALDAP_AUTH_METATABLE);
+	int i;
+	if (auth->conns == LUA_NOREF) /* already closed */
+		return 0;
+	for (i = 0; i < auth->n; i++) {
+		conn_data *conn = auth_conn (L, auth, i);
+		if (conn != NULL)
+			conn_close (conn);
+		lua_pop (L, 1);
+		luaL_unref (L, LUA_REGISTRYINDEX, auth->slots[i].box);
+		auth->slots[i].box = LUA_NOREF;
+		auth->slots[i].msgid = 0;
+	}
+	luaL_unref (L, LUA_REGISTRYINDEX, auth->conns);
+	auth->conns = LUA_NOREF;
+	lua_pushnumber (L, 1);
+	return 1;
+}
+
+
+/*
+** Return the name of the object's metatable.
+** This function is used by `tostring'.
+*/
+static int lualdap_auth_tostring (lua_State *L) {
+	auth_data *auth = luaL_checkudata(L, 1, LUALDAP_AUTH_METATABLE);
+	if (auth->conns == LUA_NOREF)
+		lua_pushfstring (L, "%s (closed)", LUALDAP_AUTH_METATABLE);
+	else
+		lua_pushfstring (L, "%s (%p)", LUALDAP_AUTH_METATABLE, (void*)auth);
+	return 1;
+}
+
+
+/*
+** Create a metatable.
+*/
+static void lualdap_createmeta_auth (lua_State *L) {
+	static const luaL_Reg metamethods[] = {
+		{"__gc", lualdap_auth_close},
+		{"__tostring", lualdap_auth_tostring},
+		/* placeholders */
+		{"__index", NULL},
+		{"__metatable", NULL},
+		{NULL, NULL}
+	};
+	static const luaL_Reg methods[] = {
+		{"check", lualdap_auth_check},
+		{"close", lualdap_auth_close},
+		{NULL, NULL}
+	};
+
+	luaL_newmetatable (L, LUALDAP_AUTH_METATABLE);
+	luaL_setfuncs(L, metamethods, 0);  /* add metamethods to new metatable */
+
+	luaL_newlibtable(L, methods);  /* create method table */
+	luaL_setfuncs(L, methods, 0);  /* add file methods to method table */
+	lua_setfield(L, -2, "__index");  /* metatable.__index = method table */
+
+	lua_pushliteral(L,LUALDAP_PREFIX"you're not allowed to get this metatable");
+	lua_setfield (L, -2, "__metatable");
+
+	lua_pop(L, 1);  /* pop metatable */
+}
+#endif
+
+
+#if !defined(WIN32)
+/*
+** Duplicate a string (NULL stays NULL).
+*/
+static char *shared_strdup (const char *s) {
+	char *d;
+	if (s == NULL)
+		return NULL;
+	d = (char *)malloc (strlen (s) + 1);
+	if (d != NULL)
+		strcpy (d, s);
+	return d;
+}
+
+
+/*
+** Free a process-wide pool which could not be completely created.
+*/
+static void shared_free (shared_pool *pool) {
+	free (pool->name);
+	free (pool->uri);
+	free (pool->who);
+	free (pool->password);
+	free (pool->settings);
+	free (pool->idle);
+	free (pool);
+}
+
+
+/*
+** Push a string describing the settings of the TLS option of the table at
+** position tab: the settings themselves when given as a table, the library
+** context otherwise.
+** @param tls TLS context of the option (or NULL).
+*/
+static void shared_tls_settings (lua_State *L, int tab, const tls_data *tls) {
+	static const char *const names[] = {
+		"cacertfile", "cacertdir", "certfile", "keyfile", "ciphers", "require_cert", NULL
+	};
+	int i;
+	lua_getfield (L, tab, "tls");
+	if (!lua_istable (L, -1)) {
+		lua_pop (L, 1);
+		lua_pushfstring (L, "%p", tls != NULL ? tls->ctx : NULL);
+		return;
+	}
+	lua_pushliteral (L, "");
+	for (i = 0; names[i] != NULL; i++) {
+		lua_getfield (L, -2, names[i]);
+		lua_pushfstring (L, "%s=%s;", names[i], lua_isstring (L, -1) ? lua_tostring (L, -1) : "");
+		lua_replace (L, -2);
+		lua_concat (L, 2);
+	}
+	lua_replace (L, -2);
+}
+
+
+/*
+** Attach to a process-wide pool, which is created by the first Lua state
+** attaching to it. Process-wide pools live until the process exits.
+** A table with the name only attaches to an existing pool; otherwise the
+** parameters must be those the pool was created with.
+** @param #1 Table with the name of the pool (name, defaults to the URI),
+**	the connection parameters (uri or host, who, password, usetls,
+**	timeout, race, cooldown, tls) and the maximum number of connections
+**	(max).
+** @return #1 Userdata with the shared pool handle.
+*/
+static int lualdap_shared_pool (lua_State *L) {
+	static const char *const params[] = {
+		"who", "password", "usetls", "timeout", "race", "cooldown", "tls", "max", NULL
+	};
+	shared_data *handle;
+	shared_pool *pool;
+	const char *name, *host, *uri = NULL, *who = NULL, *password = NULL, *settings = NULL;
+	const char *errmsg;
+	int max = 0, use_tls = 0, conflict = 0, i;
+	double timeout = 0.0;
+	connect_options opts;
+	luaL_checktype (L, 1, LUA_TTABLE);
+	lua_settop (L, 1);
+	host = strtabparam (L, 1, "uri", NULL);
+	if (host == NULL)
+		host = strtabparam (L, 1, "host", NULL);
+	if (host == NULL) { /* attach to an existing pool */
+		for (i = 0; params[i] != NULL; i++) {
+			lua_getfield (L, 1, params[i]);
+			luaL_argcheck (L, lua_isnil (L, -1), 1, LUALDAP_PREFIX"no uri nor host given");
+			lua_pop (L, 1);
+		}
+		name = strtabparam (L, 1, "name", NULL);
+		luaL_argcheck (L, name != NULL, 1, LUALDAP_PREFIX"no uri nor host given");
+	} else {
+		uri = push_uri (L, host);
+		name = strtabparam (L, 1, "name", (char *)uri);
+		who = strtabparam (L, 1, "who", NULL);
+		password = strtabparam (L, 1, "password", (char *)"");
+		use_tls = booltabparam (L, 1, "usetls", 0);
+		timeout = numbertabparam (L, 1, "timeout", 0.0);
+		max = (int)longtabparam (L, 1, "max", 10);
+		luaL_argcheck (L, max > 0, 1, LUALDAP_PREFIX"invalid pool bounds");
+		errmsg = get_connect_options (L, 1, &opts);
+		if (errmsg != NULL)
+			return faildirect (L, errmsg);
+		shared_tls_settings (L, 1, opts.tls);
+		settings = lua_pushfstring (L, "%s\n%d:%s\n%s\n%d\n%f\n%d\n%d\n%f\n%s",
+			uri, who != NULL, who != NULL ? who : "", password, use_tls, timeout,
+			max, opts.race, opts.cooldown, lua_tostring (L, -1));
+	}
+
+	/* no Lua error may be raised while the lock is held */
+	pthread_mutex_lock (&shared_pools_lock);
+	for (pool = shared_pools; pool != NULL; pool = pool->next)
+		if (strcmp (pool->name, name) == 0)
+			break;
+	if (pool != NULL)
+		conflict = settings != NULL && strcmp (pool->settings, settings) != 0;
+	else if (settings != NULL) {
+		pool = (shared_pool *)calloc (1, sizeof(shared_pool));
+		if (pool == NULL) {
+			pthread_mutex_unlock (&shared_pools_lock);
+			return luaL_error (L, LUALDAP_PREFIX"no memory");
+		}
+		pool->max = max;
+		pool->use_tls = use_tls;
+		pool->timeout = timeout;
+		pool->race = opts.race;
+		pool->cooldown = opts.cooldown;
+		pool->name = shared_strdup (name);
+		pool->uri = shared_strdup (uri);
+		pool->who = shared_strdup (who);
+		pool->password = shared_strdup (password);
+		pool->settings = shared_strdup (settings);
+		pool->idle = (LDAP **)malloc (max * sizeof(LDAP *));
+		if (pool->name == NULL || pool->uri == NULL || (who != NULL && pool->who == NULL)
+			|| pool->password == NULL || pool->settings == NULL || pool->idle == NULL) {
+			shared_free (pool);
+			pthread_mutex_unlock (&shared_pools_lock);
+			return luaL_error (L, LUALDAP_PREFIX"no memory");
+		}
+#if !defined(WINLDAP)
+		if (opts.tls != NULL) {
+			/* the pool outlives the Lua state: it takes its own reference */
+			LDAP *ld;
+			pool->tls.require_cert = opts.tls->require_cert;
+			if (ldap_initialize (&ld, NULL) == LDAP_SUCCESS) {
+				if (ldap_set_option (ld, LDAP_OPT_X_TLS_CTX, opts.tls->ctx) != LDAP_OPT_SUCCESS
+					|| ldap_get_option (ld, LDAP_OPT_X_TLS_CTX, &pool->tls.ctx) != LDAP_OPT_SUCCESS)
+					pool->tls.ctx = NULL;
+				ldap_unbind_ext (ld, NULL, NULL);
+			}
+			if (pool->tls.ctx == NULL) {
+				shared_free (pool);
+				pthread_mutex_unlock (&shared_pools_lock);
+				return faildirect (L, LUALDAP_PREFIX"Could not set TLS context");
+			}
+		}
+#endif
+		pthread_mutex_init (&pool->lock, NULL);
+		pthread_cond_init (&pool->available, NULL);
+		pool->pid = getpid ();
+		pool->next = shared_pools;
+		shared_pools = pool;
+	}
+	pthread_mutex_unlock (&shared_pools_lock);
+	luaL_argcheck (L, pool != NULL, 1, LUALDAP_PREFIX"no uri nor host given");
+	if (conflict)
+		return luaL_error (L, LUALDAP_PREFIX"shared pool `%s' exists with other settings", name);
+
+	handle = (shared_data *)lua_newuserdata (L, sizeof(shared_data));
+	handle->pool = pool;
+	luaL_setmetatable (L, LUALDAP_SHARED_METATABLE);
+	return 1;
+}
+
+
+/*
+** Borrow a connection of a process-wide pool, waiting for one to be given
+** back by another Lua state when the pool has reached its maximum size.
+** The connection goes back to the pool when it is put, closed or collected.
+** @param #1 Shared pool handle.
+** @param #2 Number with the maximum time to wait in seconds (optional,
+**	waits as long as needed by default).
+** @return #1 Userdata with connection structure.
+*/
+static int lualdap_shared_get (lua_State *L) {
+	shared_pool *pool = ((shared_data *)luaL_checkudata (L, 1, LUALDAP_SHARED_METATABLE))->pool;
+	double wait = luaL_optnumber (L, 2, -1.0);
+	double start = monotonic ();
+	struct timespec deadline;
+	conn_data *conn;
+	connect_options opts;
+	LDAP *ld = NULL;
+	const char *errmsg;
+
+	if (wait >= 0.0) {
+		struct timeval now;
+		gettimeofday (&now, NULL);
+		deadline.tv_sec = now.tv_sec + (time_t)wait;
+		deadline.tv_nsec = now.tv_usec * 1000L + (long)(1e9 * (wait - (double)(time_t)wait));
+		if (deadline.tv_nsec >= 1000000000L) {
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000L;
+		}
+	}
+	/* no Lua error may be raised while a connection is reserved */
+	conn = create_connection (L);
+	conn_remember (L, conn, pool->uri, pool->use_tls, pool->timeout);
+	if (pool->who != NULL)
+		conn_remember_bind (L, conn, pool->who, pool->password);
+
+	pthread_mutex_lock (&pool->lock);
+	if (pool->pid != getpid ()) { /* the idle connections belong to the parent process */
+		while (pool->nidle > 0) {
+			ld = pool->idle[--pool->nidle];
+			ld_orphan (ld);
+			ldap_unbind_ext (ld, NULL, NULL);
+			pool->size--;
+		}
+		ld = NULL;
+		pool->pid = getpid ();
+	}
+	while (pool->nidle == 0 && pool->size >= pool->max) {
+		if (wait < 0.0)
+			pthread_cond_wait (&pool->available, &pool->lock);
+		else if (pthread_cond_timedwait (&pool->available, &pool->lock, &deadline) == ETIMEDOUT) {
+			pool->exhausted++;
+			pool->wait += monotonic () - start;
+			pthread_mutex_unlock (&pool->lock);
+			return faildirect (L, LUALDAP_PREFIX"pool exhausted");
+		}
+	}
+	pool->gets++;
+	pool->wait += monotonic () - start;
+	if (pool->nidle > 0)
+		ld = pool->idle[--pool->nidle];
+	else
+		pool->size++; /* reserve the place of the new connection */
+	pthread_mutex_unlock (&pool->lock);
+
+	if (ld != NULL) {
+		conn->ld = ld;
+		conn->version = LDAP_VERSION3;
+		conn->lender = pool;
+		stats_attach (conn);
+		return 1;
+	}
+	opts.race = pool->race;
+	opts.cooldown = pool->cooldown;
+	opts.tls = pool->tls.ctx != NULL ? &pool->tls : NULL;
+	errmsg = conn_open (L, conn, pool->uri, pool->use_tls, pool->timeout, &opts);
+	if (errmsg == NULL && pool->who != NULL) {
+		int err = conn_bind (conn, pool->who, pool->password);
+		if (err != LDAP_SUCCESS)
+			errmsg = ldap_err2string (err);
+	}
+	if (errmsg != NULL) {
+		if (conn->ld != NULL)
+			conn_close (conn);
+		pthread_mutex_lock (&pool->lock);
+		pool->size--;
+		pthread_cond_signal (&pool->available);
+		pthread_mutex_unlock (&pool->lock);
+		return faildirect (L, errmsg);
+	}
+	conn->lender = pool;
+	return 1;
+}
+
+
+/*
+** Give back a borrowed connection to its process-wide pool.
+** The connection object is closed in this Lua state.
+** @param #1 Shared pool handle.
+** @param #2 LDAP connection (borrowed from the pool).
+** @param #3 Boolean indicating that the connection is broken (optional).
+** @return #1 True.
+*/
+static int lualdap_shared_put (lua_State *L) {
+	shared_pool *pool = ((shared_data *)luaL_checkudata (L, 1, LUALDAP_SHARED_METATABLE))->pool;
+	conn_data *conn = (conn_data *)luaL_checkudata (L, 2, LUALDAP_CONNECTION_METATABLE);
+	luaL_argcheck (L, conn->ld == NULL || conn->lender == pool, 2,
+		LUALDAP_PREFIX"connection not lent by this pool");
+	if (conn->ld != NULL)
+		conn_release (conn, lua_toboolean (L, 3));
+	lua_pushboolean (L, 1);
+	return 1;
+}
+
+
+/*
+** Return the name of the object's metatable.
+** This function is used by `tostring'.
+*/
+static int lualdap_shared_tostring (lua_State *L) {
+	shared_data *handle = luaL_checkudata(L, 1, LUALDAP_SHARED_METATABLE);
+	lua_pushfstring (L, "%s (%s)", LUALDAP_SHARED_METATABLE, handle->pool->name);
+	return 1;
+}
+
+
+/*
+** Create a metatable.
+*/
+static void lualdap_createmeta_shared (lua_State *L) {
+	static const luaL_Reg metamethods[] = {
+		{"__tostring", lualdap_shared_tostring},
+		/* placeholders */
+		{"__index", NULL},
+		{"__metatable", NULL},
+		{NULL, NULL}
+	};
+	static const luaL_Reg methods[] = {
+		{"get", lualdap_shared_get},
+		{"put", lualdap_shared_put},
+		{NULL, NULL}
+	};
+
+	luaL_newmetatable (L, LUALDAP_SHARED_METATABLE);
+	luaL_setfuncs(L, metamethods, 0);  /* add metamethods to new metatable */
+
+	luaL_newlibtable(L, methods);  /* create method table */
+	luaL_setfuncs(L, methods, 0);  /* add file methods to method table */
+	lua_setfield(L, -2, "__index");  /* metatable.__index = method table */
+
+	lua_pushliteral(L,LUALDAP_PREFIX"you're not allowed to get this metatable");
+	lua_setfield (L, -2, "__metatable");
+
+	lua_pop(L, 1);  /* pop metatable */
+}
+#endif
+
+
+#if !defined(WINLDAP)
+/*
+** Create a TLS context, to be shared by connections (see the tls option).
+** @param #1 Table with the TLS settings (cacertfile, cacertdir, certfile,
+**	keyfile, ciphers, require_cert).
+** @return #1 Userdata with TLS context structure.
+*/
+static int lualdap_tls_context (lua_State *L) {
+	const char *errmsg;
+	luaL_checktype (L, 1, LUA_TTABLE);
+	errmsg = tls_new (L, 1);
+	if (errmsg != NULL)
+		return faildirect (L, errmsg);
+	return 1;
+}
+
+
+/*
+** Release the TLS context.
+** Connections which use it keep their own reference.
+*/
+static int lualdap_tls_gc (lua_State *L) {
+	tls_data *tls = (tls_data *)luaL_checkudata (L, 1, LUALDAP_TLS_METATABLE);
+	if (tls->ctx != NULL) {
+#if defined(LUALDAP_TLS_CTX_FREE)
+		ldap_pvt_tls_ctx_free (tls->ctx);
+#endif
+		tls->ctx = NULL;
+	}
+	return 0;
+}
+
+
+/*
+** Return the name of the object's metatable.
+** This function is used by `tostring'.
+*/
+static int lualdap_tls_tostring (lua_State *L) {
+	lua_pushfstring (L, "%s (%p)", LUALDAP_TLS_METATABLE, luaL_checkudata (L, 1, LUALDAP_TLS_METATABLE));
+	return 1;
+}
+
+
+/*
+** Create a metatable.
+*/
+static void lualdap_createmeta_tls (lua_State *L) {
+	static const luaL_Reg metamethods[] = {
+		{"__gc", lualdap_tls_gc},
+		{"__tostring", lualdap_tls_tostring},
+		/* placeholders */
+		{"__metatable", NULL},
+		{NULL, NULL}
+	};
+
+	luaL_newmetatable (L, LUALDAP_TLS_METATABLE);
+	luaL_setfuncs(L, metamethods, 0);  /* add metamethods to new metatable */
+
+	lua_pushliteral(L,LUALDAP_PREFIX"you're not allowed to get this metatable");
+	lua_setfield (L, -2, "__metatable");
+
+	lua_pop(L, 1);  /* pop metatable */
+}
+#endif
+
+
+#if !defined(WIN32)
+/*
+** Set the debug level of the LDAP library and where its output goes.
+** @param #1 Number with the debug level (0 disables the output).
+** @param #2 Function called with each line of output (optional, the
+**	output goes to the standard error by default).
+** @param #3 Number with the maximum number of lines per second (optional,
+**	no limit by default).
+** @return #1 True.
+*/
+static int lualdap_set_debug (lua_State *L) {
+	int level = (int)luaL_checkinteger (L, 1);
+	double rate = luaL_optnumber (L, 3, 0.0);
+	int sink = lua_isnoneornil (L, 2) ? -1 : 1;
+	union { BER_LOG_PRINT_FN *fn; void *p; } print; /* passed as a pointer */
+	if (sink > 0)
+		luaL_checktype (L, 2, LUA_TFUNCTION);
+	luaL_argcheck (L, rate >= 0.0, 3, LUALDAP_PREFIX"invalid rate");
+	lua_settop (L, 2);
+	lua_newtable (L);
+	lua_pushvalue (L, 2);
+	lua_setfield (L, -2, "func");
+	pthread_mutex_lock (&debug_lock);
+	debug_owner++;
+	debug_sink = sink;
+	debug_rate = rate;
+	debug_len = 0;
+	debug_dropped = 0;
+	debug_pending = 0;
+	pthread_mutex_unlock (&debug_lock);
+	lua_pushnumber (L, debug_owner);
+	lua_setfield (L, -2, "owner");
+	lua_setfield (L, LUA_REGISTRYINDEX, LUALDAP_DEBUG_SINK);
+	print.fn = debug_print;
+	ber_set_option (NULL, LBER_OPT_LOG_PRINT_FN, print.p);
+	ber_set_option (NULL, LBER_OPT_DEBUG_LEVEL, &level);
+	ldap_set_option (NULL, LDAP_OPT_DEBUG_LEVEL, &level);
+	lua_pushboolean (L, 1);
+	return 1;
+}
+
+
+/*
+** Deliver the debug output waiting for the sink of set_debug.
+** @return #1 True, or nil followed by the first error raised by the sink.
+*/
+static int lualdap_flush_debug (lua_State *L) {
+	if (debug_flush (L))
+		return faildirect (L, lua_tostring (L, -1));
+	lua_pushboolean (L, 1);
+	return 1;
+}
+#endif
+
+
+#if !defined(WIN32)
+/* Counters of a process-wide pool */
+typedef struct {
+	const char   *name;
+	unsigned long size, idle, max, gets, exhausted;
+	double        wait;
+} shared_metrics;
+#endif
+
+
+/*
+** Add the statistics of a connection to the totals.
+*/
+static void metrics_add_conn (metrics_data *m, conn_data *conn) {
+	if (conn->ld != NULL)
+		m->conns++;
+	m->pending += conn->pending;
+	m->reconnects += conn->generation;
+	stats_add (&m->stats, &conn->stats);
+}
+
+
+/*
+** Compute the totals of the connections and pools registered by track_object,
+** starting from the counters of metrics_retired.
+*/
+static void metrics_collect (lua_State *L, metrics_data *m) {
+	metrics_data *retired = metrics_retired (L);
+	if (retired != NULL)
+		*m = *retired;
+	else
+		memset (m, 0, sizeof(metrics_data));
+	lua_getfield (L, LUA_REGISTRYINDEX, LUALDAP_OBJECTS);
+	lua_pushnil (L);
+	while (lua_next (L, -2) != 0) {
+		void *p;
+		lua_pop (L, 1);
+		if ((p = toudata (L, -1, LUALDAP_CONNECTION_METATABLE)) != NULL)
+			metrics_add_conn (m, (conn_data *)p);
+		else if ((p = toudata (L, -1, LUALDAP_POOL_METATABLE)) != NULL) {
+			pool_data *pool = (pool_data *)p;
+			if (pool->params != LUA_NOREF) {
+				m->idle += pool->nidle;
+				m->lent += pool_lent (L, pool);
+				m->max += pool->max;
+			}
+			m->gets += pool->gets;
+			m->exhausted += pool->exhausted;
+			m->get_time += pool->get_time;
+		}
+	}
+	lua_pop (L, 1);
+}
+
+
+/*
+** Add the header of a metric to the buffer.
+*/
+static void metrics_header (luaL_Buffer *b, const char *name, const char *type, const char *help) {
+	lua_State *L = b->L;
+	lua_pushfstring (L, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+	luaL_addvalue (b);
+}
+
+
+/*
+** Add a metric without labels, with its header, to the buffer.
+*/
+static void metrics_value (luaL_Buffer *b, const char *name, const char *type, const char *help, double value) {
+	metrics_header (b, name, type, help);
+	lua_pushfstring (b->L, "%s %f\n", name, (lua_Number)value);
+	luaL_addvalue (b);
+}
+
+
+/*
+** Add a metric of each type of operation, with its header, to the buffer.
+** @param errors Boolean indicating if the failures are reported instead
+**	of the operations.
+*/
+static void metrics_ops (luaL_Buffer *b, const char *name, const char *help, const stats_data *s, int errors) {
+	int op;
+	metrics_header (b, name, "counter", help);
+	for (op = 0; op < LUALDAP_NOPS; op++) {
+		lua_pushfstring (b->L, "%s{op=\"%s\"} %f\n", name, op_names[op],
+			(lua_Number)(errors ? s->ops[op].errors : s->ops[op].count));
+		luaL_addvalue (b);
+	}
+}
+
+
+/*
+** Add the latency histograms of the types of operations to the buffer.
+** The upper bound of the i-th bucket (from 0) is 2^(i+1) microseconds.
+*/
+static void metrics_histograms (luaL_Buffer *b, const stats_data *s) {
+	static const char *name = "lualdap_operation_duration_seconds";
+	lua_State *L = b->L;
+	int op, i;
+	metrics_header (b, name, "histogram", "Latency of the LDAP operations.");
+	for (op = 0; op < LUALDAP_NOPS; op++) {
+		const op_stats *o = &s->ops[op];
+		unsigned long n = 0;
+		double bound = 2e-6;
+		for (i = 0; i < LUALDAP_HIST_BUCKETS - 1; i++, bound *= 2.0) {
+			n += o->hist[i];
+			lua_pushfstring (L, "%s_bucket{op=\"%s\",le=\"%f\"} %f\n", name, op_names[op],
+				(lua_Number)bound, (lua_Number)n);
+			luaL_addvalue (b);
+		}
+		lua_pushfstring (L, "%s_bucket{op=\"%s\",le=\"+Inf\"} %f\n%s_sum{op=\"%s\"} %f\n%s_count{op=\"%s\"} %f\n",
+			name, op_names[op], (lua_Number)o->count, name, op_names[op], (lua_Number)o->time,
+			name, op_names[op], (lua_Number)o->count);
+		luaL_addvalue (b);
+	}
+}
+
+
+#if !defined(WIN32)
+/*
+** Add the value of a label, escaped, to the buffer.
+*/
+static void metrics_label (luaL_Buffer *b, const char *value) {
+	for (; *value != '\0'; value++) {
+		if (*value == '\\' || *value == '"')
+			luaL_addchar (b, '\\');
+		if (*value == '\n')
+			luaL_addstring (b, "\\n");
+		else
+			luaL_addchar (b, *value);
+	}
+}
+
+
+/*
+** Add a metric of each process-wide pool, with its header, to the buffer.
+** @param field Offset of the counter in shared_metrics.
+*/
+static void metrics_shared (luaL_Buffer *b, const char *name, const char *type, const char *help,
+	const shared_metrics *pools, int n, size_t field, int real) {
+	int i;
+	metrics_header (b, name, type, help);
+	for (i = 0; i < n; i++) {
+		const char *p = (const char *)&pools[i] + field;
+		double value = real ? *(const double *)p : (double)*(const unsigned long *)p;
+		lua_pushfstring (b->L, "%s{pool=\"", name);
+		luaL_addvalue (b);
+		metrics_label (b, pools[i].name);
+		lua_pushfstring (b->L, "\"} %f\n", (lua_Number)value);
+		luaL_addvalue (b);
+	}
+}
+
+
+/*
+** Take a snapshot of the counters of the process-wide pools.
+** @return Array of counters (to be freed) or NULL when there is no pool.
+*/
+static shared_metrics *shared_snapshot (int *n) {
+	shared_metrics *pools = NULL;
+	shared_pool *pool;
+	int i = 0;
+	/* no Lua error may be raised while the lock is held */
+	pthread_mutex_lock (&shared_pools_lock);
+	for (pool = shared_pools; pool != NULL; pool = pool->next)
+		i++;
+	if (i > 0)
+		pools = (shared_metrics *)malloc (i * sizeof(shared_metrics));
+	*n = (pools != NULL) ? i : 0;
+	for (i = 0, pool = shared_pools; pool != NULL && i < *n; pool = pool->next, i++) {
+		pthread_mutex_lock (&pool->lock);
+		pools[i].name = pool->name; /* pools live until the process exits */
+		pools[i].size = (unsigned long)pool->size;
+		pools[i].idle = (unsigned long)pool->nidle;
+		pools[i].max = (unsigned long)pool->max;
+		pools[i].gets = pool->gets;
+		pools[i].exhausted = pool->exhausted;
+		pools[i].wait = pool->wait;
+		pthread_mutex_unlock (&pool->lock);
+	}
+	pthread_mutex_unlock (&shared_pools_lock);
+	return pools;
+}
+#endif
+
+
+/*
+** Render the metrics of the connections and pools of the Lua state, and of
+** the process-wide pools, in the Prometheus text exposition format.
+** @return #1 String with the metrics.
+*/
+static int lualdap_metrics_text (lua_State *L) {
+	metrics_data m;
+	luaL_Buffer b;
+	int i;
+#if !defined(WIN32)
+	int n;
+	shared_metrics *pools;
 #endif
-	if (err != LDAP_SUCCESS)
-		return faildirect (L, ldap_err2string (err));
+	lua_settop (L, 0);
+	metrics_collect (L, &m);
+	luaL_buffinit (L, &b);
+	metrics_value (&b, "lualdap_connections", "gauge", "Open LDAP connections.", (double)m.conns);
+	metrics_value (&b, "lualdap_operations_in_flight", "gauge", "LDAP operations waiting for their results.", (double)m.pending);
+	metrics_value (&b, "lualdap_reconnects_total", "counter", "Automatic reconnections.", (double)m.reconnects);
+	metrics_ops (&b, "lualdap_operations_total", "Completed LDAP operations.", &m.stats, 0);
+	metrics_ops (&b, "lualdap_operation_errors_total", "Failed LDAP operations.", &m.stats, 1);
+	metrics_histograms (&b, &m.stats);
+	metrics_header (&b, "lualdap_results_total", "counter", "Failed LDAP operations by result code.");
+	for (i = 0; i <= LUALDAP_MAX_RESULT_CODE + 1; i++)
+		if (m.stats.results[i] > 0) {
+			lua_pushfstring (L, "lualdap_results_total{code=\"%d\"} %f\n", i, (lua_Number)m.stats.results[i]);
+			luaL_addvalue (&b);
+		}
+	metrics_value (&b, "lualdap_search_entries_total", "counter", "Entries returned by searches.", (double)m.stats.entries);
+	metrics_value (&b, "lualdap_received_bytes_total", "counter", "Bytes of LDAP messages received.", (double)m.stats.bytes_in);
+	metrics_value (&b, "lualdap_sent_bytes_total", "counter", "Bytes of LDAP messages sent.", (double)m.stats.bytes_out);
+	metrics_header (&b, "lualdap_pool_connections", "gauge", "Connections of the pools.");
+	lua_pushfstring (L, "lualdap_pool_connections{state=\"idle\"} %f\nlualdap_pool_connections{state=\"lent\"} %f\n",
+		(lua_Number)m.idle, (lua_Number)m.lent);
+	luaL_addvalue (&b);
+	metrics_value (&b, "lualdap_pool_max_connections", "gauge", "Maximum size of the pools.", (double)m.max);
+	metrics_value (&b, "lualdap_pool_gets_total", "counter", "Connections requested from the pools.", (double)m.gets);
+	metrics_value (&b, "lualdap_pool_exhausted_total", "counter", "Requests which found their pool exhausted.", (double)m.exhausted);
+	metrics_value (&b, "lualdap_pool_get_seconds_total", "counter", "Time spent getting connections from the pools.", m.get_time);
+#if !defined(WIN32)
+	pools = shared_snapshot (&n);
+	if (n > 0) {
+		metrics_shared (&b, "lualdap_shared_pool_connections", "gauge", "Open connections of the process-wide pools.",
+			pools, n, offsetof(shared_metrics, size), 0);
+		metrics_shared (&b, "lualdap_shared_pool_idle_connections", "gauge", "Idle connections of the process-wide pools.",
+			pools, n, offsetof(shared_metrics, idle), 0);
+		metrics_shared (&b, "lualdap_shared_pool_max_connections", "gauge", "Maximum size of the process-wide pools.",
+			pools, n, offsetof(shared_metrics, max), 0);
+		metrics_shared (&b, "lualdap_shared_pool_gets_total", "counter", "Connections borrowed from the process-wide pools.",
+			pools, n, offsetof(shared_metrics, gets), 0);
+		metrics_shared (&b, "lualdap_shared_pool_exhausted_total", "counter", "Borrowings which timed out.",
+			pools, n, offsetof(shared_metrics, exhausted), 0);
+		metrics_shared (&b, "lualdap_shared_pool_wait_seconds_total", "counter", "Time waited for connections of the process-wide pools.",
+			pools, n, offsetof(shared_metrics, wait), 1);
+	}
+	free (pools);
+#endif
+	luaL_pushresult (&b);
+	return 1;
+}
 
-	lua_pushvalue (L, 1);
+
+#if !defined(WINLDAP)
+/* Incremental decoder of LDAP messages */
+typedef struct {
+	char      *buf;       /* bytes received and not decoded yet */
+	size_t     first;     /* offset of the first byte not decoded */
+	size_t     len;       /* offset of the end of the received bytes */
+	size_t     size;      /* size of the buffer */
+} decoder_data;
+
+
+/*
+** Push the encoded request or nil and an error message, and release the
+** BER element.
+** @param rc Result of the last ber_printf.
+*/
+static int codec_result (lua_State *L, BerElement *ber, int rc) {
+	BerValue data;
+	if (rc == -1 || ber_flatten2 (ber, &data, 0) == -1) {
+		ber_free (ber, 1);
+		return faildirect (L, LUALDAP_PREFIX"encoding error");
+	}
+	lua_pushlstring (L, data.bv_val, data.bv_len);
+	ber_free (ber, 1);
 	return 1;
 }
 
 
 /*
-** Add a new entry to the directory.
-** @param #1 LDAP connection.
-** @param #2 String with new entry's DN.
-** @param #3 Table with new entry's attributes and values.
-** @return Function to process the LDAP result.
+** Create the BER element of a request.
 */
-static int lualdap_add (lua_State *L) {
-	conn_data *conn = getconnection (L);
-	ldap_pchar_t dn = (ldap_pchar_t) luaL_checkstring (L, 2);
-	attrs_data attrs;
-	ldap_int_t rc, msgid;
-	A_init (&attrs);
-	if (lua_istable (L, 3))
-		A_tab2mod (L, &attrs, 3, LUALDAP_MOD_ADD);
-	A_lastattr (L, &attrs);
-	rc = ldap_add_ext (conn->ld, dn, attrs.attrs, NULL, NULL, &msgid);
-	return create_future (L, rc, 1, msgid, LDAP_RES_ADD);
+static BerElement *codec_alloc (lua_State *L) {
+	BerElement *ber = ber_alloc_t (LBER_USE_DER);
+	if (ber == NULL)
+		luaL_error (L, LUALDAP_PREFIX"%s", ldap_err2string (LDAP_NO_MEMORY));
+	return ber;
 }
 
 
 /*
-** Compare a value against an entry.
-** @param #1 LDAP connection.
-** @param #2 String with entry's DN.
-** @param #3 String with attribute's name.
-** @param #4 String with attribute's value.
-** @return Function to process the LDAP result.
+** Get the message id of a request.
 */
-static int lualdap_compare (lua_State *L) {
-	conn_data *conn = getconnection (L);
-	ldap_pchar_t dn = (ldap_pchar_t) luaL_checkstring (L, 2);
-	ldap_pchar_t attr = (ldap_pchar_t) luaL_checkstring (L, 3);
-	BerValue bvalue;
-	ldap_int_t rc, msgid;
+static ber_int_t codec_msgid (lua_State *L) {
+	lua_Number msgid = luaL_checknumber (L, 1);
+	luaL_argcheck (L, msgid > 0 && msgid <= 2147483647.0, 1, LUALDAP_PREFIX"invalid message id");
+	return (ber_int_t)msgid;
+}
+
+
+/*
+** Encode a simple bind request.
+** @param #1 Number with the message id.
+** @param #2 String with the DN of the user.
+** @param #3 String with the password.
+** @return #1 String with the encoded request.
+*/
+static int lualdap_codec_bind_simple (lua_State *L) {
+	ber_int_t msgid = codec_msgid (L);
+	const char *dn = luaL_checkstring (L, 2);
+	BerValue cred;
+	BerElement *ber;
 	size_t len;
-	bvalue.bv_val = (char *)luaL_checklstring (L, 4, &len);
-	bvalue.bv_len = len;
-	rc = ldap_compare_ext (conn->ld, dn, attr, &bvalue, NULL, NULL, &msgid);
-	return create_future (L, rc, 1, msgid, LDAP_RES_COMPARE);
+	cred.bv_val = (char *)luaL_checklstring (L, 3, &len);
+	cred.bv_len = len;
+	ber = codec_alloc (L);
+	return codec_result (L, ber, ber_printf (ber, "{it{istO}}", msgid, LDAP_REQ_BIND,
+		(ber_int_t)LDAP_VERSION3, dn, LDAP_AUTH_SIMPLE, &cred));
 }
 
 
 /*
-** Delete an entry.
-** @param #1 LDAP connection.
-** @param #2 String with entry's DN.
-** @return Boolean.
+** Encode a step of a SASL bind.
+** @param #1 Number with the message id.
+** @param #2 String with the name of the mechanism.
+** @param #3 String with the credentials (optional).
+** @param #4 String with the DN of the user (optional).
+** @return #1 String with the encoded request.
 */
-static int lualdap_delete (lua_State *L) {
-	conn_data *conn = getconnection (L);
-	ldap_pchar_t dn = (ldap_pchar_t) luaL_checkstring (L, 2);
-	ldap_int_t rc, msgid;
-	rc = ldap_delete_ext (conn->ld, dn, NULL, NULL, &msgid);
-	return create_future (L, rc, 1, msgid, LDAP_RES_DELETE);
+static int lualdap_codec_bind_sasl (lua_State *L) {
+	ber_int_t msgid = codec_msgid (L);
+	const char *mech = luaL_checkstring (L, 2);
+	const char *dn = luaL_optstring (L, 4, "");
+	BerElement *ber;
+	int rc;
+	ber = codec_alloc (L);
+	if (lua_isnoneornil (L, 3))
+		rc = ber_printf (ber, "{it{ist{s}}}", msgid, LDAP_REQ_BIND,
+			(ber_int_t)LDAP_VERSION3, dn, LDAP_AUTH_SASL, mech);
+	else {
+		BerValue cred;
+		size_t len;
+		cred.bv_val = (char *)luaL_checklstring (L, 3, &len);
+		cred.bv_len = len;
+		rc = ber_printf (ber, "{it{ist{sO}}}", msgid, LDAP_REQ_BIND,
+			(ber_int_t)LDAP_VERSION3, dn, LDAP_AUTH_SASL, mech, &cred);
+	}
+	return codec_result (L, ber, rc);
 }
 
 
 /*
-** Convert a string into an internal LDAP_MOD operation code.
+** Encode an unbind request.
+** @param #1 Number with the message id.
+** @return #1 String with the encoded request.
 */
-static int op2code (const char *s) {
-	if (!s)
-		return LUALDAP_NO_OP;
-	switch (*s) {
-		case '+':
-			return LUALDAP_MOD_ADD;
-		case '-':
-			return LUALDAP_MOD_DEL;
-		case '=':
-			return LUALDAP_MOD_REP;
-		default:
-			return LUALDAP_NO_OP;
+static int lualdap_codec_unbind (lua_State *L) {
+	ber_int_t msgid = codec_msgid (L);
+	BerElement *ber = codec_alloc (L);
+	return codec_result (L, ber, ber_printf (ber, "{itn}", msgid, LDAP_REQ_UNBIND));
+}
+
+
+/*
+** Encode an abandon request.
+** @param #1 Number with the message id.
+** @param #2 Number with the message id of the operation to abandon.
+** @return #1 String with the encoded request.
+*/
+static int lualdap_codec_abandon (lua_State *L) {
+	ber_int_t msgid = codec_msgid (L);
+	ber_int_t id = (ber_int_t)luaL_checknumber (L, 2);
+	BerElement *ber = codec_alloc (L);
+	return codec_result (L, ber, ber_printf (ber, "{iti}", msgid, LDAP_REQ_ABANDON, id));
+}
+
+
+/*
+** Encode a search filter.
+** The value of an assertion control is the encoded filter; the handle
+** needed to create it is not connected.
+** @return 0 on success; -1 otherwise.
+*/
+static int codec_filter (BerElement *ber, const char *filter) {
+	LDAP *ld;
+	BerValue value;
+	int rc = -1;
+	if (ldap_initialize (&ld, NULL) != LDAP_SUCCESS)
+		return -1;
+	if (ldap_create_assertion_control_value (ld, (char *)filter, &value) == LDAP_SUCCESS) {
+		if (ber_write (ber, value.bv_val, value.bv_len, 0) == (ber_slen_t)value.bv_len)
+			rc = 0;
+		ber_memfree (value.bv_val);
 	}
+	ldap_unbind_ext (ld, NULL, NULL);
+	return rc;
 }
 
 
 /*
-** Modify an entry.
-** @param #1 LDAP connection.
-** @param #2 String with entry's DN.
-** @param #3, #4... Tables with modifications to apply.
-** @return True on success or nil, error message otherwise.
+** Encode a search request.
+** @param #1 Number with the message id.
+** @param #2 Table with the search parameters, as those of conn:search
+**	(the timeout is sent as the time limit, in seconds).
+** @return #1 String with the encoded request.
 */
-static int lualdap_modify (lua_State *L) {
-	conn_data *conn = getconnection (L);
-	ldap_pchar_t dn = (ldap_pchar_t) luaL_checkstring (L, 2);
+static int lualdap_codec_search (lua_State *L) {
+	ber_int_t msgid = codec_msgid (L);
+	char *attrs[LUALDAP_MAX_ATTRS];
+	const char *base, *filter;
+	int scope, attrsonly, rc;
+	long sizelimit, timelimit;
+	BerElement *ber;
+
+	luaL_checktype (L, 2, LUA_TTABLE);
+	get_attrs_param (L, 2, attrs);
+	attrsonly = booltabparam (L, 2, "attrsonly", 0);
+	base = strtabparam (L, 2, "base", NULL);
+	filter = strtabparam (L, 2, "filter", NULL);
+	scope = string2scope (L, strtabparam (L, 2, "scope", NULL));
+	if (scope == LDAP_SCOPE_DEFAULT)
+		scope = LDAP_SCOPE_SUBTREE;
+	sizelimit = longtabparam (L, 2, "sizelimit", LDAP_NO_LIMIT);
+	timelimit = (long)numbertabparam (L, 2, "timeout", 0.0);
+
+	ber = codec_alloc (L);
+	if (ber_printf (ber, "{it{seeiib", msgid, LDAP_REQ_SEARCH, base ? base : "",
+		(ber_int_t)scope, (ber_int_t)LDAP_DEREF_NEVER, (ber_int_t)sizelimit,
+		(ber_int_t)timelimit, (ber_int_t)attrsonly) == -1)
+		return codec_result (L, ber, -1);
+	if (codec_filter (ber, filter ? filter : "(objectClass=*)") == -1) {
+		ber_free (ber, 1);
+		return faildirect (L, LUALDAP_PREFIX"bad search filter");
+	}
+	rc = ber_printf (ber, "{v}}}", attrs);
+	return codec_result (L, ber, rc);
+}
+
+
+/*
+** Encode the attributes of an add request or the modifications of
+** a modify request.
+** @param modify Boolean indicating if the operation codes must be encoded.
+*/
+static int codec_mods (BerElement *ber, LDAPMod **mods, int modify) {
+	int i;
+	for (i = 0; mods[i] != NULL; i++) {
+		int rc;
+		if (modify)
+			rc = ber_printf (ber, "{e{s[V]}}",
+				(ber_int_t)(mods[i]->mod_op & ~LDAP_MOD_BVALUES),
+				mods[i]->mod_type, mods[i]->mod_bvalues);
+		else
+			rc = ber_printf (ber, "{s[V]}", mods[i]->mod_type, mods[i]->mod_bvalues);
+		if (rc == -1)
+			return -1;
+	}
+	return 0;
+}
+
+
+/*
+** Encode an add request.
+** @param #1 Number with the message id.
+** @param #2 String with the DN of the new entry.
+** @param #3 Table with the attributes and values of the new entry.
+** @return #1 String with the encoded request.
+*/
+static int lualdap_codec_add (lua_State *L) {
+	ber_int_t msgid = codec_msgid (L);
+	const char *dn = luaL_checkstring (L, 2);
 	attrs_data attrs;
-	ldap_int_t rc, msgid;
+	BerElement *ber;
+	int rc;
+	A_init (&attrs);
+	if (lua_istable (L, 3))
+		A_tab2mod (L, &attrs, 3, LUALDAP_MOD_ADD);
+	A_lastattr (L, &attrs);
+	ber = codec_alloc (L);
+	rc = ber_printf (ber, "{it{s{", msgid, LDAP_REQ_ADD, dn);
+	if (rc != -1)
+		rc = codec_mods (ber, attrs.attrs, 0);
+	if (rc != -1)
+		rc = ber_printf (ber, "}}}");
+	return codec_result (L, ber, rc);
+}
+
+
+/*
+** Encode a modify request.
+** @param #1 Number with the message id.
+** @param #2 String with the DN of the entry.
+** @param #3, #4... Tables with the modifications, as those of conn:modify.
+** @return #1 String with the encoded request.
+*/
+static int lualdap_codec_modify (lua_State *L) {
+	ber_int_t msgid = codec_msgid (L);
+	const char *dn = luaL_checkstring (L, 2);
+	attrs_data attrs;
+	BerElement *ber;
 	int param = 3;
+	int rc;
 	A_init (&attrs);
 	while (lua_istable (L, param)) {
 		int op;
@@ -559,339 +6725,429 @@ static int lualdap_modify (lua_State *L) {
 		op = op2code (lua_tostring (L, -1));
 		if (op == LUALDAP_NO_OP)
 			return luaL_error (L, LUALDAP_PREFIX"forgotten operation on argument #%d", param);
-		/* get array of attributes and values */
 		A_tab2mod (L, &attrs, param, op);
 		param++;
 	}
 	A_lastattr (L, &attrs);
-	rc = ldap_modify_ext (conn->ld, dn, attrs.attrs, NULL, NULL, &msgid);
-	return create_future (L, rc, 1, msgid, LDAP_RES_MODIFY);
+	ber = codec_alloc (L);
+	rc = ber_printf (ber, "{it{s{", msgid, LDAP_REQ_MODIFY, dn);
+	if (rc != -1)
+		rc = codec_mods (ber, attrs.attrs, 1);
+	if (rc != -1)
+		rc = ber_printf (ber, "}}}");
+	return codec_result (L, ber, rc);
 }
 
 
 /*
-** Change the distinguished name of an entry.
+** Encode a delete request.
+** @param #1 Number with the message id.
+** @param #2 String with the DN of the entry.
+** @return #1 String with the encoded request.
 */
-static int lualdap_rename (lua_State *L) {
-	conn_data *conn = getconnection (L);
-	ldap_pchar_t dn = (ldap_pchar_t) luaL_checkstring (L, 2);
-	ldap_pchar_t rdn = (ldap_pchar_t) luaL_checkstring (L, 3);
-	ldap_pchar_t par = (ldap_pchar_t) luaL_optlstring (L, 4, NULL, NULL);
-	const int del = luaL_optnumber (L, 5, 0);
-	ldap_int_t msgid;
-	ldap_int_t rc = ldap_rename (conn->ld, dn, rdn, par, del, NULL, NULL, &msgid);
-	return create_future (L, rc, 1, msgid, LDAP_RES_MODDN);
+static int lualdap_codec_delete (lua_State *L) {
+	ber_int_t msgid = codec_msgid (L);
+	const char *dn = luaL_checkstring (L, 2);
+	BerElement *ber = codec_alloc (L);
+	return codec_result (L, ber, ber_printf (ber, "{its}", msgid, LDAP_REQ_DELETE, dn));
 }
 
 
 /*
-** Push an attribute value (or a table of values) on top of the stack.
-** @param L lua_State.
-** @param ld LDAP Connection.
-** @param entry Current entry.
-** @param attr Name of entry's attribute to get values from.
-** @return 1 in case of success.
+** Encode a rename (modify DN) request.
+** @param #1 Number with the message id.
+** @param #2 String with the DN of the entry.
+** @param #3 String with the new RDN.
+** @param #4 String with the new parent DN (optional).
+** @param #5 Number indicating if the old RDN must be deleted (optional).
+** @return #1 String with the encoded request.
 */
-static int push_values (lua_State *L, LDAP *ld, LDAPMessage *entry, char *attr) {
-	int i, n;
-	BerValue **vals = ldap_get_values_len (ld, entry, attr);
-	n = ldap_count_values_len (vals);
-	if (n == 0) /* no values */
-		lua_pushboolean (L, 1);
-	else if (n == 1) /* just one value */
-		lua_pushlstring (L, vals[0]->bv_val, vals[0]->bv_len);
-	else { /* Multiple values */
-		lua_newtable (L);
-		for (i = 0; i < n; i++) {
-			lua_pushlstring (L, vals[i]->bv_val, vals[i]->bv_len);
-			lua_rawseti (L, -2, i+1);
-		}
-	}
-	ldap_value_free_len (vals);
-	return 1;
+static int lualdap_codec_rename (lua_State *L) {
+	ber_int_t msgid = codec_msgid (L);
+	const char *dn = luaL_checkstring (L, 2);
+	const char *rdn = luaL_checkstring (L, 3);
+	const char *par = luaL_optstring (L, 4, NULL);
+	ber_int_t del = luaL_optnumber (L, 5, 0) != 0;
+	BerElement *ber = codec_alloc (L);
+	if (par == NULL)
+		return codec_result (L, ber, ber_printf (ber, "{it{ssb}}", msgid,
+			LDAP_REQ_MODDN, dn, rdn, del));
+	return codec_result (L, ber, ber_printf (ber, "{it{ssbts}}", msgid,
+		LDAP_REQ_MODDN, dn, rdn, del, LDAP_TAG_NEWSUPERIOR, par));
 }
 
 
 /*
-** Store entry's attributes and values at the given table.
-** @param entry Current entry.
-** @param tab Absolute stack index of the table.
+** Encode a compare request.
+** @param #1 Number with the message id.
+** @param #2 String with the DN of the entry.
+** @param #3 String with the name of the attribute.
+** @param #4 String with the value.
+** @return #1 String with the encoded request.
 */
-static void set_attribs (lua_State *L, LDAP *ld, LDAPMessage *entry, int tab) {
-	char *attr;
-	BerElement *ber = NULL;
-	for (attr = ldap_first_attribute (ld, entry, &ber);
-		attr != NULL;
-		attr = ldap_next_attribute (ld, entry, ber))
-	{
-		lua_pushstring (L, attr);
-		push_values (L, ld, entry, attr);
-		lua_rawset (L, tab); /* tab[attr] = vals */
-		ldap_memfree (attr);
-	}
-	ber_free (ber, 0); /* don't need to test if (ber == NULL) */
+static int lualdap_codec_compare (lua_State *L) {
+	ber_int_t msgid = codec_msgid (L);
+	const char *dn = luaL_checkstring (L, 2);
+	const char *attr = luaL_checkstring (L, 3);
+	BerValue bvalue;
+	BerElement *ber;
+	size_t len;
+	bvalue.bv_val = (char *)luaL_checklstring (L, 4, &len);
+	bvalue.bv_len = len;
+	ber = codec_alloc (L);
+	return codec_result (L, ber, ber_printf (ber, "{it{s{sO}}}", msgid,
+		LDAP_REQ_COMPARE, dn, attr, &bvalue));
 }
 
 
 /*
-** Get the distinguished name of the given entry and pushes it on the stack.
+** Encode an extended request.
+** @param #1 Number with the message id.
+** @param #2 String with the name (OID) of the operation.
+** @param #3 String with the value of the request (optional).
+** @return #1 String with the encoded request.
 */
-static void push_dn (lua_State *L, LDAP *ld, LDAPMessage *entry) {
-	char *dn = ldap_get_dn (ld, entry);
-	lua_pushstring (L, dn);
-	ldap_memfree (dn);
+static int lualdap_codec_extended (lua_State *L) {
+	ber_int_t msgid = codec_msgid (L);
+	const char *oid = luaL_checkstring (L, 2);
+	BerElement *ber = codec_alloc (L);
+	BerValue bvalue;
+	size_t len;
+	if (lua_isnoneornil (L, 3))
+		return codec_result (L, ber, ber_printf (ber, "{it{ts}}", msgid,
+			LDAP_REQ_EXTENDED, LDAP_TAG_EXOP_REQ_OID, oid));
+	bvalue.bv_val = (char *)luaL_checklstring (L, 3, &len);
+	bvalue.bv_len = len;
+	return codec_result (L, ber, ber_printf (ber, "{it{tstO}}", msgid,
+		LDAP_REQ_EXTENDED, LDAP_TAG_EXOP_REQ_OID, oid,
+		LDAP_TAG_EXOP_REQ_VALUE, &bvalue));
 }
 
 
 /*
-** Release connection reference.
+** Get the decoder.
 */
-static void search_close (lua_State *L, search_data *search) {
-	luaL_unref (L, LUA_REGISTRYINDEX, search->conn);
-	search->conn = LUA_NOREF;
+static decoder_data *getdecoder (lua_State *L) {
+	return (decoder_data *)luaL_checkudata (L, 1, LUALDAP_DECODER_METATABLE);
 }
 
 
 /*
-** Retrieve next message...
-** @return #1 entry's distinguished name.
-** @return #2 table with entry's attributes and values.
+** Get the size of the first message of the buffer.
+** @return Size of the message, 0 when it is not complete yet or -1 when
+**	the bytes are not an LDAP message.
 */
-static int next_message (lua_State *L) {
-	search_data *search = getsearch (L);
-	conn_data *conn;
-	struct timeval *timeout = NULL; /* ??? function parameter ??? */
-	LDAPMessage *res;
-	int rc;
-	int ret;
+static long decoder_size (decoder_data *d) {
+	const unsigned char *p = (const unsigned char *)d->buf + d->first;
+	size_t avail = d->len - d->first;
+	size_t head, size;
+	if (avail < 2)
+		return 0;
+	if (p[0] != LDAP_TAG_MESSAGE)
+		return -1;
+	if (p[1] < 0x80) { /* short form */
+		head = 2;
+		size = p[1];
+	} else { /* long form (the indefinite form is not allowed) */
+		size_t i, n = p[1] & 0x7f;
+		if (n == 0 || n > 4)
+			return -1;
+		if (avail < 2 + n)
+			return 0;
+		head = 2 + n;
+		size = 0;
+		for (i = 0; i < n; i++)
+			size = (size << 8) | p[2 + i];
+	}
+	if (size > 0x7fffffff - head)
+		return -1;
+	return avail < head + size ? 0 : (long)(head + size);
+}
 
-	lua_rawgeti (L, LUA_REGISTRYINDEX, search->conn);
-	conn = (conn_data *)lua_touserdata (L, -1); /* get connection */
 
-	rc = ldap_result (conn->ld, search->msgid, LDAP_MSG_ONE, timeout, &res);
-	if (rc == 0)
-		return faildirect (L, LUALDAP_PREFIX"result timeout expired");
-	else if (rc == -1)
-		return faildirect (L, LUALDAP_PREFIX"result error");
-	else if (rc == LDAP_RES_SEARCH_RESULT) { /* last message => nil */
-		/* close search object to avoid reuse */
-		search_close (L, search);
-		ret = 0;
-	} else {
-		LDAPMessage *msg = ldap_first_message (conn->ld, res);
-		switch (ldap_msgtype (msg)) {
-			case LDAP_RES_SEARCH_ENTRY: {
-				LDAPMessage *entry = ldap_first_entry (conn->ld, msg);
-				push_dn (L, conn->ld, entry);
-				lua_newtable (L);
-				set_attribs (L, conn->ld, entry, lua_gettop (L));
-				ret = 2; /* two return values */
-				break;
-			}
-/*No reference to LDAP_RES_SEARCH_REFERENCE on MSDN. Maybe there is a replacement to it?*/
-#ifdef LDAP_RES_SEARCH_REFERENCE
-			case LDAP_RES_SEARCH_REFERENCE: {
-				LDAPMessage *ref = ldap_first_reference (conn->ld, msg);
-				push_dn (L, conn->ld, ref); /* is this supposed to work? */
-				lua_pushnil (L);
-				ret = 2; /* two return values */
-				break;
-			}
-#endif
-			case LDAP_RES_SEARCH_RESULT:
-				/* close search object to avoid reuse */
-				search_close (L, search);
-				ret = 0;
-				break;
-			default:
-				ldap_msgfree (res);
-				return luaL_error (L, LUALDAP_PREFIX"error on search result chain");
-		}
+/*
+** Store the attributes of an entry in the table on top of the stack.
+** @return 0 or -1 when the entry cannot be decoded.
+*/
+static int decode_attribs (lua_State *L, BerElement *ber) {
+	ber_tag_t tag;
+	ber_len_t len;
+	char *last;
+	for (tag = ber_first_element (ber, &len, &last);
+		tag != LBER_DEFAULT;
+		tag = ber_next_element (ber, &len, last))
+	{
+		BerValue type;
+		BerValue **vals = NULL;
+		if (ber_scanf (ber, "{mV}", &type, &vals) == LBER_ERROR)
+			return -1;
+		lua_pushlstring (L, type.bv_val, type.bv_len);
+		push_bervals (L, vals);
+		lua_rawset (L, -3); /* tab[attr] = vals */
+		ber_bvecfree (vals);
 	}
-	ldap_msgfree (res);
-	return ret;
+	return 0;
 }
 
 
 /*
-** Convert a string to one of the possible scopes of the search.
+** Store a list of URIs in a field of the table on top of the stack.
+** @return 0 or -1 when the list cannot be decoded.
 */
-static int string2scope (lua_State *L, const char *s) {
-	if ((s == NULL) || (*s == '\0'))
-		return LDAP_SCOPE_DEFAULT;
-	switch (*s) {
-		case 'b':
-			return LDAP_SCOPE_BASE;
-		case 'o':
-			return LDAP_SCOPE_ONELEVEL;
-		case 's':
-			return LDAP_SCOPE_SUBTREE;
-		default:
-			return luaL_error (L, LUALDAP_PREFIX"invalid search scope `%s'", s);
+static int decode_uris (lua_State *L, BerElement *ber, const char *field) {
+	char **uris = NULL;
+	int i;
+	if (ber_scanf (ber, "{v}", &uris) == LBER_ERROR)
+		return -1;
+	lua_newtable (L);
+	for (i = 0; uris != NULL && uris[i] != NULL; i++) {
+		lua_pushstring (L, uris[i]);
+		lua_rawseti (L, -2, i+1);
 	}
+	lua_setfield (L, -2, field);
+	ber_memvfree ((void **)uris);
+	return 0;
+}
+
+
+/*
+** Store a string in a field of the table on top of the stack.
+** @return 0 or -1 when the string cannot be decoded.
+*/
+static int decode_string (lua_State *L, BerElement *ber, const char *field) {
+	BerValue bv;
+	if (ber_scanf (ber, "m", &bv) == LBER_ERROR)
+		return -1;
+	lua_pushlstring (L, bv.bv_val, bv.bv_len);
+	lua_setfield (L, -2, field);
+	return 0;
 }
 
 
 /*
-** Close the search object.
+** Decode the result of an operation (or an intermediate response) on
+** the table on top of the stack.
+** @return 0 or -1 when the result cannot be decoded.
 */
-static int lualdap_search_close (lua_State *L) {
-	search_data *search = (search_data *)luaL_checkudata (L, 1, LUALDAP_SEARCH_METATABLE);
-	if (search->conn == LUA_NOREF)
+static int decode_result (lua_State *L, BerElement *ber, ber_tag_t msgtag) {
+	ber_tag_t tag;
+	ber_len_t len;
+	ber_int_t code;
+	BerValue matched, message;
+	if (msgtag == LDAP_RES_INTERMEDIATE) {
+		if (ber_scanf (ber, "{") == LBER_ERROR)
+			return -1;
+		lua_pushliteral (L, "intermediate");
+		lua_setfield (L, -2, "type");
+		tag = ber_peek_tag (ber, &len);
+		if (tag == LDAP_TAG_IM_RES_OID) {
+			if (decode_string (L, ber, "oid") == -1)
+				return -1;
+			tag = ber_peek_tag (ber, &len);
+		}
+		if (tag == LDAP_TAG_IM_RES_VALUE && decode_string (L, ber, "value") == -1)
+			return -1;
 		return 0;
-	search_close (L, search);
-	lua_pushnumber (L, 1);
-	return 1;
+	}
+	if (ber_scanf (ber, "{emm", &code, &matched, &message) == LBER_ERROR)
+		return -1;
+	lua_pushstring (L, msgtag == LDAP_RES_BIND ? "bind" :
+		msgtag == LDAP_RES_SEARCH_RESULT ? "search" : op_names[res2op ((int)msgtag)]);
+	lua_setfield (L, -2, "type");
+	lua_pushnumber (L, code);
+	lua_setfield (L, -2, "code");
+	lua_pushlstring (L, matched.bv_val, matched.bv_len);
+	lua_setfield (L, -2, "matched");
+	lua_pushlstring (L, message.bv_val, message.bv_len);
+	lua_setfield (L, -2, "message");
+	for (tag = ber_peek_tag (ber, &len); tag != LBER_DEFAULT; tag = ber_peek_tag (ber, &len)) {
+		int rc;
+		if (tag == LDAP_TAG_REFERRAL)
+			rc = decode_uris (L, ber, "referrals");
+		else if (tag == LDAP_TAG_SASL_RES_CREDS && msgtag == LDAP_RES_BIND)
+			rc = decode_string (L, ber, "credentials");
+		else if (tag == LDAP_TAG_EXOP_RES_OID && msgtag == LDAP_RES_EXTENDED)
+			rc = decode_string (L, ber, "oid");
+		else if (tag == LDAP_TAG_EXOP_RES_VALUE && msgtag == LDAP_RES_EXTENDED)
+			rc = decode_string (L, ber, "value");
+		else
+			break; /* controls of the message */
+		if (rc == -1)
+			return -1;
+	}
+	return 0;
 }
 
 
 /*
-** Create a search object and leaves it on top of the stack.
+** Decode a message and push the table describing it.
+** @return 0 or -1 when the message cannot be decoded.
 */
-static void create_search (lua_State *L, int conn_index, int msgid) {
-	search_data *search = (search_data *)lua_newuserdata (L, sizeof (search_data));
-	luaL_setmetatable (L, LUALDAP_SEARCH_METATABLE);
-	search->conn = LUA_NOREF;
-	search->msgid = msgid;
-	lua_pushvalue (L, conn_index);
-	search->conn = luaL_ref (L, LUA_REGISTRYINDEX);
+static int decode_message (lua_State *L, BerElement *ber) {
+	ber_int_t msgid;
+	ber_tag_t tag;
+	ber_len_t len;
+	BerValue dn;
+	if (ber_scanf (ber, "{i", &msgid) == LBER_ERROR)
+		return -1;
+	lua_newtable (L);
+	lua_pushnumber (L, msgid);
+	lua_setfield (L, -2, "msgid");
+	tag = ber_peek_tag (ber, &len);
+	switch (tag) {
+		case LDAP_RES_SEARCH_ENTRY:
+			lua_pushliteral (L, "entry");
+			lua_setfield (L, -2, "type");
+			if (ber_scanf (ber, "{m", &dn) == LBER_ERROR)
+				return -1;
+			lua_pushlstring (L, dn.bv_val, dn.bv_len);
+			lua_setfield (L, -2, "dn");
+			lua_newtable (L);
+			if (decode_attribs (L, ber) == -1)
+				return -1;
+			lua_setfield (L, -2, "attrs");
+			return 0;
+		case LDAP_RES_SEARCH_REFERENCE:
+			lua_pushliteral (L, "reference");
+			lua_setfield (L, -2, "type");
+			return decode_uris (L, ber, "uris");
+		case LDAP_RES_BIND:
+		case LDAP_RES_SEARCH_RESULT:
+		case LDAP_RES_MODIFY:
+		case LDAP_RES_ADD:
+		case LDAP_RES_DELETE:
+		case LDAP_RES_MODDN:
+		case LDAP_RES_COMPARE:
+		case LDAP_RES_EXTENDED:
+		case LDAP_RES_INTERMEDIATE:
+			return decode_result (L, ber, tag);
+		default:
+			return -1;
+	}
 }
 
 
 /*
-** Fill in the attrs array, according to the attrs parameter.
+** Append bytes to the buffer of the decoder.
+** @param #1 LDAP decoder.
+** @param #2 String with the bytes received.
 */
-static void get_attrs_param (lua_State *L, char *attrs[]) {
-	lua_getfield(L, 2, "attrs");
-	if (lua_isstring (L, -1)) {
-		attrs[0] = (char *)lua_tostring (L, -1);
-		attrs[1] = NULL;
-	} else if (!lua_istable (L, -1))
-		attrs[0] = NULL;
-	else {
-		int i;
-		int n = lua_rawlen(L, -1);
-		if (LUALDAP_MAX_ATTRS < (n+1))
-			luaL_error (L, LUALDAP_PREFIX"too many arguments");
-		luaL_checkstack(L, n, NULL);
-		for (i = 0; i < n; i++) {
-			lua_rawgeti (L, -1, i+1); /* push table element */
-			if (lua_isstring (L, -1)) {
-				attrs[i] = (char *)lua_tostring (L, -1);
-				lua_pop(L, 1);
-			} else {
-				luaL_error (L, LUALDAP_PREFIX"invalid value #%d", i+1);
-			}
-		}
-		attrs[n] = NULL;
+static int lualdap_decoder_feed (lua_State *L) {
+	decoder_data *d = getdecoder (L);
+	size_t n;
+	const char *data = luaL_checklstring (L, 2, &n);
+	if (d->first > 0 && d->len + n > d->size) { /* discard the decoded bytes */
+		memmove (d->buf, d->buf + d->first, d->len - d->first);
+		d->len -= d->first;
+		d->first = 0;
+	}
+	if (d->len + n > d->size) {
+		size_t size = d->size > 0 ? d->size : 4096;
+		char *buf;
+		while (size < d->len + n)
+			size *= 2;
+		buf = (char *)realloc (d->buf, size);
+		if (buf == NULL)
+			return luaL_error (L, LUALDAP_PREFIX"%s", ldap_err2string (LDAP_NO_MEMORY));
+		d->buf = buf;
+		d->size = size;
 	}
+	memcpy (d->buf + d->len, data, n);
+	d->len += n;
+	return 0;
 }
 
 
 /*
-** Fill in the struct timeval, according to the timeout parameter.
+** Decode the next message of the buffer.
+** @param #1 LDAP decoder.
+** @return #1 Table describing the message, nil when no message is
+**	complete yet, or nil and an error message when the bytes are not
+**	an LDAP message (the buffer is then emptied).
 */
-static struct timeval *get_timeout_param (lua_State *L, struct timeval *st) {
-	double t = numbertabparam (L, "timeout", 0.0);
-	if(t <= 0.0)
-		return NULL; /* No timeout, block */
-	st->tv_sec = (long)t;
-	st->tv_usec = (long)(1000000.0 * (t - (double)st->tv_sec));
-	return st;
+static int lualdap_decoder_next (lua_State *L) {
+	decoder_data *d = getdecoder (L);
+	long size = decoder_size (d);
+	BerElement *ber;
+	BerValue bv;
+	int rc;
+	if (size == 0) {
+		lua_pushnil (L);
+		return 1;
+	}
+	if (size > 0) {
+		bv.bv_val = d->buf + d->first;
+		bv.bv_len = (ber_len_t)size;
+		ber = ber_init (&bv);
+		if (ber == NULL)
+			return luaL_error (L, LUALDAP_PREFIX"%s", ldap_err2string (LDAP_NO_MEMORY));
+		lua_settop (L, 1);
+		rc = decode_message (L, ber);
+		ber_free (ber, 1);
+		if (rc == 0) {
+			d->first += size;
+			return 1;
+		}
+	}
+	d->first = d->len = 0;
+	return faildirect (L, LUALDAP_PREFIX"decoding error");
 }
 
 
 /*
-** Perform a search operation.
-** @return #1 Function to iterate over the result entries.
-** @return #2 nil.
-** @return #3 nil as first entry.
-** The search result is defined as an upvalue of the iterator.
+** Release the buffer of the decoder.
 */
-static int lualdap_search (lua_State *L) {
-	conn_data *conn = getconnection (L);
-	ldap_pchar_t base;
-	ldap_pchar_t filter;
-	char *attrs[LUALDAP_MAX_ATTRS];
-	int scope, attrsonly, msgid, rc, sizelimit;
-	struct timeval st, *timeout;
-
-	if (!lua_istable (L, 2))
-		return luaL_error (L, LUALDAP_PREFIX"no search specification");
-	get_attrs_param (L, attrs);
-	/* get other parameters */
-	attrsonly = booltabparam (L, "attrsonly", 0);
-	base = (ldap_pchar_t) strtabparam (L, "base", NULL);
-	filter = (ldap_pchar_t) strtabparam (L, "filter", NULL);
-	scope = string2scope (L, strtabparam (L, "scope", NULL));
-	sizelimit = longtabparam (L, "sizelimit", LDAP_NO_LIMIT);
-	timeout = get_timeout_param (L, &st);
-
-	rc = ldap_search_ext (conn->ld, base, scope, filter, attrs, attrsonly,
-		NULL, NULL, timeout, sizelimit, &msgid);
-	if (rc != LDAP_SUCCESS)
-		return luaL_error (L, LUALDAP_PREFIX"%s", ldap_err2string (rc));
-
-	create_search (L, 1, msgid);
-	lua_pushcclosure (L, next_message, 1);
-	lua_pushvalue(L, 2);
-	return 2;
+static int lualdap_decoder_gc (lua_State *L) {
+	decoder_data *d = getdecoder (L);
+	free (d->buf);
+	d->buf = NULL;
+	d->first = d->len = d->size = 0;
+	return 0;
 }
 
 
 /*
-** Return the name of the object's metatable.
-** This function is used by `tostring'.
+** Return a string with the size of the buffer of the decoder.
 */
-static int lualdap_conn_tostring (lua_State *L) {
-	conn_data *conn = luaL_checkudata(L, 1, LUALDAP_CONNECTION_METATABLE);
-	if (conn->ld == NULL)
-		lua_pushfstring (L, "%s (closed)", LUALDAP_CONNECTION_METATABLE);
-	else
-		lua_pushfstring (L, "%s (%p)", LUALDAP_CONNECTION_METATABLE, (void*)conn);
+static int lualdap_decoder_tostring (lua_State *L) {
+	decoder_data *d = getdecoder (L);
+	lua_pushfstring (L, "%s (%d bytes)", LUALDAP_DECODER_METATABLE, (int)(d->len - d->first));
 	return 1;
 }
 
 
 /*
-** Return the name of the object's metatable.
-** This function is used by `tostring'.
+** Create a decoder of the messages received from an LDAP server.
+** @return #1 LDAP decoder.
 */
-static int lualdap_search_tostring (lua_State *L) {
-	search_data *search = luaL_checkudata(L, 1, LUALDAP_SEARCH_METATABLE);
-	if (search->conn == LUA_NOREF)
-		lua_pushfstring (L, "%s (closed)", LUALDAP_SEARCH_METATABLE);
-	else
-		lua_pushfstring (L, "%s (%p)", LUALDAP_SEARCH_METATABLE, (void*)search);
+static int lualdap_codec_decoder (lua_State *L) {
+	decoder_data *d = (decoder_data *)lua_newuserdata (L, sizeof (decoder_data));
+	d->buf = NULL;
+	d->first = d->len = d->size = 0;
+	luaL_setmetatable (L, LUALDAP_DECODER_METATABLE);
 	return 1;
 }
 
 
 /*
-** Create a metatable.
+** Create the metatable of the decoder objects.
 */
-static void lualdap_createmeta_conn (lua_State *L) {
+static void lualdap_createmeta_decoder (lua_State *L) {
 	static const luaL_Reg metamethods[] = {
-		{"__gc", lualdap_close},
-		{"__tostring", lualdap_conn_tostring},
+		{"__gc", lualdap_decoder_gc},
+		{"__tostring", lualdap_decoder_tostring},
 		/* placeholders */
 		{"__index", NULL},
 		{"__metatable", NULL},
 		{NULL, NULL}
 	};
 	static const luaL_Reg methods[] = {
-		{"close", lualdap_close},
-		{"bind_simple", lualdap_bind_simple},
-		{"add", lualdap_add},
-		{"compare", lualdap_compare},
-		{"delete", lualdap_delete},
-		{"modify", lualdap_modify},
-		{"rename", lualdap_rename},
-		{"search", lualdap_search},
+		{"feed", lualdap_decoder_feed},
+		{"next", lualdap_decoder_next},
 		{NULL, NULL}
 	};
 
-	luaL_newmetatable (L, LUALDAP_CONNECTION_METATABLE);
+	luaL_newmetatable (L, LUALDAP_DECODER_METATABLE);
 	luaL_setfuncs(L, metamethods, 0);  /* add metamethods to new metatable */
 
 	luaL_newlibtable(L, methods);  /* create method table */
@@ -903,175 +7159,7 @@ static void lualdap_createmeta_conn (lua_State *L) {
 
 	lua_pop(L, 1);  /* pop metatable */
 }
-
-
-/*
-** Create a metatable.
-*/
-static void lualdap_createmeta_search (lua_State *L) {
-	static const luaL_Reg metamethods[] = {
-		{"__gc", lualdap_search_close},
-		{"__tostring", lualdap_search_tostring},
-		/* placeholders */
-		{"__metatable", NULL},
-		{NULL, NULL}
-	};
-
-	luaL_newmetatable (L, LUALDAP_SEARCH_METATABLE);
-	luaL_setfuncs(L, metamethods, 0);  /* add metamethods to new metatable */
-
-	lua_pushliteral(L,LUALDAP_PREFIX"you're not allowed to get this metatable");
-	lua_setfield (L, -2, "__metatable");
-
-	lua_pop(L, 1);  /* pop metatable */
-}
-
-
-#if !defined(WINLDAP)
-/*
-** Open and initialize a connection to a server (without binding).
-** @param #1 String with URI.
-** @return #1 Userdata with connection structure.
-*/
-static int lualdap_initialize (lua_State *L) {
-	ldap_pchar_t uri = (ldap_pchar_t) luaL_checkstring (L, 1);
-	conn_data *conn = (conn_data *)lua_newuserdata (L, sizeof(conn_data));
-	int err;
-	int lev=7;
-
-	/* Initialize */
-	luaL_setmetatable (L, LUALDAP_CONNECTION_METATABLE);
-	conn->version = 0;
-#if defined(LDAP_API_FEATURE_X_OPENLDAP) && LDAP_API_FEATURE_X_OPENLDAP >= 20300
-	err = ldap_initialize (&conn->ld, uri);
-	if (err != LDAP_SUCCESS)
-		return faildirect(L, ldap_err2string(err));
-#else
-#	error Unsupported LDAP library version
-#endif
-
-	/* Set protocol version */
-	conn->version = LDAP_VERSION3;
-	if (ldap_set_option (conn->ld, LDAP_OPT_PROTOCOL_VERSION, &conn->version)
-		!= LDAP_OPT_SUCCESS)
-		return faildirect(L, LUALDAP_PREFIX"Error setting LDAP version");
-	ldap_set_option(conn->ld, LDAP_OPT_DEBUG_LEVEL, &lev);
-
-	return 1;
-}
-#endif
-
-/*
-** Open a connection to a server.
-** @param #1 String with hostname.
-** @param #2 Boolean indicating if TLS must be used.
-** @param #3 Number for connection timeout (optional).
-** @return #1 Userdata with connection structure.
-*/
-static int lualdap_open (lua_State *L) {
-	ldap_pchar_t host = (ldap_pchar_t) luaL_checkstring (L, 1);
-	int use_tls = lua_toboolean (L, 2);
-	double timeout = lua_tonumber (L, 3);
-	conn_data *conn = (conn_data *)lua_newuserdata (L, sizeof(conn_data));
-#if defined(LDAP_API_FEATURE_X_OPENLDAP) && LDAP_API_FEATURE_X_OPENLDAP >= 20300
-	int err;
-#endif
-
-	/* Initialize */
-	luaL_setmetatable (L, LUALDAP_CONNECTION_METATABLE);
-	conn->version = 0;
-#if defined(LDAP_API_FEATURE_X_OPENLDAP) && LDAP_API_FEATURE_X_OPENLDAP >= 20300
-	if (strstr(host, "://") != NULL) {
-		err = ldap_initialize(&conn->ld, host);
-	} else {
-		lua_getglobal (L, "string");
-		lua_getfield (L, -1, "gsub");
-		if (!lua_isfunction (L, -1))
-			return faildirect (L, LUALDAP_PREFIX"string.gsub broken");
-		lua_pushvalue (L, 1); /* host */
-		lua_pushstring (L, "(%S+)");
-		lua_pushstring (L, "ldap://%1");
-		lua_call (L, 3, 1); /* string.gsub(host, '(%S+)', 'ldap://%1') */
-		/* ldap_initialize handles a whitespace-separated list of hostnames */
-		err = ldap_initialize(&conn->ld, lua_tostring (L, -1));
-		lua_pop(L, 2);
-	}
-	if (err != LDAP_SUCCESS)
-#else
-	conn->ld = ldap_init (host, LDAP_PORT);
-	if (conn->ld == NULL)
-#endif
-		return faildirect(L,LUALDAP_PREFIX"Error connecting to server");
-/* LDAP_OPT_TIMEOUT and LDAP_OPT_NETWORK_TIMEOUT are not supported by WinLDAP.
- * WinLDAP does have LDAP_OPT_SEND_TIMEOUT; it is yet to be determined whether
- * that would work as a connection timeout */
-#if !defined(WINLDAP)
-	/* Set timeout (optionally) */
-	if (timeout > 0.0) {
-		struct timeval optTimeout;
-		optTimeout.tv_sec = (long)timeout;
-		optTimeout.tv_usec = (long)(1000000.0 * (timeout - (double)optTimeout.tv_sec));
-		if (ldap_set_option (conn->ld, LDAP_OPT_TIMEOUT, &optTimeout) != LDAP_OPT_SUCCESS)
-			return faildirect(L, LUALDAP_PREFIX"Could not set timeout");
-		if (ldap_set_option (conn->ld, LDAP_OPT_NETWORK_TIMEOUT, &optTimeout) != LDAP_OPT_SUCCESS)
-			return faildirect(L, LUALDAP_PREFIX"Could not set network timeout");
-	}
 #endif
-	/* Set protocol version */
-	conn->version = LDAP_VERSION3;
-	if (ldap_set_option (conn->ld, LDAP_OPT_PROTOCOL_VERSION, &conn->version)
-		!= LDAP_OPT_SUCCESS)
-		return faildirect(L, LUALDAP_PREFIX"Error setting LDAP version");
-	/* Use TLS */
-	if (use_tls) {
-		int rc = ldap_start_tls_s (conn->ld, NULL, NULL);
-		if (rc != LDAP_SUCCESS)
-			return faildirect (L, ldap_err2string (rc));
-	}
-	return 1;
-}
-
-/*
-** Open and initialize a connection to a server.
-** @param #1 String with hostname.
-** @param #2 String with username.
-** @param #3 String with password.
-** @param #4 Boolean indicating if TLS must be used.
-** @param #5 Number for connection timeout (optional).
-** @return #1 Userdata with connection structure.
-*/
-static int lualdap_open_simple (lua_State *L) {
-	ldap_pchar_t host = (ldap_pchar_t) luaL_checkstring (L, 1);
-	ldap_pchar_t who = (ldap_pchar_t) luaL_optstring (L, 2, "");
-	const char *password = luaL_optstring (L, 3, "");
-	int use_tls = lua_toboolean (L, 4);
-	double timeout = lua_tonumber (L, 5);
-
-	/* Open */
-	lua_pushcfunction (L, lualdap_open);
-	lua_pushstring (L, host);
-	lua_pushboolean (L, use_tls);
-	lua_pushnumber (L, timeout);
-	lua_call (L, 3, 2);
-	if (lua_isnil (L, -2)) {
-		return 2; /* nil, msg */
-	} else {
-		lua_pop (L, 1); /* keep only the userdata (LDAP connection) */
-	}
-
-	/* Bind to a server */
-	lua_pushcfunction (L, lualdap_bind_simple);
-	lua_pushvalue (L, -2); /* connection */
-	lua_pushstring (L, who);
-	lua_pushstring (L, password);
-	lua_call (L, 3, 2);
-	if (lua_isnil (L, -2)) {
-		return 2; /* Pass through in case of errors */
-	} else {
-		lua_pop (L, 2); /* Discard return values from lualdap_bind_simple */
-	}
-	return 1;
-}
 
 
 /*
@@ -1097,6 +7185,18 @@ int luaopen_lualdap (lua_State *L) {
 #endif
 		{"open", lualdap_open},
 		{"open_simple", lualdap_open_simple},
+		{"pool", lualdap_pool},
+		{"router", lualdap_router},
+		{"metrics_text", lualdap_metrics_text},
+#if !defined(WIN32)
+		{"shared_pool", lualdap_shared_pool},
+		{"set_debug", lualdap_set_debug},
+		{"flush_debug", lualdap_flush_debug},
+#endif
+#if !defined(WINLDAP)
+		{"tls_context", lualdap_tls_context},
+		{"authenticator", lualdap_authenticator},
+#endif
 		/* placeholders */
 		{"_COPYRIGHT", NULL},
 		{"_DESCRIPTION", NULL},
@@ -1104,8 +7204,30 @@ int luaopen_lualdap (lua_State *L) {
 		{NULL, NULL},
 	};
 
+	lua_newtable (L); /* weak set of the objects reported by metrics_text */
+	lua_newtable (L);
+	lua_pushliteral (L, "k");
+	lua_setfield (L, -2, "__mode");
+	lua_setmetatable (L, -2);
+	lua_setfield (L, LUA_REGISTRYINDEX, LUALDAP_OBJECTS);
+	lua_getfield (L, LUA_REGISTRYINDEX, LUALDAP_RETIRED);
+	if (lua_isnil (L, -1)) { /* counters of the collected objects */
+		memset (lua_newuserdata (L, sizeof(metrics_data)), 0, sizeof(metrics_data));
+		lua_setfield (L, LUA_REGISTRYINDEX, LUALDAP_RETIRED);
+	}
+	lua_pop (L, 1);
 	lualdap_createmeta_conn (L);
 	lualdap_createmeta_search (L);
+	lualdap_createmeta_future (L);
+	lualdap_createmeta_pool (L);
+	lualdap_createmeta_router (L);
+#if !defined(WIN32)
+	lualdap_createmeta_shared (L);
+#endif
+#if !defined(WINLDAP)
+	lualdap_createmeta_tls (L);
+	lualdap_createmeta_auth (L);
+#endif
 	luaL_newlib(L, lualdap);
 /*
    In Lua 5.2 "modules are not expected to set global variables":
@@ -1119,3 +7241,32 @@ int luaopen_lualdap (lua_State *L) {
 
 	return 1;
 }
+
+
+#if !defined(WINLDAP)
+/*
+** Create the table of the BER codec, to be used by applications which
+** do their own input/output (require "lualdap.codec").
+*/
+int luaopen_lualdap_codec (lua_State *L) {
+	static const struct luaL_Reg codec[] = {
+		{"abandon", lualdap_codec_abandon},
+		{"add", lualdap_codec_add},
+		{"bind_sasl", lualdap_codec_bind_sasl},
+		{"bind_simple", lualdap_codec_bind_simple},
+		{"compare", lualdap_codec_compare},
+		{"decoder", lualdap_codec_decoder},
+		{"delete", lualdap_codec_delete},
+		{"extended", lualdap_codec_extended},
+		{"modify", lualdap_codec_modify},
+		{"rename", lualdap_codec_rename},
+		{"search", lualdap_codec_search},
+		{"unbind", lualdap_codec_unbind},
+		{NULL, NULL},
+	};
+
+	lualdap_createmeta_decoder (L);
+	luaL_newlib(L, codec);
+	return 1;
+}
+#endif
@@ -10,6 +10,11 @@
 #define LDAP_OPT_SUCCESS LDAP_SUCCESS
 #endif
 
+/* MSDN names the result code option LDAP_OPT_ERROR_NUMBER */
+#ifndef LDAP_OPT_RESULT_CODE
+#define LDAP_OPT_RESULT_CODE LDAP_OPT_ERROR_NUMBER
+#endif
+
 /* MSDN doesn't mention LDAP_SCOPE_DEFAULT, so default will be LDAP_SCOPE_SUBTREE */
 #ifndef LDAP_SCOPE_DEFAULT
 #define LDAP_SCOPE_DEFAULT LDAP_SCOPE_SUBTREE
@@ -0,0 +1,1738 @@
+/*
+** Mock LDAP server for the tests and benchmarks of LuaLDAP
+** See Copyright Notice in license.md
+**
+** It serves a synthetic directory held in memory, with a configurable
+** number and size of entries, a fixed latency added to every response
+** and scripted errors, over TCP or a local socket.
+** Simple binds, searches, add, modify, delete, rename, compare,
+** abandon and the Who am I? extended operation are supported, with the
+** assertion control; the other critical controls are refused.
+*/
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include <lber.h>
+#include <ldap.h>
+
+#define MOCK_DEFAULT_URI "ldap://localhost:3898/"
+#define MOCK_DEFAULT_BASE "dc=example,dc=com"
+
+/* Maximum number of simultaneous connections */
+#define MOCK_MAX_CONNECTIONS 256
+
+/* Maximum size of a request */
+#define MOCK_MAX_MESSAGE (16 * 1024 * 1024)
+
+/* Maximum number of scripted errors */
+#define MOCK_MAX_ERRORS 16
+
+/* Who am I? extended operation (RFC 4532) */
+#ifndef LDAP_EXOP_WHO_AM_I
+#define LDAP_EXOP_WHO_AM_I "1.3.6.1.4.1.4203.1.11.3"
+#endif
+
+/* Types of operations, as those of the statistics of LuaLDAP */
+#define MOCK_OP_ADD      0
+#define MOCK_OP_BIND     1
+#define MOCK_OP_COMPARE  2
+#define MOCK_OP_DELETE   3
+#define MOCK_OP_EXTENDED 4
+#define MOCK_OP_MODIFY   5
+#define MOCK_OP_RENAME   6
+#define MOCK_OP_SEARCH   7
+#define MOCK_NOPS        8
+
+static const char *const op_names[MOCK_NOPS] = {
+	"add", "bind", "compare", "delete", "extended", "modify", "rename", "search"
+};
+
+static const ber_tag_t op_results[MOCK_NOPS] = {
+	LDAP_RES_ADD, LDAP_RES_BIND, LDAP_RES_COMPARE, LDAP_RES_DELETE,
+	LDAP_RES_EXTENDED, LDAP_RES_MODIFY, LDAP_RES_MODDN, LDAP_RES_SEARCH_RESULT
+};
+
+
+/* Attribute of an entry */
+typedef struct {
+	char      *name;
+	BerValue  *vals;      /* array of n values terminated by a NULL bv_val */
+	int        n;
+} mock_attr;
+
+
+/* Entry of the directory */
+typedef struct mock_entry {
+	char              *dn;
+	char              *ndn;       /* normalized DN */
+	mock_attr         *attrs;
+	int                nattrs;
+	int                children;  /* number of entries below it */
+	int                index;     /* position in the array of entries */
+	struct mock_entry *next;      /* next entry of its hash bucket */
+} mock_entry;
+
+
+/* Search filter */
+typedef struct mock_filter {
+	ber_tag_t           choice;    /* LDAP_FILTER_* */
+	BerValue            attr;
+	BerValue            value;
+	BerValue            initial;   /* substrings */
+	BerValue            final;
+	BerValue           *any;
+	int                 nany;
+	struct mock_filter *child;     /* first operand of and, or and not */
+	struct mock_filter *next;      /* next operand */
+} mock_filter;
+
+
+/* Controls of a request */
+typedef struct {
+	BerElement  *ber;        /* holds the values of the assertion */
+	mock_filter *assertion;  /* filter of the assertion control (or NULL) */
+} mock_controls;
+
+
+/* Scripted error */
+typedef struct {
+	int            op;
+	int            code;      /* result code, or -1 to close the connection */
+	unsigned long  every;     /* applies to every nth operation */
+} mock_error;
+
+
+/* Response waiting to be sent */
+typedef struct mock_response {
+	double                 due;       /* time from which it may be sent */
+	ber_int_t              msgid;
+	char                  *data;
+	size_t                 len, off, size;
+	struct mock_response  *next;
+} mock_response;
+
+
+/* Client connection */
+typedef struct {
+	int            fd;        /* -1 once closed */
+	char          *in;        /* bytes received and not processed yet */
+	size_t         inlen, insize;
+	mock_response *head, *tail;
+	char          *bound;     /* DN of the last bind (NULL when anonymous) */
+} mock_conn;
+
+
+/* Settings */
+static const char *base = MOCK_DEFAULT_BASE;
+static const char *manager = NULL;
+static const char *password = "admin";
+static double latency = 0.0;
+static mock_error errors[MOCK_MAX_ERRORS];
+static int nerrors = 0;
+static unsigned long counts[MOCK_NOPS];
+
+/* Directory */
+static char *nsuffix = NULL;  /* normalized DN of the base entry */
+static mock_entry **entries = NULL;
+static int nentries = 0, maxentries = 0;
+static mock_entry **buckets = NULL;
+static unsigned nbuckets = 0;
+
+/* Connections */
+static mock_conn conns[MOCK_MAX_CONNECTIONS];
+static int nconns = 0;
+
+
+static void *xmalloc (size_t size) {
+	void *p = malloc (size);
+	if (p == NULL) {
+		fprintf (stderr, "mockldap: out of memory\n");
+		exit (1);
+	}
+	return p;
+}
+
+
+static void *xrealloc (void *p, size_t size) {
+	p = realloc (p, size);
+	if (p == NULL) {
+		fprintf (stderr, "mockldap: out of memory\n");
+		exit (1);
+	}
+	return p;
+}
+
+
+static char *xstrndup (const char *s, size_t len) {
+	char *p = (char *)xmalloc (len + 1);
+	memcpy (p, s, len);
+	p[len] = '\0';
+	return p;
+}
+
+
+static double monotonic (void) {
+	struct timespec ts;
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+
+/*
+** Normalize a DN: lower case, without spaces around separators.
+** @return Newly allocated string.
+*/
+static char *normalize (const char *dn, size_t len) {
+	char *ndn = (char *)xmalloc (len + 1);
+	size_t i, n = 0;
+	for (i = 0; i < len; i++) {
+		char c = dn[i];
+		if (c == ' ' && (n == 0 || ndn[n-1] == ',' || ndn[n-1] == '='))
+			continue;
+		if ((c == ',' || c == '=') && n > 0 && ndn[n-1] == ' ')
+			n--;
+		ndn[n++] = (char)tolower ((unsigned char)c);
+	}
+	while (n > 0 && ndn[n-1] == ' ')
+		n--;
+	ndn[n] = '\0';
+	return ndn;
+}
+
+
+/*
+** Get the parent of a DN (the empty string for a top entry).
+*/
+static const char *parent (const char *dn) {
+	const char *comma = strchr (dn, ',');
+	return comma == NULL ? "" : comma + 1;
+}
+
+
+/*
+** Compare two values, ignoring the case.
+** @return Negative, zero or positive as strcmp.
+*/
+static int bv_casecmp (const BerValue *a, const BerValue *b) {
+	ber_len_t i, n = a->bv_len < b->bv_len ? a->bv_len : b->bv_len;
+	for (i = 0; i < n; i++) {
+		int d = tolower ((unsigned char)a->bv_val[i]) - tolower ((unsigned char)b->bv_val[i]);
+		if (d != 0)
+			return d;
+	}
+	return a->bv_len < b->bv_len ? -1 : a->bv_len > b->bv_len;
+}
+
+
+/*
+** Find a value in another one, ignoring the case.
+** @return Offset of the value or -1.
+*/
+static long bv_casefind (const BerValue *v, ber_len_t from, const BerValue *s) {
+	ber_len_t i;
+	for (i = from; i + s->bv_len <= v->bv_len; i++) {
+		BerValue part;
+		part.bv_val = v->bv_val + i;
+		part.bv_len = s->bv_len;
+		if (bv_casecmp (&part, s) == 0)
+			return (long)i;
+	}
+	return -1;
+}
+
+
+/*
+** Hash a normalized DN.
+*/
+static unsigned dn_hash (const char *ndn) {
+	unsigned h = 2166136261u;
+	for (; *ndn != '\0'; ndn++)
+		h = (h ^ (unsigned char)*ndn) * 16777619u;
+	return h;
+}
+
+
+static mock_entry *find_entry (const char *ndn) {
+	mock_entry *e;
+	if (nbuckets == 0)
+		return NULL;
+	for (e = buckets[dn_hash (ndn) & (nbuckets - 1)]; e != NULL; e = e->next)
+		if (strcmp (e->ndn, ndn) == 0)
+			return e;
+	return NULL;
+}
+
+
+static void hash_insert (mock_entry *e) {
+	mock_entry **b = &buckets[dn_hash (e->ndn) & (nbuckets - 1)];
+	e->next = *b;
+	*b = e;
+}
+
+
+static void hash_remove (mock_entry *e) {
+	mock_entry **b = &buckets[dn_hash (e->ndn) & (nbuckets - 1)];
+	while (*b != e)
+		b = &(*b)->next;
+	*b = e->next;
+}
+
+
+/*
+** Add an entry to the directory.
+*/
+static void insert_entry (mock_entry *e) {
+	mock_entry *p = find_entry (parent (e->ndn));
+	if (nentries == maxentries) {
+		maxentries = maxentries > 0 ? 2 * maxentries : 1024;
+		entries = (mock_entry **)xrealloc (entries, maxentries * sizeof (mock_entry *));
+	}
+	if ((unsigned)nentries >= nbuckets) { /* rehash */
+		unsigned i, old = nbuckets;
+		mock_entry **olds = buckets;
+		nbuckets = nbuckets > 0 ? 2 * nbuckets : 1024;
+		buckets = (mock_entry **)xmalloc (nbuckets * sizeof (mock_entry *));
+		memset (buckets, 0, nbuckets * sizeof (mock_entry *));
+		for (i = 0; i < old; i++) {
+			mock_entry *next, *o;
+			for (o = olds[i]; o != NULL; o = next) {
+				next = o->next;
+				hash_insert (o);
+			}
+		}
+		free (olds);
+	}
+	e->index = nentries;
+	entries[nentries++] = e;
+	hash_insert (e);
+	if (p != NULL)
+		p->children++;
+}
+
+
+/*
+** Remove an entry from the directory (without releasing it).
+*/
+static void remove_entry (mock_entry *e) {
+	mock_entry *p = find_entry (parent (e->ndn));
+	hash_remove (e);
+	entries[e->index] = entries[--nentries];
+	entries[e->index]->index = e->index;
+	if (p != NULL)
+		p->children--;
+}
+
+
+static mock_entry *new_entry (const char *dn, size_t len) {
+	mock_entry *e = (mock_entry *)xmalloc (sizeof (mock_entry));
+	e->dn = xstrndup (dn, len);
+	e->ndn = normalize (dn, len);
+	e->attrs = NULL;
+	e->nattrs = 0;
+	e->children = 0;
+	e->index = -1;
+	e->next = NULL;
+	return e;
+}
+
+
+static void free_attr (mock_attr *a) {
+	int i;
+	for (i = 0; i < a->n; i++)
+		free (a->vals[i].bv_val);
+	free (a->vals);
+	free (a->name);
+}
+
+
+static void free_entry (mock_entry *e) {
+	int i;
+	for (i = 0; i < e->nattrs; i++)
+		free_attr (&e->attrs[i]);
+	free (e->attrs);
+	free (e->dn);
+	free (e->ndn);
+	free (e);
+}
+
+
+/*
+** Find an attribute of an entry, and create it if asked to.
+*/
+static mock_attr *entry_attr (mock_entry *e, const char *name, size_t len, int create) {
+	int i;
+	mock_attr *a;
+	for (i = 0; i < e->nattrs; i++)
+		if (strlen (e->attrs[i].name) == len && strncasecmp (e->attrs[i].name, name, len) == 0)
+			return &e->attrs[i];
+	if (!create)
+		return NULL;
+	e->attrs = (mock_attr *)xrealloc (e->attrs, (e->nattrs + 1) * sizeof (mock_attr));
+	a = &e->attrs[e->nattrs++];
+	a->name = xstrndup (name, len);
+	a->vals = (BerValue *)xmalloc (sizeof (BerValue));
+	a->vals[0].bv_val = NULL;
+	a->vals[0].bv_len = 0;
+	a->n = 0;
+	return a;
+}
+
+
+static int attr_find_value (mock_attr *a, const BerValue *v) {
+	int i;
+	for (i = 0; i < a->n; i++)
+		if (bv_casecmp (&a->vals[i], v) == 0)
+			return i;
+	return -1;
+}
+
+
+static void attr_add_value (mock_attr *a, const char *val, size_t len) {
+	a->vals = (BerValue *)xrealloc (a->vals, (a->n + 2) * sizeof (BerValue));
+	a->vals[a->n].bv_val = xstrndup (val, len);
+	a->vals[a->n].bv_len = len;
+	a->n++;
+	a->vals[a->n].bv_val = NULL;
+	a->vals[a->n].bv_len = 0;
+}
+
+
+static void attr_del_value (mock_attr *a, int i) {
+	free (a->vals[i].bv_val);
+	memmove (&a->vals[i], &a->vals[i+1], (a->n - i) * sizeof (BerValue));
+	a->n--;
+}
+
+
+static void entry_del_attr (mock_entry *e, mock_attr *a) {
+	int i = (int)(a - e->attrs);
+	free_attr (a);
+	memmove (&e->attrs[i], &e->attrs[i+1], (e->nattrs - i - 1) * sizeof (mock_attr));
+	e->nattrs--;
+}
+
+
+/*
+** Add the value of a RDN (attr=value) to an entry, or remove it.
+*/
+static void entry_rdn (mock_entry *e, const char *rdn, int add) {
+	const char *eq = strchr (rdn, '=');
+	const char *end = strchr (rdn, ',');
+	mock_attr *a;
+	BerValue v;
+	if (eq == NULL || (end != NULL && eq > end))
+		return;
+	if (end == NULL)
+		end = rdn + strlen (rdn);
+	v.bv_val = (char *)eq + 1;
+	v.bv_len = end - eq - 1;
+	a = entry_attr (e, rdn, eq - rdn, add);
+	if (a == NULL)
+		return;
+	if (add && attr_find_value (a, &v) < 0)
+		attr_add_value (a, v.bv_val, v.bv_len);
+	else if (!add) {
+		int i = attr_find_value (a, &v);
+		if (i >= 0)
+			attr_del_value (a, i);
+		if (a->n == 0)
+			entry_del_attr (e, a);
+	}
+}
+
+
+/*
+** Fill the directory with the base entry and count synthetic entries
+** cn=entryN with nattrs attributes of nvalues values of size bytes.
+*/
+static void generate (int count, int nattrs, int nvalues, int size) {
+	char dn[1024], name[32];
+	char *value = (char *)xmalloc (size + 32);
+	mock_entry *e;
+	int i, j, k;
+
+	e = new_entry (base, strlen (base));
+	nsuffix = normalize (base, strlen (base));
+	attr_add_value (entry_attr (e, "objectClass", 11, 1), "top", 3);
+	entry_rdn (e, base, 1);
+	insert_entry (e);
+	for (i = 1; i <= count; i++) {
+		int len = snprintf (dn, sizeof (dn), "cn=entry%d,%s", i, base);
+		mock_attr *oc;
+		e = new_entry (dn, len);
+		oc = entry_attr (e, "objectClass", 11, 1);
+		attr_add_value (oc, "top", 3);
+		attr_add_value (oc, "person", 6);
+		entry_rdn (e, dn, 1);
+		attr_add_value (entry_attr (e, "sn", 2, 1), dn + 3, strchr (dn, ',') - dn - 3);
+		for (j = 1; j <= nattrs; j++) {
+			mock_attr *a;
+			snprintf (name, sizeof (name), "mockAttr%d", j);
+			a = entry_attr (e, name, strlen (name), 1);
+			for (k = 1; k <= nvalues; k++) {
+				int n = snprintf (value, 32, "%d-", k);
+				while (n < size) {
+					value[n] = (char)('a' + (i + j + n) % 26);
+					n++;
+				}
+				attr_add_value (a, value, n);
+			}
+		}
+		insert_entry (e);
+	}
+	free (value);
+}
+
+
+/*
+** Add the entries of an LDIF file to the directory.
+** Only unfolded "attr: value" lines are read (no base64 value, no change
+** record); the parent of each entry must exist.
+** @return 0 or -1 after printing the error.
+*/
+static int load_ldif (const char *file) {
+	FILE *f = fopen (file, "r");
+	char line[4096];
+	mock_entry *e = NULL;
+	int n = 0, rc = 0;
+
+	if (f == NULL) {
+		fprintf (stderr, "mockldap: cannot open %s: %s\n", file, strerror (errno));
+		return -1;
+	}
+	for (;;) {
+		int eof = fgets (line, sizeof (line), f) == NULL;
+		size_t len = eof ? 0 : strcspn (line, "\r\n");
+		const char *error = NULL;
+		char *colon, *value;
+		n++;
+		line[len] = '\0';
+		if (line[0] == '#')
+			continue;
+		if (len == 0) { /* end of an entry */
+			if (e != NULL) {
+				if (find_entry (e->ndn) != NULL)
+					error = "the entry already exists";
+				else if (find_entry (parent (e->ndn)) == NULL)
+					error = "the parent of the entry does not exist";
+				else {
+					insert_entry (e);
+					e = NULL;
+				}
+			}
+		} else if ((colon = strchr (line, ':')) == NULL || colon[1] == ':' || colon[1] == '<')
+			error = "unsupported line";
+		else {
+			for (value = colon + 1; *value == ' '; value++)
+				;
+			if (e == NULL && (colon - line != 2 || strncasecmp (line, "dn", 2) != 0))
+				error = "an entry must start with its dn";
+			else if (e == NULL)
+				e = new_entry (value, strlen (value));
+			else
+				attr_add_value (entry_attr (e, line, colon - line, 1), value, strlen (value));
+		}
+		if (error != NULL) {
+			fprintf (stderr, "mockldap: %s:%d: %s\n", file, n, error);
+			rc = -1;
+			break;
+		}
+		if (eof)
+			break;
+	}
+	if (e != NULL)
+		free_entry (e);
+	fclose (f);
+	return rc;
+}
+
+
+/*
+** Queue a response on a connection.
+** The responses of the same request sent at the same time are gathered
+** in one buffer.
+*/
+static void respond (mock_conn *c, ber_int_t msgid, double due, BerElement *ber) {
+	BerValue data;
+	mock_response *r = c->tail;
+	if (ber_flatten2 (ber, &data, 0) == -1) {
+		ber_free (ber, 1);
+		return;
+	}
+	if (r == NULL || r->off > 0 || r->msgid != msgid || r->due != due) {
+		r = (mock_response *)xmalloc (sizeof (mock_response));
+		r->due = due;
+		r->msgid = msgid;
+		r->data = NULL;
+		r->len = r->off = r->size = 0;
+		r->next = NULL;
+		if (c->tail != NULL)
+			c->tail->next = r;
+		else
+			c->head = r;
+		c->tail = r;
+	}
+	if (r->len + data.bv_len > r->size) {
+		r->size = r->size > 0 ? r->size : 4096;
+		while (r->len + data.bv_len > r->size)
+			r->size *= 2;
+		r->data = (char *)xrealloc (r->data, r->size);
+	}
+	memcpy (r->data + r->len, data.bv_val, data.bv_len);
+	r->len += data.bv_len;
+	ber_free (ber, 1);
+}
+
+
+/*
+** Queue the result of an operation.
+** @param value Value of the response of an extended operation (or NULL).
+*/
+static void respond_result (mock_conn *c, ber_int_t msgid, double due, ber_tag_t tag,
+	ber_int_t code, const char *text, const BerValue *value)
+{
+	BerElement *ber = ber_alloc_t (LBER_USE_DER);
+	int rc;
+	if (ber == NULL)
+		return;
+	rc = ber_printf (ber, "{it{ess", msgid, tag, code, "", text);
+	if (rc != -1 && value != NULL)
+		rc = ber_printf (ber, "tO", LDAP_TAG_EXOP_RES_VALUE, value);
+	if (rc != -1)
+		rc = ber_printf (ber, "}}");
+	if (rc == -1)
+		ber_free (ber, 1);
+	else
+		respond (c, msgid, due, ber);
+}
+
+
+/*
+** Check if the attribute was asked by a search.
+*/
+static int selected (char **attrs, const char *name) {
+	int i;
+	if (attrs == NULL || attrs[0] == NULL)
+		return 1;
+	for (i = 0; attrs[i] != NULL; i++)
+		if (strcmp (attrs[i], "*") == 0 || strcasecmp (attrs[i], name) == 0)
+			return 1;
+	return 0;
+}
+
+
+/*
+** Queue an entry returned by a search.
+*/
+static void respond_entry (mock_conn *c, ber_int_t msgid, double due, mock_entry *e,
+	char **attrs, int attrsonly)
+{
+	BerElement *ber = ber_alloc_t (LBER_USE_DER);
+	int i, rc;
+	if (ber == NULL)
+		return;
+	rc = ber_printf (ber, "{it{s{", msgid, LDAP_RES_SEARCH_ENTRY, e->dn);
+	for (i = 0; i < e->nattrs && rc != -1; i++) {
+		if (!selected (attrs, e->attrs[i].name))
+			continue;
+		if (attrsonly)
+			rc = ber_printf (ber, "{s[]}", e->attrs[i].name);
+		else
+			rc = ber_printf (ber, "{s[W]}", e->attrs[i].name, e->attrs[i].vals);
+	}
+	if (rc != -1)
+		rc = ber_printf (ber, "}}}");
+	if (rc == -1)
+		ber_free (ber, 1);
+	else
+		respond (c, msgid, due, ber);
+}
+
+
+static void free_filter (mock_filter *f) {
+	while (f != NULL) {
+		mock_filter *next = f->next;
+		free_filter (f->child);
+		free (f->any);
+		free (f);
+		f = next;
+	}
+}
+
+
+/*
+** Decode a search filter.
+** Its values point into the request.
+** @return Filter or NULL when it cannot be decoded.
+*/
+static mock_filter *parse_filter (BerElement *ber) {
+	ber_len_t len;
+	char *last;
+	ber_tag_t tag = ber_peek_tag (ber, &len);
+	mock_filter *f = (mock_filter *)xmalloc (sizeof (mock_filter));
+	memset (f, 0, sizeof (mock_filter));
+	f->choice = tag;
+	switch (tag) {
+		case LDAP_FILTER_AND:
+		case LDAP_FILTER_OR: {
+			mock_filter **tail = &f->child;
+			for (tag = ber_first_element (ber, &len, &last);
+				tag != LBER_DEFAULT;
+				tag = ber_next_element (ber, &len, last))
+			{
+				if ((*tail = parse_filter (ber)) == NULL)
+					goto fail;
+				tail = &(*tail)->next;
+			}
+			return f;
+		}
+		case LDAP_FILTER_NOT:
+			if (ber_skip_tag (ber, &len) == LBER_DEFAULT || (f->child = parse_filter (ber)) == NULL)
+				goto fail;
+			return f;
+		case LDAP_FILTER_EQUALITY:
+		case LDAP_FILTER_GE:
+		case LDAP_FILTER_LE:
+		case LDAP_FILTER_APPROX:
+			if (ber_scanf (ber, "{mm}", &f->attr, &f->value) == LBER_ERROR)
+				goto fail;
+			return f;
+		case LDAP_FILTER_PRESENT:
+			if (ber_scanf (ber, "m", &f->attr) == LBER_ERROR)
+				goto fail;
+			return f;
+		case LDAP_FILTER_SUBSTRINGS:
+			if (ber_scanf (ber, "{m", &f->attr) == LBER_ERROR)
+				goto fail;
+			for (tag = ber_first_element (ber, &len, &last);
+				tag != LBER_DEFAULT;
+				tag = ber_next_element (ber, &len, last))
+			{
+				BerValue bv;
+				if (ber_scanf (ber, "m", &bv) == LBER_ERROR)
+					goto fail;
+				if (tag == LDAP_SUBSTRING_INITIAL)
+					f->initial = bv;
+				else if (tag == LDAP_SUBSTRING_FINAL)
+					f->final = bv;
+				else {
+					f->any = (BerValue *)xrealloc (f->any, (f->nany + 1) * sizeof (BerValue));
+					f->any[f->nany++] = bv;
+				}
+			}
+			return f;
+		case LDAP_FILTER_EXT: /* never matches */
+			if (ber_scanf (ber, "x") == LBER_ERROR)
+				goto fail;
+			return f;
+		default:
+			break;
+	}
+fail:
+	free_filter (f);
+	return NULL;
+}
+
+
+/*
+** Check if a value matches a substrings filter.
+*/
+static int match_substrings (const BerValue *v, const mock_filter *f) {
+	ber_len_t pos = 0;
+	int i;
+	if (f->initial.bv_val != NULL) {
+		BerValue head;
+		if (v->bv_len < f->initial.bv_len)
+			return 0;
+		head.bv_val = v->bv_val;
+		head.bv_len = f->initial.bv_len;
+		if (bv_casecmp (&head, &f->initial) != 0)
+			return 0;
+		pos = head.bv_len;
+	}
+	for (i = 0; i < f->nany; i++) {
+		long found = bv_casefind (v, pos, &f->any[i]);
+		if (found < 0)
+			return 0;
+		pos = (ber_len_t)found + f->any[i].bv_len;
+	}
+	if (f->final.bv_val != NULL) {
+		BerValue tail;
+		if (v->bv_len < pos + f->final.bv_len)
+			return 0;
+		tail.bv_val = v->bv_val + v->bv_len - f->final.bv_len;
+		tail.bv_len = f->final.bv_len;
+		if (bv_casecmp (&tail, &f->final) != 0)
+			return 0;
+	}
+	return 1;
+}
+
+
+static int match_filter (mock_entry *e, const mock_filter *f) {
+	const mock_filter *c;
+	mock_attr *a;
+	int i;
+	switch (f->choice) {
+		case LDAP_FILTER_AND:
+			for (c = f->child; c != NULL; c = c->next)
+				if (!match_filter (e, c))
+					return 0;
+			return 1;
+		case LDAP_FILTER_OR:
+			for (c = f->child; c != NULL; c = c->next)
+				if (match_filter (e, c))
+					return 1;
+			return 0;
+		case LDAP_FILTER_NOT:
+			return !match_filter (e, f->child);
+		case LDAP_FILTER_PRESENT:
+			return entry_attr (e, f->attr.bv_val, f->attr.bv_len, 0) != NULL;
+		default:
+			break;
+	}
+	a = entry_attr (e, f->attr.bv_val, f->attr.bv_len, 0);
+	if (a == NULL)
+		return 0;
+	for (i = 0; i < a->n; i++) {
+		switch (f->choice) {
+			case LDAP_FILTER_EQUALITY:
+			case LDAP_FILTER_APPROX:
+				if (bv_casecmp (&a->vals[i], &f->value) == 0)
+					return 1;
+				break;
+			case LDAP_FILTER_GE:
+				if (bv_casecmp (&a->vals[i], &f->value) >= 0)
+					return 1;
+				break;
+			case LDAP_FILTER_LE:
+				if (bv_casecmp (&a->vals[i], &f->value) <= 0)
+					return 1;
+				break;
+			case LDAP_FILTER_SUBSTRINGS:
+				if (match_substrings (&a->vals[i], f))
+					return 1;
+				break;
+			default:
+				return 0;
+		}
+	}
+	return 0;
+}
+
+
+/*
+** Check if an entry is in the scope of a search.
+*/
+static int in_scope (const char *ndn, const char *nbase, int scope) {
+	size_t n = strlen (ndn), b = strlen (nbase);
+	if (scope == LDAP_SCOPE_BASE)
+		return strcmp (ndn, nbase) == 0;
+	if (b == 0) /* the whole directory */
+		return scope == LDAP_SCOPE_SUBTREE || strchr (ndn, ',') == NULL;
+	if (n == b)
+		return scope == LDAP_SCOPE_SUBTREE && strcmp (ndn, nbase) == 0;
+	if (n < b + 1 || ndn[n - b - 1] != ',' || strcmp (ndn + n - b, nbase) != 0)
+		return 0;
+	return scope == LDAP_SCOPE_SUBTREE || strcmp (parent (ndn), nbase) == 0;
+}
+
+
+/*
+** Build the entry of the root DSE.
+*/
+static mock_entry *root_entry (void) {
+	mock_entry *root = new_entry ("", 0);
+	attr_add_value (entry_attr (root, "objectClass", 11, 1), "top", 3);
+	attr_add_value (entry_attr (root, "namingContexts", 14, 1), base, strlen (base));
+	attr_add_value (entry_attr (root, "supportedLDAPVersion", 20, 1), "3", 1);
+	attr_add_value (entry_attr (root, "supportedExtension", 18, 1),
+		LDAP_EXOP_WHO_AM_I, strlen (LDAP_EXOP_WHO_AM_I));
+	attr_add_value (entry_attr (root, "supportedControl", 16, 1),
+		LDAP_CONTROL_ASSERT, strlen (LDAP_CONTROL_ASSERT));
+	return root;
+}
+
+
+static int do_search (mock_conn *c, ber_int_t msgid, double due, BerElement *ber,
+	const mock_filter *assertion)
+{
+	BerValue dn;
+	ber_int_t scope, deref, sizelimit, timelimit, attrsonly;
+	char **attrs = NULL;
+	mock_filter *filter;
+	mock_entry *e = NULL;
+	char *nbase;
+	int i, found = 0;
+	ber_int_t code = LDAP_SUCCESS;
+
+	if (ber_scanf (ber, "{meeiib", &dn, &scope, &deref, &sizelimit, &timelimit, &attrsonly) == LBER_ERROR)
+		return -1;
+	filter = parse_filter (ber);
+	if (filter == NULL)
+		return -1;
+	if (ber_scanf (ber, "{v}", &attrs) == LBER_ERROR) {
+		free_filter (filter);
+		return -1;
+	}
+	nbase = normalize (dn.bv_val, dn.bv_len);
+	if (nbase[0] == '\0' && scope == LDAP_SCOPE_BASE) {
+		mock_entry *root = root_entry ();
+		if (assertion != NULL && !match_filter (root, assertion))
+			code = LDAP_ASSERTION_FAILED;
+		else if (match_filter (root, filter))
+			respond_entry (c, msgid, due, root, attrs, attrsonly);
+		free_entry (root);
+	} else if (nbase[0] != '\0' && (e = find_entry (nbase)) == NULL)
+		code = LDAP_NO_SUCH_OBJECT;
+	else if (e != NULL && assertion != NULL && !match_filter (e, assertion))
+		code = LDAP_ASSERTION_FAILED;
+	else {
+		for (i = 0; i < nentries; i++) {
+			e = entries[i];
+			if (!in_scope (e->ndn, nbase, scope) || !match_filter (e, filter))
+				continue;
+			if (sizelimit > 0 && found == sizelimit) {
+				code = LDAP_SIZELIMIT_EXCEEDED;
+				break;
+			}
+			respond_entry (c, msgid, due, e, attrs, attrsonly);
+			found++;
+		}
+	}
+	respond_result (c, msgid, due, LDAP_RES_SEARCH_RESULT, code, "", NULL);
+	free (nbase);
+	free_filter (filter);
+	ber_memvfree ((void **)attrs);
+	return 0;
+}
+
+
+static int do_bind (mock_conn *c, ber_int_t msgid, double due, BerElement *ber) {
+	ber_int_t version;
+	BerValue dn, cred;
+	ber_len_t len;
+	ber_int_t code = LDAP_SUCCESS;
+	char *ndn;
+
+	if (ber_scanf (ber, "{im", &version, &dn) == LBER_ERROR)
+		return -1;
+	free (c->bound);
+	c->bound = NULL;
+	if (ber_peek_tag (ber, &len) != LDAP_AUTH_SIMPLE) {
+		respond_result (c, msgid, due, LDAP_RES_BIND, LDAP_AUTH_METHOD_NOT_SUPPORTED,
+			"only simple binds are supported", NULL);
+		return 0;
+	}
+	if (ber_scanf (ber, "m", &cred) == LBER_ERROR)
+		return -1;
+	ndn = normalize (dn.bv_val, dn.bv_len);
+	if (ndn[0] == '\0' && cred.bv_len == 0)
+		; /* anonymous */
+	else if (cred.bv_len == 0)
+		code = LDAP_UNWILLING_TO_PERFORM; /* unauthenticated bind */
+	else {
+		char *nmanager = normalize (manager, strlen (manager));
+		if ((strcmp (ndn, nmanager) != 0 && find_entry (ndn) == NULL)
+			|| cred.bv_len != strlen (password) || memcmp (cred.bv_val, password, cred.bv_len) != 0)
+			code = LDAP_INVALID_CREDENTIALS;
+		else
+			c->bound = xstrndup (dn.bv_val, dn.bv_len);
+		free (nmanager);
+	}
+	free (ndn);
+	respond_result (c, msgid, due, LDAP_RES_BIND, code, "", NULL);
+	return 0;
+}
+
+
+static int do_add (mock_conn *c, ber_int_t msgid, double due, BerElement *ber) {
+	BerValue dn;
+	ber_tag_t tag;
+	ber_len_t len;
+	char *last;
+	mock_entry *e;
+	ber_int_t code = LDAP_SUCCESS;
+
+	if (ber_scanf (ber, "{m", &dn) == LBER_ERROR)
+		return -1;
+	e = new_entry (dn.bv_val, dn.bv_len);
+	for (tag = ber_first_element (ber, &len, &last);
+		tag != LBER_DEFAULT;
+		tag = ber_next_element (ber, &len, last))
+	{
+		BerValue type;
+		BerVarray vals = NULL;
+		mock_attr *a;
+		int i;
+		if (ber_scanf (ber, "{m[W]}", &type, &vals) == LBER_ERROR) {
+			free_entry (e);
+			return -1;
+		}
+		a = entry_attr (e, type.bv_val, type.bv_len, 1);
+		for (i = 0; vals != NULL && vals[i].bv_val != NULL; i++)
+			attr_add_value (a, vals[i].bv_val, vals[i].bv_len);
+		ber_bvarray_free (vals);
+	}
+	if (find_entry (e->ndn) != NULL)
+		code = LDAP_ALREADY_EXISTS;
+	else if (parent (e->ndn)[0] != '\0' && find_entry (parent (e->ndn)) == NULL
+		&& strcmp (e->ndn, nsuffix) != 0)
+		code = LDAP_NO_SUCH_OBJECT;
+	if (code == LDAP_SUCCESS)
+		insert_entry (e);
+	else
+		free_entry (e);
+	respond_result (c, msgid, due, LDAP_RES_ADD, code, "", NULL);
+	return 0;
+}
+
+
+/*
+** Apply a modification to an entry.
+** @return LDAP result code.
+*/
+static ber_int_t apply_mod (mock_entry *e, ber_int_t op, const BerValue *type, BerVarray vals) {
+	mock_attr *a = entry_attr (e, type->bv_val, type->bv_len, op != LDAP_MOD_DELETE);
+	int i;
+	switch (op) {
+		case LDAP_MOD_ADD:
+			for (i = 0; vals != NULL && vals[i].bv_val != NULL; i++) {
+				if (attr_find_value (a, &vals[i]) >= 0)
+					return LDAP_TYPE_OR_VALUE_EXISTS;
+				attr_add_value (a, vals[i].bv_val, vals[i].bv_len);
+			}
+			break;
+		case LDAP_MOD_DELETE:
+			if (a == NULL)
+				return LDAP_NO_SUCH_ATTRIBUTE;
+			if (vals == NULL || vals[0].bv_val == NULL) {
+				entry_del_attr (e, a);
+				return LDAP_SUCCESS;
+			}
+			for (i = 0; vals[i].bv_val != NULL; i++) {
+				int j = attr_find_value (a, &vals[i]);
+				if (j < 0)
+					return LDAP_NO_SUCH_ATTRIBUTE;
+				attr_del_value (a, j);
+			}
+			break;
+		case LDAP_MOD_REPLACE:
+			while (a->n > 0)
+				attr_del_value (a, a->n - 1);
+			for (i = 0; vals != NULL && vals[i].bv_val != NULL; i++)
+				attr_add_value (a, vals[i].bv_val, vals[i].bv_len);
+			break;
+		default:
+			return LDAP_PROTOCOL_ERROR;
+	}
+	if (a->n == 0)
+		entry_del_attr (e, a);
+	return LDAP_SUCCESS;
+}
+
+
+static int do_modify (mock_conn *c, ber_int_t msgid, double due, BerElement *ber,
+	const mock_filter *assertion)
+{
+	BerValue dn;
+	ber_tag_t tag;
+	ber_len_t len;
+	char *last, *ndn;
+	mock_entry *e;
+	ber_int_t code = LDAP_SUCCESS;
+
+	if (ber_scanf (ber, "{m", &dn) == LBER_ERROR)
+		return -1;
+	ndn = normalize (dn.bv_val, dn.bv_len);
+	e = find_entry (ndn);
+	free (ndn);
+	if (e == NULL)
+		code = LDAP_NO_SUCH_OBJECT;
+	else if (assertion != NULL && !match_filter (e, assertion))
+		code = LDAP_ASSERTION_FAILED;
+	for (tag = ber_first_element (ber, &len, &last);
+		tag != LBER_DEFAULT;
+		tag = ber_next_element (ber, &len, last))
+	{
+		ber_int_t op;
+		BerValue type;
+		BerVarray vals = NULL;
+		if (ber_scanf (ber, "{e{m[W]}}", &op, &type, &vals) == LBER_ERROR)
+			return -1;
+		if (code == LDAP_SUCCESS)
+			code = apply_mod (e, op, &type, vals);
+		ber_bvarray_free (vals);
+	}
+	respond_result (c, msgid, due, LDAP_RES_MODIFY, code, "", NULL);
+	return 0;
+}
+
+
+static int do_delete (mock_conn *c, ber_int_t msgid, double due, BerElement *ber,
+	const mock_filter *assertion)
+{
+	BerValue dn;
+	char *ndn;
+	mock_entry *e;
+	ber_int_t code = LDAP_SUCCESS;
+
+	if (ber_scanf (ber, "m", &dn) == LBER_ERROR)
+		return -1;
+	ndn = normalize (dn.bv_val, dn.bv_len);
+	e = find_entry (ndn);
+	free (ndn);
+	if (e == NULL)
+		code = LDAP_NO_SUCH_OBJECT;
+	else if (assertion != NULL && !match_filter (e, assertion))
+		code = LDAP_ASSERTION_FAILED;
+	else if (e->children > 0)
+		code = LDAP_NOT_ALLOWED_ON_NONLEAF;
+	else {
+		remove_entry (e);
+		free_entry (e);
+	}
+	respond_result (c, msgid, due, LDAP_RES_DELETE, code, "", NULL);
+	return 0;
+}
+
+
+static int do_rename (mock_conn *c, ber_int_t msgid, double due, BerElement *ber,
+	const mock_filter *assertion)
+{
+	BerValue dn, rdn, sup;
+	ber_int_t deleteold;
+	ber_len_t len;
+	char *ndn, *newdn, *nnew;
+	const char *sup_dn;
+	mock_entry *e;
+	ber_int_t code = LDAP_SUCCESS;
+
+	if (ber_scanf (ber, "{mmb", &dn, &rdn, &deleteold) == LBER_ERROR)
+		return -1;
+	sup.bv_val = NULL;
+	if (ber_peek_tag (ber, &len) == LDAP_TAG_NEWSUPERIOR && ber_scanf (ber, "m", &sup) == LBER_ERROR)
+		return -1;
+	ndn = normalize (dn.bv_val, dn.bv_len);
+	e = find_entry (ndn);
+	free (ndn);
+	if (e == NULL) {
+		respond_result (c, msgid, due, LDAP_RES_MODDN, LDAP_NO_SUCH_OBJECT, "", NULL);
+		return 0;
+	}
+	if (assertion != NULL && !match_filter (e, assertion)) {
+		respond_result (c, msgid, due, LDAP_RES_MODDN, LDAP_ASSERTION_FAILED, "", NULL);
+		return 0;
+	}
+	if (e->children > 0) {
+		respond_result (c, msgid, due, LDAP_RES_MODDN, LDAP_NOT_ALLOWED_ON_NONLEAF, "", NULL);
+		return 0;
+	}
+	if (sup.bv_val != NULL) {
+		sup_dn = sup.bv_val;
+		len = sup.bv_len;
+	} else {
+		sup_dn = parent (e->dn);
+		len = strlen (sup_dn);
+	}
+	newdn = (char *)xmalloc (rdn.bv_len + len + 2);
+	memcpy (newdn, rdn.bv_val, rdn.bv_len);
+	newdn[rdn.bv_len] = '\0';
+	if (len > 0) {
+		newdn[rdn.bv_len] = ',';
+		memcpy (newdn + rdn.bv_len + 1, sup_dn, len);
+		newdn[rdn.bv_len + 1 + len] = '\0';
+	}
+	nnew = normalize (newdn, strlen (newdn));
+	if (parent (nnew)[0] != '\0' && find_entry (parent (nnew)) == NULL)
+		code = LDAP_NO_SUCH_OBJECT;
+	else if (strcmp (nnew, e->ndn) != 0 && find_entry (nnew) != NULL)
+		code = LDAP_ALREADY_EXISTS;
+	else {
+		remove_entry (e);
+		if (deleteold)
+			entry_rdn (e, e->dn, 0);
+		free (e->dn);
+		free (e->ndn);
+		e->dn = newdn;
+		e->ndn = nnew;
+		entry_rdn (e, e->dn, 1);
+		insert_entry (e);
+		newdn = nnew = NULL;
+	}
+	free (newdn);
+	free (nnew);
+	respond_result (c, msgid, due, LDAP_RES_MODDN, code, "", NULL);
+	return 0;
+}
+
+
+static int do_compare (mock_conn *c, ber_int_t msgid, double due, BerElement *ber,
+	const mock_filter *assertion)
+{
+	BerValue dn, type, value;
+	char *ndn;
+	mock_entry *e;
+	mock_attr *a;
+	ber_int_t code;
+
+	if (ber_scanf (ber, "{m{mm}}", &dn, &type, &value) == LBER_ERROR)
+		return -1;
+	ndn = normalize (dn.bv_val, dn.bv_len);
+	e = find_entry (ndn);
+	free (ndn);
+	if (e == NULL)
+		code = LDAP_NO_SUCH_OBJECT;
+	else if (assertion != NULL && !match_filter (e, assertion))
+		code = LDAP_ASSERTION_FAILED;
+	else if ((a = entry_attr (e, type.bv_val, type.bv_len, 0)) == NULL)
+		code = LDAP_NO_SUCH_ATTRIBUTE;
+	else
+		code = attr_find_value (a, &value) >= 0 ? LDAP_COMPARE_TRUE : LDAP_COMPARE_FALSE;
+	respond_result (c, msgid, due, LDAP_RES_COMPARE, code, "", NULL);
+	return 0;
+}
+
+
+static int do_extended (mock_conn *c, ber_int_t msgid, double due, BerElement *ber) {
+	BerValue oid, id;
+	char *authzid;
+	if (ber_scanf (ber, "{m", &oid) == LBER_ERROR)
+		return -1;
+	if (oid.bv_len != strlen (LDAP_EXOP_WHO_AM_I) || memcmp (oid.bv_val, LDAP_EXOP_WHO_AM_I, oid.bv_len) != 0) {
+		respond_result (c, msgid, due, LDAP_RES_EXTENDED, LDAP_PROTOCOL_ERROR,
+			"unsupported extended operation", NULL);
+		return 0;
+	}
+	authzid = (char *)xmalloc (c->bound != NULL ? strlen (c->bound) + 4 : 1);
+	if (c->bound != NULL)
+		sprintf (authzid, "dn:%s", c->bound);
+	else
+		authzid[0] = '\0';
+	id.bv_val = authzid;
+	id.bv_len = strlen (authzid);
+	respond_result (c, msgid, due, LDAP_RES_EXTENDED, LDAP_SUCCESS, "", &id);
+	free (authzid);
+	return 0;
+}
+
+
+/*
+** Drop the responses of an abandoned operation which were not sent yet.
+*/
+static int do_abandon (mock_conn *c, BerElement *ber) {
+	ber_int_t id;
+	mock_response **r = &c->head;
+	if (ber_scanf (ber, "i", &id) == LBER_ERROR)
+		return -1;
+	c->tail = NULL;
+	while (*r != NULL) {
+		if ((*r)->msgid == id && (*r)->off == 0) {
+			mock_response *dead = *r;
+			*r = dead->next;
+			free (dead->data);
+			free (dead);
+		} else {
+			c->tail = *r;
+			r = &(*r)->next;
+		}
+	}
+	return 0;
+}
+
+
+/*
+** Check if a scripted error applies to an operation.
+** @return 1 and the result code when it applies, 0 otherwise.
+*/
+static int scripted (int op, int *code) {
+	int i;
+	counts[op]++;
+	for (i = 0; i < nerrors; i++)
+		if (errors[i].op == op && counts[op] % errors[i].every == 0) {
+			*code = errors[i].code;
+			return 1;
+		}
+	return 0;
+}
+
+
+/*
+** Decode the controls of a request.
+** The assertion control applies to compare, delete, modify, rename and
+** search; the other controls are ignored unless they are critical.
+** @return LDAP result code.
+*/
+static ber_int_t parse_controls (const BerValue *request, int op, mock_controls *ctrls) {
+	BerElement *ber = ber_init ((BerValue *)request);
+	ber_int_t msgid, code = LDAP_SUCCESS;
+	ber_tag_t tag;
+	ber_len_t len;
+	char *last;
+
+	if (ber == NULL)
+		return LDAP_OTHER;
+	if (ber_scanf (ber, "{ix", &msgid) == LBER_ERROR)
+		code = LDAP_PROTOCOL_ERROR;
+	else if (ber_peek_tag (ber, &len) == LDAP_TAG_CONTROLS) {
+		for (tag = ber_first_element (ber, &len, &last);
+			tag != LBER_DEFAULT && code == LDAP_SUCCESS;
+			tag = ber_next_element (ber, &len, last))
+		{
+			BerValue oid, value;
+			ber_int_t critical = 0;
+			value.bv_val = NULL;
+			value.bv_len = 0;
+			if (ber_scanf (ber, "{m", &oid) == LBER_ERROR
+				|| (ber_peek_tag (ber, &len) == LBER_BOOLEAN && ber_scanf (ber, "b", &critical) == LBER_ERROR)
+				|| (ber_peek_tag (ber, &len) == LBER_OCTETSTRING && ber_scanf (ber, "m", &value) == LBER_ERROR)
+				|| ber_scanf (ber, "}") == LBER_ERROR)
+				code = LDAP_PROTOCOL_ERROR;
+			else if (oid.bv_len == strlen (LDAP_CONTROL_ASSERT)
+				&& memcmp (oid.bv_val, LDAP_CONTROL_ASSERT, oid.bv_len) == 0
+				&& (op == MOCK_OP_COMPARE || op == MOCK_OP_DELETE || op == MOCK_OP_MODIFY
+					|| op == MOCK_OP_RENAME || op == MOCK_OP_SEARCH))
+			{
+				if (ctrls->assertion != NULL || value.bv_val == NULL
+					|| (ctrls->ber = ber_init (&value)) == NULL
+					|| (ctrls->assertion = parse_filter (ctrls->ber)) == NULL)
+					code = LDAP_PROTOCOL_ERROR;
+			} else if (critical)
+				code = LDAP_UNAVAILABLE_CRITICAL_EXTENSION;
+		}
+	}
+	ber_free (ber, 1);
+	return code;
+}
+
+
+/*
+** Process a request.
+** @return 0 or -1 when the connection must be closed.
+*/
+static int process (mock_conn *c, const BerValue *request) {
+	double due = monotonic () + latency;
+	BerElement *ber;
+	mock_controls ctrls;
+	ber_int_t msgid;
+	ber_len_t len;
+	ber_tag_t tag;
+	int op, code, rc;
+
+	ber = ber_init ((BerValue *)request);
+	if (ber == NULL)
+		return -1;
+	if (ber_scanf (ber, "{i", &msgid) == LBER_ERROR) {
+		ber_free (ber, 1);
+		return -1;
+	}
+	tag = ber_peek_tag (ber, &len);
+	switch (tag) {
+		case LDAP_REQ_ABANDON: rc = do_abandon (c, ber); ber_free (ber, 1); return rc;
+		case LDAP_REQ_ADD: op = MOCK_OP_ADD; break;
+		case LDAP_REQ_BIND: op = MOCK_OP_BIND; break;
+		case LDAP_REQ_COMPARE: op = MOCK_OP_COMPARE; break;
+		case LDAP_REQ_DELETE: op = MOCK_OP_DELETE; break;
+		case LDAP_REQ_EXTENDED: op = MOCK_OP_EXTENDED; break;
+		case LDAP_REQ_MODIFY: op = MOCK_OP_MODIFY; break;
+		case LDAP_REQ_MODDN: op = MOCK_OP_RENAME; break;
+		case LDAP_REQ_SEARCH: op = MOCK_OP_SEARCH; break;
+		default: ber_free (ber, 1); return -1; /* unbind or unknown */
+	}
+	if (scripted (op, &code)) {
+		ber_free (ber, 1);
+		if (code < 0)
+			return -1;
+		respond_result (c, msgid, due, op_results[op], code, "scripted error", NULL);
+		return 0;
+	}
+	ctrls.ber = NULL;
+	ctrls.assertion = NULL;
+	code = parse_controls (request, op, &ctrls);
+	if (code != LDAP_SUCCESS) {
+		respond_result (c, msgid, due, op_results[op], code, "unsupported control", NULL);
+		rc = 0;
+	} else switch (op) {
+		case MOCK_OP_ADD: rc = do_add (c, msgid, due, ber); break;
+		case MOCK_OP_BIND: rc = do_bind (c, msgid, due, ber); break;
+		case MOCK_OP_COMPARE: rc = do_compare (c, msgid, due, ber, ctrls.assertion); break;
+		case MOCK_OP_DELETE: rc = do_delete (c, msgid, due, ber, ctrls.assertion); break;
+		case MOCK_OP_EXTENDED: rc = do_extended (c, msgid, due, ber); break;
+		case MOCK_OP_MODIFY: rc = do_modify (c, msgid, due, ber, ctrls.assertion); break;
+		case MOCK_OP_RENAME: rc = do_rename (c, msgid, due, ber, ctrls.assertion); break;
+		default: rc = do_search (c, msgid, due, ber, ctrls.assertion); break;
+	}
+	free_filter (ctrls.assertion);
+	if (ctrls.ber != NULL)
+		ber_free (ctrls.ber, 1);
+	ber_free (ber, 1);
+	return rc;
+}
+
+
+/*
+** Get the size of the first request of the buffer.
+** @return Size of the request, 0 when it is not complete yet or -1 when
+**	the bytes are not an LDAP message.
+*/
+static long request_size (const char *buf, size_t avail) {
+	const unsigned char *p = (const unsigned char *)buf;
+	size_t head, size;
+	if (avail < 2)
+		return 0;
+	if (p[0] != LDAP_TAG_MESSAGE)
+		return -1;
+	if (p[1] < 0x80) {
+		head = 2;
+		size = p[1];
+	} else {
+		size_t i, n = p[1] & 0x7f;
+		if (n == 0 || n > 4)
+			return -1;
+		if (avail < 2 + n)
+			return 0;
+		head = 2 + n;
+		size = 0;
+		for (i = 0; i < n; i++)
+			size = (size << 8) | p[2 + i];
+	}
+	if (size > MOCK_MAX_MESSAGE)
+		return -1;
+	return avail < head + size ? 0 : (long)(head + size);
+}
+
+
+static void conn_close (mock_conn *c) {
+	while (c->head != NULL) {
+		mock_response *r = c->head;
+		c->head = r->next;
+		free (r->data);
+		free (r);
+	}
+	c->tail = NULL;
+	free (c->in);
+	free (c->bound);
+	c->in = c->bound = NULL;
+	close (c->fd);
+	c->fd = -1;
+}
+
+
+/*
+** Read and process the requests received on a connection.
+*/
+static void conn_read (mock_conn *c) {
+	size_t first = 0;
+	ssize_t n;
+	if (c->insize - c->inlen < 65536) {
+		c->insize = c->insize > 0 ? 2 * c->insize : 131072;
+		c->in = (char *)xrealloc (c->in, c->insize);
+	}
+	n = recv (c->fd, c->in + c->inlen, c->insize - c->inlen, 0);
+	if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR)) {
+		conn_close (c);
+		return;
+	}
+	if (n < 0)
+		return;
+	c->inlen += n;
+	for (;;) {
+		long size = request_size (c->in + first, c->inlen - first);
+		BerValue bv;
+		if (size == 0)
+			break;
+		if (size < 0) {
+			conn_close (c);
+			return;
+		}
+		bv.bv_val = c->in + first;
+		bv.bv_len = (ber_len_t)size;
+		if (process (c, &bv) == -1) {
+			conn_close (c);
+			return;
+		}
+		first += size;
+	}
+	memmove (c->in, c->in + first, c->inlen - first);
+	c->inlen -= first;
+}
+
+
+/*
+** Send the responses which are due.
+*/
+static void conn_write (mock_conn *c, double now) {
+	while (c->head != NULL && c->head->due <= now) {
+		mock_response *r = c->head;
+		ssize_t n = send (c->fd, r->data + r->off, r->len - r->off, 0);
+		if (n < 0) {
+			if (errno != EAGAIN && errno != EINTR)
+				conn_close (c);
+			return;
+		}
+		r->off += n;
+		if (r->off < r->len)
+			return;
+		c->head = r->next;
+		if (c->head == NULL)
+			c->tail = NULL;
+		free (r->data);
+		free (r);
+	}
+}
+
+
+/*
+** Decode the %XX sequences of the path of a local socket.
+*/
+static void unescape (char *s) {
+	char *d = s;
+	for (; *s != '\0'; s++) {
+		if (s[0] == '%' && isxdigit ((unsigned char)s[1]) && isxdigit ((unsigned char)s[2])) {
+			char hex[3] = { s[1], s[2], '\0' };
+			*d++ = (char)strtol (hex, NULL, 16);
+			s += 2;
+		} else
+			*d++ = *s;
+	}
+	*d = '\0';
+}
+
+
+/*
+** Open the listening socket of the URI (ldap://host:port/ or
+** ldapi://escaped-path).
+*/
+static int listen_uri (const char *uri) {
+	char buf[1024];
+	char *host, *port, *end;
+	struct addrinfo hints, *res, *ai;
+	int fd = -1, on = 1;
+
+	if (strncmp (uri, "ldapi://", 8) == 0) {
+		struct sockaddr_un sun;
+		snprintf (buf, sizeof (buf), "%s", uri + 8);
+		end = strchr (buf, '/');
+		if (end != NULL)
+			*end = '\0';
+		unescape (buf);
+		if (strlen (buf) >= sizeof (sun.sun_path))
+			return -1;
+		memset (&sun, 0, sizeof (sun));
+		sun.sun_family = AF_UNIX;
+		strcpy (sun.sun_path, buf);
+		unlink (buf);
+		fd = socket (AF_UNIX, SOCK_STREAM, 0);
+		if (fd < 0 || bind (fd, (struct sockaddr *)&sun, sizeof (sun)) < 0 || listen (fd, 128) < 0)
+			return -1;
+		return fd;
+	}
+	if (strncmp (uri, "ldap://", 7) != 0)
+		return -1;
+	snprintf (buf, sizeof (buf), "%s", uri + 7);
+	end = strchr (buf, '/');
+	if (end != NULL)
+		*end = '\0';
+	host = buf;
+	port = strrchr (buf, ':');
+	if (port != NULL)
+		*port++ = '\0';
+	memset (&hints, 0, sizeof (hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_PASSIVE;
+	if (getaddrinfo (*host != '\0' ? host : NULL, port != NULL ? port : "389", &hints, &res) != 0)
+		return -1;
+	for (ai = res; ai != NULL; ai = ai->ai_next) {
+		fd = socket (ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+		if (fd < 0)
+			continue;
+		setsockopt (fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof (on));
+		if (bind (fd, ai->ai_addr, ai->ai_addrlen) == 0 && listen (fd, 128) == 0)
+			break;
+		close (fd);
+		fd = -1;
+	}
+	freeaddrinfo (res);
+	return fd;
+}
+
+
+/*
+** Parse a scripted error: op:code[:every], where code is a result code
+** or "close".
+*/
+static int parse_error (const char *s) {
+	char op[32];
+	const char *colon = strchr (s, ':');
+	int i;
+	if (colon == NULL || colon - s >= (long)sizeof (op) || nerrors == MOCK_MAX_ERRORS)
+		return -1;
+	memcpy (op, s, colon - s);
+	op[colon - s] = '\0';
+	for (i = 0; i < MOCK_NOPS; i++)
+		if (strcmp (op, op_names[i]) == 0)
+			break;
+	if (i == MOCK_NOPS)
+		return -1;
+	errors[nerrors].op = i;
+	errors[nerrors].code = strncmp (colon + 1, "close", 5) == 0 ? -1 : atoi (colon + 1);
+	colon = strchr (colon + 1, ':');
+	errors[nerrors].every = colon != NULL ? strtoul (colon + 1, NULL, 10) : 1;
+	if (errors[nerrors].every == 0)
+		return -1;
+	nerrors++;
+	return 0;
+}
+
+
+static void usage (void) {
+	fprintf (stderr,
+		"usage: mockldap [-f] [-H uri] [-P pidfile] [-b base] [-D binddn] [-w password]\n"
+		"                [-n entries] [-a attributes] [-v values] [-s size]\n"
+		"                [-i ldif] [-l latency_ms] [-e op:code[:every]]...\n");
+	exit (2);
+}
+
+
+int main (int argc, char *argv[]) {
+	const char *uri = MOCK_DEFAULT_URI;
+	const char *pidfile = NULL;
+	const char *ldif = NULL;
+	int count = 100, nattrs = 4, nvalues = 1, size = 32;
+	int foreground = 0;
+	int opt, lfd, i;
+	char buf[1024];
+	struct pollfd fds[MOCK_MAX_CONNECTIONS + 1];
+
+	while ((opt = getopt (argc, argv, "fH:P:b:D:w:n:a:v:s:i:l:e:")) != -1) {
+		switch (opt) {
+			case 'f': foreground = 1; break;
+			case 'H': uri = optarg; break;
+			case 'P': pidfile = optarg; break;
+			case 'b': base = optarg; break;
+			case 'D': manager = optarg; break;
+			case 'w': password = optarg; break;
+			case 'n': count = atoi (optarg); break;
+			case 'a': nattrs = atoi (optarg); break;
+			case 'v': nvalues = atoi (optarg); break;
+			case 's': size = atoi (optarg); break;
+			case 'i': ldif = optarg; break;
+			case 'l': latency = atof (optarg) / 1000.0; break;
+			case 'e':
+				if (parse_error (optarg) == -1)
+					usage ();
+				break;
+			default: usage ();
+		}
+	}
+	if (count < 0 || nattrs < 0 || nvalues < 0 || size < 0 || latency < 0.0)
+		usage ();
+	if (manager == NULL) {
+		snprintf (buf, sizeof (buf), "cn=Manager,%s", base);
+		manager = buf;
+	}
+
+	signal (SIGPIPE, SIG_IGN);
+	lfd = listen_uri (uri);
+	if (lfd < 0) {
+		fprintf (stderr, "mockldap: cannot listen on %s: %s\n", uri, strerror (errno));
+		return 1;
+	}
+	fcntl (lfd, F_SETFL, fcntl (lfd, F_GETFL) | O_NONBLOCK);
+	generate (count, nattrs, nvalues, size);
+	if (ldif != NULL && load_ldif (ldif) == -1)
+		return 1;
+
+	if (!foreground) {
+		pid_t pid = fork ();
+		if (pid < 0)
+			return 1;
+		if (pid > 0) { /* the socket is ready when the parent exits */
+			if (pidfile != NULL) {
+				FILE *f = fopen (pidfile, "w");
+				if (f != NULL) {
+					fprintf (f, "%ld\n", (long)pid);
+					fclose (f);
+				}
+			}
+			return 0;
+		}
+		setsid ();
+		i = open ("/dev/null", O_RDWR);
+		if (i >= 0) {
+			dup2 (i, 0);
+			dup2 (i, 1);
+			dup2 (i, 2);
+			if (i > 2)
+				close (i);
+		}
+	}
+
+	for (;;) {
+		double now = monotonic (), next = -1.0;
+		int timeout = -1, n = 0;
+
+		fds[n].fd = lfd;
+		fds[n].events = nconns < MOCK_MAX_CONNECTIONS ? POLLIN : 0;
+		n++;
+		for (i = 0; i < nconns; i++) {
+			mock_conn *c = &conns[i];
+			fds[n].fd = c->fd;
+			fds[n].events = POLLIN;
+			if (c->head != NULL) {
+				if (c->head->due <= now)
+					fds[n].events |= POLLOUT;
+				else if (next < 0.0 || c->head->due < next)
+					next = c->head->due;
+			}
+			n++;
+		}
+		if (next >= 0.0)
+			timeout = (int)((next - now) * 1000.0) + 1;
+		if (poll (fds, n, timeout) < 0 && errno != EINTR)
+			return 1;
+
+		if (fds[0].revents & POLLIN) {
+			int fd = accept (lfd, NULL, NULL);
+			if (fd >= 0) {
+				mock_conn *c = &conns[nconns++];
+				int on = 1;
+				fcntl (fd, F_SETFL, fcntl (fd, F_GETFL) | O_NONBLOCK);
+				/* pipelined responses must not wait for the acknowledgement of the previous ones (fails on local sockets) */
+				setsockopt (fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof (on));
+				memset (c, 0, sizeof (mock_conn));
+				c->fd = fd;
+			}
+		}
+		now = monotonic ();
+		for (i = 1; i < n; i++) {
+			mock_conn *c = &conns[i - 1];
+			if (c->fd >= 0 && (fds[i].revents & (POLLIN | POLLHUP | POLLERR)))
+				conn_read (c);
+			if (c->fd >= 0)
+				conn_write (c, now);
+		}
+		for (i = 0; i < nconns; ) { /* forget the closed connections */
+			if (conns[i].fd < 0)
+				conns[i] = conns[--nconns];
+			else
+				i++;
+		}
+	}
+}
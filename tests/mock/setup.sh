@@ -0,0 +1,19 @@
+#!/bin/sh
+set -ex
+
+d=$(readlink -f "$(dirname $0)")
+. $d/test.env
+
+test -x "$d/mockldap" \
+	|| make -C "$d/../.." mock
+
+if test -f "$d/mockldap.pid"; then
+	kill "$(cat "$d/mockldap.pid")" || true
+	rm -f "$d/mockldap.pid"
+fi
+
+# the entries of the tests are the ones loaded into slapd by tests/openshift/setup.sh
+# extra arguments are given to the server, e.g. -n 10000 -a 8 -s 256 -l 2
+"$d/mockldap" -H "$LDAP_URI" -P "$d/mockldap.pid" \
+	-b "$LDAP_BASE_DN" -D "$LDAP_BIND_DN" -w "$LDAP_BIND_PASSWORD" \
+	-i "$d/../openshift/test.ldif" "$@"
@@ -14,8 +14,22 @@ end
 
 if not os.getenv('OS') then
     assert(type(m.initialize) == 'function')
+    assert(type(m.shared_pool) == 'function')
+    assert(type(m.tls_context) == 'function')
+    assert(type(m.authenticator) == 'function')
+    assert(type(m.set_debug) == 'function')
+    assert(type(m.flush_debug) == 'function')
+
+    local codec = require'lualdap.codec'
+    assert(type(codec.search) == 'function')
+    local decoder = codec.decoder()
+    decoder:feed'\48\12\2\1\1\107\7\10\1\0\4\0\4\0'
+    assert(decoder:next().type == 'delete')
 end
 assert(type(m.open) == 'function')
 assert(type(m.open_simple) == 'function')
+assert(type(m.pool) == 'function')
+assert(type(m.router) == 'function')
+assert(type(m.metrics_text) == 'function')
 
 print'PASS'